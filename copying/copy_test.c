@@ -0,0 +1,430 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "gc_copy.h"
+
+#define ASSERT(EXPECTED, RESULT)\
+  if(EXPECTED != RESULT) { printf("\n%-30s failure on line %d; expecting %d found %d\n", \
+        __func__, __LINE__, EXPECTED, RESULT); }
+#define STR_ASSERT(EXPECTED, RESULT)\
+  if(strcmp(EXPECTED,RESULT)!=0) { printf("\n%-30s failure on line %d; expecting:\n%s\nfound:\n%s\n", \
+        __func__, __LINE__, EXPECTED, RESULT); }
+
+#define TEST(t) printf("TESTING %s\n", #t); t();
+
+#define check(expected) \
+    {\
+    char *found = gc_get_state(); \
+    STR_ASSERT(expected, found);\
+    free(found); \
+    }
+
+typedef struct {
+    heap_object header;
+
+    int userid;
+    int parking_sport;
+    float salary;
+    String *name;
+} User;
+
+typedef struct {
+    heap_object header;
+
+    int ID;
+    String *name;
+    struct Employee *mgr;
+} Employee;
+
+object_metadata User_class = {
+    .name = "User", .size = sizeof(User), .num_fields = 1,
+    .field_offsets = {offsetof(User, name)}
+};
+
+object_metadata Employee_class = {
+    .name = "Employee", .size = sizeof(Employee), .num_fields = 2,
+    .field_offsets = {offsetof(Employee, name), offsetof(Employee, mgr)}
+};
+
+
+void test_empty() {
+    gc_init(1000);
+    ASSERT(0, gc_num_roots());
+    check("next_free=0\n"
+          "objects:\n");
+    gc();
+    check("next_free=0\n"
+          "objects:\n");
+    gc_done();
+}
+
+void test_alloc_str_gc_copies_it() {
+    gc_init(1000);
+    String *a;
+    gc_add_root(a);
+
+    a = gc_alloc_string(10);
+    strcpy(a->str, "hi mom");
+    String *before = a;
+
+    gc();
+
+    check("next_free=32\n"
+          "objects:\n"
+          "  0000:String[16+11]=\"hi mom\"\n");
+    ASSERT(1, (int)(a != before)); // now in the other semispace
+
+    gc_done();
+}
+
+void test_alloc_str_set_null_gc() {
+    gc_init(1000);
+    String *a;
+    gc_add_root(a);
+
+    a = gc_alloc_string(10);
+    strcpy(a->str, "hi mom");
+    a = NULL;
+
+    gc();
+
+    check("next_free=0\n"
+          "objects:\n");
+
+    gc_done();
+}
+
+void test_alloc_2_str_overwrite_first_one_gc() {
+    gc_init(1000);
+    String *a;
+    gc_add_root(a);
+
+    a = gc_alloc_string(10);
+    strcpy(a->str, "hi mom");
+    a = gc_alloc_string(10);
+    strcpy(a->str,"hi dad");
+
+    check("next_free=64\n"  // garbage stays until gc()
+          "objects:\n"
+          "  0000:String[16+11]=\"hi mom\"\n"
+          "  0032:String[16+11]=\"hi dad\"\n");
+
+    gc();
+
+    check("next_free=32\n"
+          "objects:\n"
+          "  0000:String[16+11]=\"hi dad\"\n");
+
+    gc_done();
+}
+
+void test_alloc_user_after_string() {
+    gc_init(1000);
+
+    String * s = gc_alloc_string(20);
+    gc_add_root(s);
+    strcpy(s->str, "parrt");
+
+    User *u = (User *) gc_alloc(&User_class);
+    gc_add_root(u);
+    u->name = s;
+
+    u = NULL; // should free user but NOT string
+
+    gc();
+
+    check("next_free=40\n"
+          "objects:\n"
+          "  0000:String[16+21]=\"parrt\"\n");
+
+    gc_done();
+}
+
+/* Copies come out breadth first from the root, not in allocation order */
+void test_alloc_obj_with_two_ptr_fields() {
+    gc_init(1000);
+
+    Employee *tombu = (Employee *) gc_alloc(&Employee_class);
+    String *s = gc_alloc_string(3);
+    strcpy(s->str, "Tom");
+    tombu->name = s;
+
+    Employee *parrt = (Employee *) gc_alloc(&Employee_class);
+    parrt->name = gc_alloc_string(10);
+    strcpy(parrt->name->str, "Terence");
+    parrt->mgr = (struct Employee *)tombu;
+
+    gc_add_root(parrt); // just one root
+
+    gc();
+
+    check("next_free=120\n"
+          "objects:\n"
+          "  0000:Employee[32]->[32,64]\n"
+          "  0032:String[16+11]=\"Terence\"\n"
+          "  0064:Employee[32]->[96,NULL]\n"
+          "  0096:String[16+4]=\"Tom\"\n");
+
+    gc_done();
+}
+
+void test_mgr_cycle() {
+    gc_init(1000);
+
+    Employee *tombu = (Employee *) gc_alloc(&Employee_class);
+    String *s = gc_alloc_string(3);
+    strcpy(s->str, "Tom");
+    tombu->name = s;
+
+    Employee *parrt = (Employee *) gc_alloc(&Employee_class);
+    parrt->name = gc_alloc_string(10);
+    strcpy(parrt->name->str, "Terence");
+
+    // CYCLE
+    parrt->mgr = (struct Employee *)tombu;
+    tombu->mgr = (struct Employee *)parrt;
+
+    gc_add_root(parrt); // just one root; can it find everyone and not freak out?
+
+    gc();
+
+    check("next_free=120\n"
+          "objects:\n"
+          "  0000:Employee[32]->[32,64]\n"
+          "  0032:String[16+11]=\"Terence\"\n"
+          "  0064:Employee[32]->[96,0]\n"
+          "  0096:String[16+4]=\"Tom\"\n");
+
+    parrt->mgr = NULL;  // can't see tombu from anywhere
+
+    gc();
+
+    check("next_free=64\n"
+          "objects:\n"
+          "  0000:Employee[32]->[32,NULL]\n"
+          "  0032:String[16+11]=\"Terence\"\n");
+
+    gc_done();
+}
+
+static Employee *_e1;
+
+static void f()
+{
+    String *a;
+    Employee *b;
+    gc_begin_func();
+
+    a = gc_alloc_string(10);
+    strcpy(a->str, "parrt");
+    b = (Employee *)gc_alloc(&Employee_class);
+    gc_add_root(a);
+    gc_add_root(b);
+    ASSERT(3, gc_num_roots());
+
+    gc_end_func(); // should deallocate a,b automagically
+}
+
+void test_local_roots_in_called_func() {
+    gc_init(1000);
+
+    // start with a global root
+    _e1 = (Employee *)gc_alloc(&Employee_class);
+    gc_add_root(_e1);
+
+    f();
+    ASSERT(1, gc_num_roots());
+
+    gc();
+
+    check("next_free=32\n"
+          "objects:\n"
+          "  0000:Employee[32]->[NULL,NULL]\n");
+
+    _e1 = NULL;
+    gc();
+    check("next_free=0\n"
+          "objects:\n");
+
+    gc_done();
+}
+
+void test_self_reference() {
+    gc_init(1000);
+    gc_alloc_string(1); // garbage
+    Employee *e = (Employee *) gc_alloc(&Employee_class);
+    e->mgr = (struct Employee *)e; // own boss
+    gc_add_root(e);
+
+    gc();
+
+    check("next_free=32\n"
+          "objects:\n"
+          "  0000:Employee[32]->[NULL,0]\n");
+
+    gc_done();
+}
+
+void test_long_mgr_chain() {
+    int n = 300000; // no recursion or mark stack, so no depth limit
+    gc_init(n * (int)sizeof(Employee) + 1000);
+
+    Employee *boss = NULL;
+    gc_add_root(boss);
+    int i;
+    for (i = 0; i < n; i++) {
+        Employee *e = (Employee *) gc_alloc(&Employee_class);
+        e->ID = i;
+        e->mgr = (struct Employee *)boss;
+        boss = e;
+    }
+    gc();
+    ASSERT(n * (int)sizeof(Employee), (int)gc_heap_highwater());
+
+    Employee *e = boss;
+    for (i = n - 1; i >= 0; i--) {
+        ASSERT(i, e->ID);
+        e = (Employee *)e->mgr;
+    }
+
+    gc_done();
+}
+
+void test_independent_heaps() {
+    gc_init(1000);
+    String *a;
+    gc_add_root(a);
+    a = gc_alloc_string(3);
+    strcpy(a->str, "hi!");
+
+    gc_heap *h = gc_heap_new(1000);
+    Employee *e;
+    gc_heap_add_root(h, e);
+    e = (Employee *) gc_heap_alloc(h, &Employee_class);
+    e->name = gc_heap_alloc_string(h, 3);
+    strcpy(e->name->str, "Tom");
+    gc_heap_alloc_string(h, 10); // garbage
+    gc_heap_collect(h);
+    ASSERT((int)sizeof(Employee) + 24, (int)gc_heap_highwater_of(h));
+    STR_ASSERT("Tom", e->name->str);
+    gc_heap_free(h);
+
+    gc(); // the default heap never saw h's objects
+    check("next_free=24\n"
+          "objects:\n"
+          "  0000:String[16+4]=\"hi!\"\n");
+    gc_done();
+}
+
+#define NUM_MUTATORS	4
+#define TYPE_ROUNDS		50
+
+static uint32_t type_ids[NUM_MUTATORS * TYPE_ROUNDS];
+
+/* Each thread collects a heap of its own, allocating a type no one has
+ * seen before each round, so it registers while the others collect.
+ */
+static void *use_own_heap_with_new_types(void *arg) {
+    int id = (int)(intptr_t)arg;
+    gc_heap *h = gc_heap_new(20000);
+    Employee *boss = NULL;
+    gc_heap_add_root(h, boss);
+    int errors = 0;
+    int round;
+    for (round = 0; round < TYPE_ROUNDS; round++) {
+        object_metadata *m = malloc(sizeof(object_metadata) + 2 * sizeof(int)); // types are never unregistered
+        m->name = "Employee";
+        m->size = sizeof(Employee);
+        m->num_fields = 2;
+        m->type_id = 0;
+        m->field_offsets[0] = offsetof(Employee, name);
+        m->field_offsets[1] = offsetof(Employee, mgr);
+        boss = NULL;
+        int i;
+        for (i = 0; i < 100; i++) {
+            gc_heap_alloc_string(h, 40); // garbage
+            Employee *e = (Employee *) gc_heap_alloc(h, m);
+            e->ID = id * 1000 + i;
+            e->mgr = (struct Employee *)boss;
+            boss = e;
+        }
+        gc_heap_collect(h);
+        if ( gc_heap_highwater_of(h) != 100 * (long)sizeof(Employee) ) errors++;
+        Employee *e = boss;
+        for (i = 99; i >= 0; i--) {
+            if ( e->ID != id * 1000 + i ) errors++;
+            e = (Employee *)e->mgr;
+        }
+        type_ids[id * TYPE_ROUNDS + round] = m->type_id;
+    }
+    gc_heap_free(h);
+    return (void *)(intptr_t)errors;
+}
+
+static int compare_ids(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+void test_register_types_while_others_collect() {
+    pthread_t threads[NUM_MUTATORS];
+    int t;
+    for (t = 0; t < NUM_MUTATORS; t++) {
+        pthread_create(&threads[t], NULL, use_own_heap_with_new_types, (void *)(intptr_t)t);
+    }
+    int errors = 0;
+    for (t = 0; t < NUM_MUTATORS; t++) {
+        void *e;
+        pthread_join(threads[t], &e);
+        errors += (int)(intptr_t)e;
+    }
+    ASSERT(0, errors);
+    qsort(type_ids, NUM_MUTATORS * TYPE_ROUNDS, sizeof(uint32_t), compare_ids);
+    int duplicates = 0;
+    int i;
+    for (i = 1; i < NUM_MUTATORS * TYPE_ROUNDS; i++) {
+        if ( type_ids[i] == type_ids[i - 1] ) duplicates++;
+    }
+    ASSERT(0, duplicates);
+}
+
+void test_big_loop_doesnt_run_out_of_memory() {
+    gc_init(1000);
+
+    Employee *tombu;
+    gc_add_root(tombu);
+
+    int i = 0;
+    while ( i < 10000000 ) {
+        tombu = (Employee *) gc_alloc(&Employee_class);
+        String *s = gc_alloc_string(3);
+        strcpy(s->str, "Tom");
+        tombu->name = s;
+        i++;
+    }
+    STR_ASSERT("Tom", tombu->name->str);
+
+    gc_done();
+}
+
+int main() {
+    TEST(test_empty);
+    TEST(test_alloc_str_gc_copies_it);
+    TEST(test_alloc_str_set_null_gc);
+    TEST(test_alloc_2_str_overwrite_first_one_gc);
+    TEST(test_alloc_user_after_string);
+    TEST(test_alloc_obj_with_two_ptr_fields);
+    TEST(test_mgr_cycle);
+    TEST(test_local_roots_in_called_func);
+    TEST(test_self_reference);
+    TEST(test_long_mgr_chain);
+    TEST(test_independent_heaps);
+    TEST(test_register_types_while_others_collect);
+
+    TEST(test_big_loop_doesnt_run_out_of_memory);
+
+    return 0;
+}
@@ -0,0 +1,357 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "misc.h"
+#include "gc_copy.h"
+
+#define DEBUG 0
+
+_Static_assert(sizeof(void *) == sizeof(uint64_t), "heap_object header and pointers must both be 64 bits");
+
+#define ROOTS_INITIAL_SIZE		32
+
+/* Everything one heap owns; gc_init(), gc() and friends use default_heap */
+struct gc_heap {
+    heap_object ***roots;
+    int num_roots; /* index of next free space in roots for a root */
+    int roots_size; /* how big is roots array */
+
+    /* Two semispaces of heap_size bytes. We bump allocate in the one starting
+     * at start_of_heap; the other is empty except during gc().
+     */
+    int heap_size;
+    uint8_t *start_of_heap;
+    uint8_t *end_of_heap;
+    uint8_t *next_free;
+    uint8_t *other_space;
+    uint8_t *copy_free; // where gc() copies the next live object
+};
+
+static gc_heap *default_heap = NULL;
+
+#define HEADER_TAG		((uint64_t)1)
+#define TYPE_ID_SHIFT	8
+#define TYPE_ID_MASK	0xFFFFFF
+
+/* All registered types, indexed by object_metadata.type_id; shared by all
+ * heaps. Allocation registers a type the first time it sees it, so one
+ * thread may register while another collects. The table is fixed chunks
+ * that never move once allocated, each published with a release store,
+ * and a type's entry is filled in before its type_id is, so obj_type()
+ * needs no lock; type_lock only keeps registrations apart.
+ */
+#define TYPE_CHUNK_LOG2	10
+#define TYPE_CHUNK		(1 << TYPE_CHUNK_LOG2)
+#define NUM_TYPE_CHUNKS	((TYPE_ID_MASK + 1) / TYPE_CHUNK)
+
+static object_metadata **type_chunks[NUM_TYPE_CHUNKS];
+static int num_types = 1; // type_id 0 means not registered yet
+static pthread_mutex_t type_lock = PTHREAD_MUTEX_INITIALIZER;
+#define SIZE_SHIFT		32
+
+static inline uint64_t make_header(uint32_t size, uint32_t type_id) {
+    return ((uint64_t)size << SIZE_SHIFT) | ((uint64_t)type_id << TYPE_ID_SHIFT) | HEADER_TAG;
+}
+
+static inline uint32_t obj_size(heap_object *p) {
+    return (uint32_t)(p->header >> SIZE_SHIFT);
+}
+
+static inline object_metadata *obj_type(heap_object *p) {
+    uint32_t id = (uint32_t)(p->header >> TYPE_ID_SHIFT) & TYPE_ID_MASK;
+    object_metadata **chunk = __atomic_load_n(&type_chunks[id >> TYPE_CHUNK_LOG2], __ATOMIC_ACQUIRE);
+    return chunk[id & (TYPE_CHUNK - 1)];
+}
+
+static heap_object *forward(gc_heap *h, heap_object *p);
+static void forward_slot(gc_heap *h, heap_object **slot);
+static void scan_fields(gc_heap *h, heap_object *p);
+static void *gc_alloc_space(gc_heap *h, size_t size);
+static void *grow_array(void *array, int *size, int initial_size, size_t elem_size);
+static bool gc_in_heap(gc_heap *h, heap_object *p);
+static char *ptr_to_str(gc_heap *h, heap_object *p);
+static unsigned long gc_rel_addr(gc_heap *h, heap_object *p);
+
+gc_heap *gc_heap_new(int size) {
+    gc_heap *h = calloc(1, sizeof(gc_heap));
+    if ( h == NULL ) {
+        fprintf(stderr, "gc: out of memory allocating a heap\n");
+        exit(EXIT_FAILURE);
+    }
+    h->heap_size = size;
+    h->start_of_heap = malloc((size_t)size);
+    h->other_space = malloc((size_t)size);
+    if ( h->start_of_heap == NULL || h->other_space == NULL ) {
+        fprintf(stderr, "gc: out of memory allocating %d byte semispaces\n", size);
+        exit(EXIT_FAILURE);
+    }
+    h->end_of_heap = h->start_of_heap + size;
+    h->next_free = h->start_of_heap;
+    h->num_roots = 0;
+    return h;
+}
+
+void gc_heap_free(gc_heap *h) {
+    free(h->start_of_heap);
+    free(h->other_space);
+    free(h->roots);
+    free(h);
+}
+
+void gc_heap_add_addr_of_root(gc_heap *h, heap_object **p)
+{
+    if ( h->num_roots >= h->roots_size ) {
+        h->roots = grow_array(h->roots, &h->roots_size, ROOTS_INITIAL_SIZE, sizeof(heap_object **));
+    }
+    h->roots[h->num_roots++] = p;
+}
+
+/* Perform a Cheney copying collection. Copy the objects the roots point at
+ * into the other semispace, then scan the copies in order, copying what
+ * their fields point at onto the end. The region between the scan pointer
+ * and copy_free is the breadth-first queue of copied-but-unscanned objects,
+ * so we need no stack and never touch garbage: the cost is proportional to
+ * live data only. Copying an object replaces its old header with the
+ * address of the copy so later pointers to it get the same copy. Then the
+ * semispaces swap roles.
+ */
+void gc_heap_collect(gc_heap *h) {
+    if (DEBUG) printf("gc_copy\n");
+    uint8_t *to_space = h->other_space;
+    h->copy_free = to_space;
+    int i;
+    for (i = 0; i < h->num_roots; i++) {
+        forward_slot(h, h->roots[i]);
+    }
+
+    uint8_t *scan = to_space;
+    while ( scan < h->copy_free ) {
+        heap_object *p = (heap_object *)scan;
+        scan_fields(h, p);
+        scan += obj_size(p);
+    }
+
+    h->other_space = h->start_of_heap;
+    h->start_of_heap = to_space;
+    h->end_of_heap = h->start_of_heap + h->heap_size;
+    h->next_free = h->copy_free;
+}
+
+/* Return p's copy in the other semispace, copying it there if it hasn't been yet */
+static heap_object *forward(gc_heap *h, heap_object *p) {
+    if ( (p->header & HEADER_TAG) == 0 ) return (heap_object *)(uintptr_t)p->header;
+    uint32_t size = obj_size(p);
+    heap_object *copy = (heap_object *)h->copy_free;
+    h->copy_free += size;
+    memcpy(copy, p, size);
+    p->header = (uint64_t)(uintptr_t)copy;
+    if (DEBUG) printf("copy %s@%p to %p\n", obj_type(copy)->name, p, copy);
+    return copy;
+}
+
+static void forward_slot(gc_heap *h, heap_object **slot) {
+    if ( *slot != NULL && gc_in_heap(h, *slot) ) *slot = forward(h, *slot);
+}
+
+static void scan_fields(gc_heap *h, heap_object *p) {
+    object_metadata *metaclass = obj_type(p);
+    int f;
+    for (f = 0; f < metaclass->num_fields; f++) {
+        forward_slot(h, (heap_object **)((uint8_t *)p + metaclass->field_offsets[f]));
+    }
+}
+
+object_metadata String_metaclass = {.name = "String", .size = sizeof(String), .num_fields = 0};
+
+heap_object *gc_heap_alloc(gc_heap *h, object_metadata *metaclass) {
+    size_t size = align_to_word_boundary((size_t)metaclass->size);
+    heap_object *p = gc_alloc_space(h, size);
+    if ( p==NULL ) return NULL;
+
+    memset(p, 0, size);
+    p->header = make_header((uint32_t)size, gc_register_type(metaclass));
+    return p;
+}
+
+String *gc_heap_alloc_string(gc_heap *h, int size) {
+    String *s;
+    /* size for struct String, the String itself, and null char */
+    size_t n = align_to_word_boundary(sizeof (String) + size + 1);
+    s = (String *) gc_alloc_space(h, n);
+    if ( s==NULL ) return NULL;
+    memset(s, 0, n);
+    s->header.header = make_header((uint32_t)n, gc_register_type(&String_metaclass));
+    s->length = size;
+    return s;
+}
+
+uint32_t gc_register_type(object_metadata *metaclass) {
+    uint32_t id = __atomic_load_n(&metaclass->type_id, __ATOMIC_ACQUIRE);
+    if ( id != 0 ) return id;
+
+    pthread_mutex_lock(&type_lock);
+    if ( metaclass->type_id != 0 ) { // another thread beat us to it
+        pthread_mutex_unlock(&type_lock);
+        return metaclass->type_id;
+    }
+    int f;
+    for (f = 0; f < metaclass->num_fields; f++) {
+        int offset = metaclass->field_offsets[f];
+        if ( offset % WORD_SIZE_IN_BYTES != 0 || offset < (int)sizeof(heap_object) ||
+             offset + (int)sizeof(heap_object *) > metaclass->size ) {
+            fprintf(stderr, "gc: %s field offset %d isn't a word aligned slot in the instance\n",
+                    metaclass->name, offset);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if ( num_types > TYPE_ID_MASK ) {
+        fprintf(stderr, "gc: too many types to register %s\n", metaclass->name);
+        exit(EXIT_FAILURE);
+    }
+    object_metadata **chunk = type_chunks[num_types >> TYPE_CHUNK_LOG2];
+    if ( chunk == NULL ) {
+        chunk = calloc(TYPE_CHUNK, sizeof(object_metadata *));
+        if ( chunk == NULL ) {
+            fprintf(stderr, "gc: out of memory registering %s\n", metaclass->name);
+            exit(EXIT_FAILURE);
+        }
+        __atomic_store_n(&type_chunks[num_types >> TYPE_CHUNK_LOG2], chunk, __ATOMIC_RELEASE);
+    }
+    chunk[num_types & (TYPE_CHUNK - 1)] = metaclass;
+    id = (uint32_t)num_types++;
+    __atomic_store_n(&metaclass->type_id, id, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&type_lock);
+    return id;
+}
+
+int gc_heap_num_roots(gc_heap *h) {
+    return h->num_roots;
+}
+
+void gc_heap_set_num_roots(gc_heap *h, int roots)
+{
+    h->num_roots = roots;
+}
+
+long gc_heap_highwater_of(gc_heap *h) {
+    return h->next_free - h->start_of_heap;
+}
+
+/* Objects in the current semispace in address order. Right after gc()
+ * those are exactly the live objects.
+ */
+char *gc_heap_get_state(gc_heap *h) {
+    charbuf state = charbuf_new(1000);
+    char buf[1000];
+    sprintf(buf, "next_free=%ld\n", gc_rel_addr(h, (heap_object *) h->next_free));
+    charbuf_add_str(&state, buf);
+    sprintf(buf, "objects:\n");
+    charbuf_add_str(&state, buf);
+    uint8_t *q;
+    for (q = h->start_of_heap; q < h->next_free; q += obj_size((heap_object *)q)) {
+        heap_object *p = (heap_object *)q;
+        charbuf_add_str(&state, "  ");
+        char *s = ptr_to_str(h, p);
+        charbuf_add_str(&state, s);
+        free(s);
+        object_metadata *metaclass = obj_type(p);
+        if ( metaclass->num_fields>0 ) {
+            charbuf_add_str(&state, "->[");
+            int i;
+            for (i = 0; i < metaclass->num_fields; i++) {
+                heap_object *target_obj = *(heap_object **)((uint8_t *)p + metaclass->field_offsets[i]);
+                if ( i>0 ) charbuf_add(&state, ',');
+                if ( target_obj!=NULL ) {
+                    sprintf(buf, "%ld", gc_rel_addr(h, target_obj));
+                    charbuf_add_str(&state, buf);
+                }
+                else {
+                    charbuf_add_str(&state, "NULL");
+                }
+            }
+            charbuf_add_str(&state, "]");
+        }
+        charbuf_add(&state, '\n');
+    }
+    char *s = charbuf_to_str(state);
+    charbuf_free(state);
+    return s;
+}
+
+// the original single heap API, on default_heap
+
+void gc_init(int size) {
+    default_heap = gc_heap_new(size);
+}
+
+void gc_done() {
+    gc_heap_free(default_heap);
+    default_heap = NULL;
+}
+
+void gc() { gc_heap_collect(default_heap); }
+
+heap_object *gc_alloc(object_metadata *metaclass) { return gc_heap_alloc(default_heap, metaclass); }
+
+String *gc_alloc_string(int size) { return gc_heap_alloc_string(default_heap, size); }
+
+void gc_add_addr_of_root(heap_object **p) { gc_heap_add_addr_of_root(default_heap, p); }
+
+int gc_num_roots() { return gc_heap_num_roots(default_heap); }
+
+void gc_set_num_roots(int roots) { gc_heap_set_num_roots(default_heap, roots); }
+
+long gc_heap_highwater() { return gc_heap_highwater_of(default_heap); }
+
+char *gc_get_state() { return gc_heap_get_state(default_heap); }
+
+/** Allocate size bytes in the heap; if full, gc() */
+static void *gc_alloc_space(gc_heap *h, size_t size) {
+    if (h->next_free + size > h->end_of_heap) {
+        gc_heap_collect(h); // try to collect
+        if (h->next_free + size > h->end_of_heap) { // try again
+            return NULL;                      // oh well, no room. puke
+        }
+    }
+
+    void *p = h->next_free;
+    h->next_free += size;
+    return p;
+}
+
+/* Double the capacity of array (initial_size if empty), updating *size.
+ * Running out of memory for collector bookkeeping is fatal.
+ */
+static void *grow_array(void *array, int *size, int initial_size, size_t elem_size) {
+    int n = *size == 0 ? initial_size : *size * 2;
+    void *bigger = realloc(array, n * elem_size);
+    if ( bigger == NULL ) {
+        fprintf(stderr, "gc: out of memory growing internal array to %d elements\n", n);
+        exit(EXIT_FAILURE);
+    }
+    *size = n;
+    return bigger;
+}
+
+static bool gc_in_heap(gc_heap *h, heap_object *p) {
+    return (uint8_t *)p >= h->start_of_heap && (uint8_t *)p < h->end_of_heap;
+}
+
+static char *ptr_to_str(gc_heap *h, heap_object *p) {
+    char *buf = malloc(200);
+    if (obj_type(p) == &String_metaclass) {
+        String *s = (String *) p;
+        sprintf(buf, "%04ld:String[%ld+%d]=\"%s\"",
+                gc_rel_addr(h, p), sizeof (String), s->length + 1, s->str);
+    }
+    else {
+        sprintf(buf, "%04ld:%s[%d]", gc_rel_addr(h, p), obj_type(p)->name, obj_size(p));
+    }
+    return buf;
+}
+
+static unsigned long gc_rel_addr(gc_heap *h, heap_object *p) {
+    if ( p==NULL ) return 0;
+    return (unsigned long)((uint8_t *)p - h->start_of_heap);
+}
@@ -0,0 +1,130 @@
+#ifndef GC_COPY_H_
+#define GC_COPY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Describes the layout of one type of heap object; one instance per type */
+typedef struct {
+	const char *name;		// "Employee"
+	int size;				// size in bytes of an instance, including heap_object header
+	int num_fields;			// how many managed pointer fields in an instance
+	uint32_t type_id;		// index into the collector's type table; 0 until registered
+	int field_offsets[];	// byte offset of each managed pointer field from start of object
+} object_metadata;
+
+/* One word at the start of every instance in the heap:
+ *
+ *   63           32 31          8 7     1  0
+ *  +---------------+-------------+-------+---+
+ *  | size in bytes | type_id     | flags | 1 |
+ *  +---------------+-------------+-------+---+
+ *
+ * size includes the header and is word aligned. type_id indexes the type
+ * table of object_metadata. Bit 0 is always set so a header can never be
+ * mistaken for a (word aligned) pointer; gc() replaces the header of each
+ * object it has copied with the address of the copy.
+ */
+typedef struct _heap_object {
+	uint64_t header;
+#ifndef __cplusplus // C++ can't embed a struct ending in a flexible array
+	unsigned char mem[]; // nothing allocated; just a label to location of actual instance data
+#endif
+} heap_object;
+
+typedef struct {
+	heap_object header;
+	int length;				// number of chars, not counting the terminating '\0'
+	char str[];
+} String;
+
+extern object_metadata String_metaclass;
+
+// GC interface
+
+/* Initialize two semispaces of size bytes each for use with the garbage
+ * collector. Objects are allocated in one; gc() copies the live ones into
+ * the other and swaps them.
+ */
+extern void gc_init(int size);
+
+/* Announce you are done with the heap managed by the garbage collector */
+extern void gc_done();
+
+/* Perform a copying garbage collection, moving all live objects to the
+ * start of the other semispace in breadth-first order.
+ */
+extern void gc();
+
+/* Add a type to the collector's type table and return its type_id.
+ * Registering again is a no-op and gc_alloc() registers types it hasn't
+ * seen, so calling this is optional.
+ */
+extern uint32_t gc_register_type(object_metadata *metaclass);
+extern heap_object *gc_alloc(object_metadata *metaclass);
+extern String *gc_alloc_string(int size);
+extern void gc_add_addr_of_root(heap_object **p);
+
+#define gc_begin_func()		int __save = gc_num_roots()
+#define gc_end_func()		gc_set_num_roots(__save)
+#define gc_add_root(p)		gc_add_addr_of_root((heap_object **)&(p));
+
+/* An independent heap. The calls above work on a default heap made by
+ * gc_init(); gc_heap_xxx(h, ...) do the same on heap h. Heaps share only
+ * the type table, which a collection reads without locking, so threads can
+ * each use and collect their own heap without synchronizing.
+ */
+typedef struct gc_heap gc_heap;
+
+extern gc_heap *gc_heap_new(int size);
+extern void gc_heap_free(gc_heap *h);
+extern void gc_heap_collect(gc_heap *h);
+extern heap_object *gc_heap_alloc(gc_heap *h, object_metadata *metaclass);
+extern String *gc_heap_alloc_string(gc_heap *h, int size);
+extern void gc_heap_add_addr_of_root(gc_heap *h, heap_object **p);
+extern int gc_heap_num_roots(gc_heap *h);
+extern void gc_heap_set_num_roots(gc_heap *h, int roots);
+extern char *gc_heap_get_state(gc_heap *h);
+extern long gc_heap_highwater_of(gc_heap *h);
+
+#define gc_heap_begin_func(h)	int __save = gc_heap_num_roots(h)
+#define gc_heap_end_func(h)		gc_heap_set_num_roots(h, __save)
+#define gc_heap_add_root(h, p)	gc_heap_add_addr_of_root(h, (heap_object **)&(p));
+
+// peek into internals for testing and hidden use in macros
+
+extern char *gc_get_state();
+extern long gc_heap_highwater();
+extern int gc_num_roots();
+extern void gc_set_num_roots(int roots);
+
+static const size_t WORD_SIZE_IN_BYTES = sizeof(void *);
+static const size_t ALIGN_MASK = WORD_SIZE_IN_BYTES - 1;
+
+/* Pad size n to include header */
+static inline size_t size_with_header(size_t n) {
+	return n + sizeof(heap_object);
+}
+
+/* Align n to nearest word size boundary (4 or 8) */
+static inline size_t align_to_word_boundary(size_t n) {
+	return (n & ALIGN_MASK) == 0 ? n : (n + WORD_SIZE_IN_BYTES) & ~ALIGN_MASK;
+}
+
+/* Convert a user request for n bytes into a size in bytes that has all necessary
+ * header room and is word aligned.
+ */
+static inline size_t request2size(size_t n) {
+	return align_to_word_boundary(size_with_header(n));
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
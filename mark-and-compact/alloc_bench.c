@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include "gc.h"
+
+/* Allocation throughput versus number of mutator threads. Each thread
+ * allocates short lived nodes, keeping only a short list of the latest
+ * ones, so nearly all the time goes to the allocator and the collections
+ * it triggers. Allocation itself is a TLAB bump; threads only meet when
+ * refilling a TLAB or stopping the world. Scaling is limited by the cores
+ * available; run with nproc >= the largest thread count to see it.
+ */
+
+#define ALLOCS		2000000	// per thread
+#define KEEP		64		// nodes each thread keeps alive
+#define HEAP_SIZE	(32*1024*1024)
+#define REPS		3
+
+typedef struct Node {
+    heap_object header;
+    struct Node *next;
+    long value;
+} Node;
+
+object_metadata Node_class = {
+    .name = "Node", .size = sizeof(Node), .num_fields = 1,
+    .field_offsets = {offsetof(Node, next)}
+};
+
+static double now_ms() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000.0 + t.tv_nsec / 1000000.0;
+}
+
+static void *mutator(void *arg) {
+    (void)arg;
+    gc_register_thread();
+    Node *head = NULL;
+    gc_add_root(head);
+    int len = 0;
+    long i;
+    for (i = 0; i < ALLOCS; i++) {
+        Node *n = (Node *)gc_alloc(&Node_class);
+        n->value = i;
+        n->next = head;
+        head = n;
+        if ( ++len == KEEP ) { head = NULL; len = 0; }
+    }
+    gc_unregister_thread();
+    return NULL;
+}
+
+/* Best wall clock ms of REPS runs of n threads each doing ALLOCS allocations */
+static double run_ms(int n) {
+    double best = 1e30;
+    int r;
+    for (r = 0; r < REPS; r++) {
+        gc_init(HEAP_SIZE);
+        pthread_t threads[8];
+        double t0 = now_ms();
+        int t;
+        for (t = 0; t < n; t++) pthread_create(&threads[t], NULL, mutator, NULL);
+        gc_blocking_begin();
+        for (t = 0; t < n; t++) pthread_join(threads[t], NULL);
+        gc_blocking_end();
+        double ms = now_ms() - t0;
+        if ( ms < best ) best = ms;
+        gc_done();
+    }
+    return best;
+}
+
+int main() {
+    static const int threads[] = {1, 2, 4, 8};
+    printf("%d allocations of %d bytes per thread in a %d MB heap; best of %d\n",
+           ALLOCS, (int)sizeof(Node), HEAP_SIZE / (1024 * 1024), REPS);
+    printf("%8s %10s %14s %8s\n", "threads", "ms", "Mallocs/s", "speedup");
+    double rate1 = 0;
+    int i;
+    for (i = 0; i < (int)(sizeof(threads) / sizeof(threads[0])); i++) {
+        double ms = run_ms(threads[i]);
+        double rate = (double)ALLOCS * threads[i] / ms / 1000.0;
+        if ( i == 0 ) rate1 = rate;
+        printf("%8d %10.2f %14.2f %8.2f\n", threads[i], ms, rate, rate / rate1);
+    }
+    return 0;
+}
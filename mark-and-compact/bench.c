@@ -0,0 +1,143 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include "gc.h"
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/* Small-object workload: a linked list of N nodes with a dead node
+ * allocated between each pair of live ones. We run it with Node, whose
+ * header is the one-word heap_object, and with FatNode, which pads in the
+ * 16 bytes that the old size/marked + metaclass + forwarded header used,
+ * and report heap use, gc() time and time to walk the compacted list.
+ * Cache misses come from perf_event_open() where the kernel allows it;
+ * otherwise run under `perf stat -e cache-misses` to see them.
+ */
+
+#define N		1000000
+#define REPS	5
+
+typedef struct Node {
+    heap_object header;
+    struct Node *next;
+    long value;
+} Node;
+
+typedef struct FatNode {
+    heap_object header;
+    uint8_t old_header[16];
+    struct FatNode *next;
+    long value;
+} FatNode;
+
+object_metadata Node_class = {
+    .name = "Node", .size = sizeof(Node), .num_fields = 1,
+    .field_offsets = {offsetof(Node, next)}
+};
+
+object_metadata FatNode_class = {
+    .name = "FatNode", .size = sizeof(FatNode), .num_fields = 1,
+    .field_offsets = {offsetof(FatNode, next)}
+};
+
+static int miss_counter = -1;
+
+static void open_miss_counter() {
+#if defined(__linux__)
+    struct perf_event_attr pe;
+    memset(&pe, 0, sizeof(pe));
+    pe.type = PERF_TYPE_HARDWARE;
+    pe.size = sizeof(pe);
+    pe.config = PERF_COUNT_HW_CACHE_MISSES;
+    pe.disabled = 1;
+    pe.exclude_kernel = 1;
+    pe.exclude_hv = 1;
+    miss_counter = (int)syscall(__NR_perf_event_open, &pe, 0, -1, -1, 0);
+#endif
+}
+
+static void start_misses() {
+#if defined(__linux__)
+    if ( miss_counter < 0 ) return;
+    ioctl(miss_counter, PERF_EVENT_IOC_RESET, 0);
+    ioctl(miss_counter, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+}
+
+static long long stop_misses() {
+    long long n = -1;
+#if defined(__linux__)
+    if ( miss_counter < 0 ) return -1;
+    ioctl(miss_counter, PERF_EVENT_IOC_DISABLE, 0);
+    if ( read(miss_counter, &n, sizeof(n)) != sizeof(n) ) n = -1;
+#endif
+    return n;
+}
+
+static double now_ms() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000.0 + t.tv_nsec / 1000000.0;
+}
+
+/* Node and FatNode share next/value accessors through these offsets */
+static void run(object_metadata *type, size_t next_offset, size_t value_offset) {
+    double best_gc = 1e30, best_walk = 1e30;
+    long long gc_misses = -1, walk_misses = -1;
+    long live_bytes = 0;
+    int r;
+    for (r = 0; r < REPS; r++) {
+        gc_init(2 * N * type->size + 1000);
+        heap_object *head = NULL;
+        gc_add_root(head);
+        int i;
+        for (i = 0; i < N; i++) {
+            heap_object *p = gc_alloc(type);
+            *(heap_object **)((uint8_t *)p + next_offset) = head;
+            *(long *)((uint8_t *)p + value_offset) = i;
+            head = p;
+            gc_alloc(type); // garbage
+        }
+
+        start_misses();
+        double t0 = now_ms();
+        gc();
+        double t1 = now_ms();
+        long long m = stop_misses();
+        if ( t1 - t0 < best_gc ) { best_gc = t1 - t0; gc_misses = m; }
+        live_bytes = gc_heap_highwater();
+
+        start_misses();
+        t0 = now_ms();
+        long sum = 0;
+        heap_object *p;
+        for (p = head; p != NULL; p = *(heap_object **)((uint8_t *)p + next_offset)) {
+            sum += *(long *)((uint8_t *)p + value_offset);
+        }
+        t1 = now_ms();
+        m = stop_misses();
+        if ( sum != (long)N * (N - 1) / 2 ) printf("bad sum %ld\n", sum);
+        if ( t1 - t0 < best_walk ) { best_walk = t1 - t0; walk_misses = m; }
+
+        gc_done();
+    }
+    printf("%-8s %9d %12ld %9.2f %9.2f %12lld %12lld\n", type->name, type->size,
+           live_bytes, best_gc, best_walk, gc_misses, walk_misses);
+}
+
+int main() {
+    open_miss_counter();
+    printf("%d live + %d dead objects, best of %d; misses -1 if counters unavailable\n", N, N, REPS);
+    printf("%-8s %9s %12s %9s %9s %12s %12s\n",
+           "type", "obj bytes", "live bytes", "gc ms", "walk ms", "gc misses", "walk misses");
+    run(&Node_class, offsetof(Node, next), offsetof(Node, value));
+    run(&FatNode_class, offsetof(FatNode, next), offsetof(FatNode, value));
+    return 0;
+}
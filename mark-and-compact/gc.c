@@ -1,314 +1,2676 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include "misc.h"
 #include "gc.h"
 
 #define DEBUG 0
 
-#define MAX_ROOTS		100
-#define MAX_OBJECTS 	200
+_Static_assert(sizeof(void *) == sizeof(uint64_t), "heap_object header and pointers must both be 64 bits");
 
-static heap_object **_roots[MAX_ROOTS];
-static int num_roots = 0; /* index of next free space in _roots for a root */
+#define ROOTS_INITIAL_SIZE		32
 
-static int heap_size;
-static uint8_t *start_of_heap;
-static uint8_t *end_of_heap;
-static uint8_t *next_free;
+#define MARK_STACK_INITIAL_SIZE	64
+#define MARK_STACK_MAX_SIZE		(1024*1024)
 
-// temp array; result of mark operation
-static heap_object *live_objects[MAX_OBJECTS];
-static int num_live_objects = 0;
+#if defined(__GNUC__)
+#define PREFETCH(p)		__builtin_prefetch(p)
+#else
+#define PREFETCH(p)
+#endif
 
-static void gc_mark_live();
-static void gc_mark_object(heap_object *p);
-static void gc_sweep();
+/* A thread registered to use the heap. Each has its own stack of roots so
+ * gc_begin_func()/gc_end_func() in one thread don't disturb another's.
+ */
+typedef struct gc_mutator {
+    gc_tlab tlab;       // first, so gc_my_tlab also finds the mutator
+    heap_object ***roots;
+    int num_roots;      // index of next free space in roots for a root
+    int roots_size;     // how big is roots array
+    pthread_t thread;
+    struct gc_mutator *next;
+} gc_mutator;
+
+/* Each thread's mutator in the heap it last used. Using another heap
+ * looks up (or registers) the thread's mutator there.
+ */
+GC_THREAD_LOCAL gc_tlab *gc_my_tlab = NULL;
+
+/* TLABs come from next_free with a CAS, or from the nursery under
+ * alloc_lock. Objects too big for a TLAB go straight into the heap.
+ */
+#define TLAB_SIZE			(32*1024)
+#define MAX_TLAB_OBJECT		(TLAB_SIZE / 4)
+
+static pthread_mutex_t type_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The heap gc_init() makes for the API without a gc_heap argument */
+gc_heap *gc_default_heap = NULL;
+
+/* Side mark bitmap: one bit per word-aligned granule of the heap, set for
+ * the granule where a live object starts. Marking touches only this dense
+ * array rather than object headers, unmarking is a memset, and scanning it
+ * yields the live objects in address order.
+ */
+typedef uint64_t bitmap_word;
+#define BITS_PER_BITMAP_WORD	64
+
+/* What the collector needs to trace one type. ptr_map has bit i set if
+ * word i of an instance is a managed pointer, so tracing an object is a
+ * loop over set bits with no per-field metadata lookups. A type with
+ * pointers past its first 64 words also walks field_offsets for those.
+ */
+typedef struct {
+    uint64_t ptr_map;
+    bool has_far_fields;
+    object_metadata *metaclass;
+} type_descriptor;
+
+#define PTR_MAP_WORDS	64
+
+#define TYPE_ID_MASK	0xFFFFFF
+
+/* All registered types, indexed by object_metadata.type_id. Shared by
+ * all heaps and never freed as the metadata outlive any one heap. The
+ * descriptors sit in fixed chunks that never move once allocated, so a
+ * heap can collect while another thread registers a type: each chunk is
+ * published with a release store and a descriptor is filled in before
+ * its type_id is, so obj_desc() needs no lock.
+ */
+#define TYPE_CHUNK_LOG2	10
+#define TYPE_CHUNK		(1 << TYPE_CHUNK_LOG2)
+#define NUM_TYPE_CHUNKS	((TYPE_ID_MASK + 1) / TYPE_CHUNK)
+
+static type_descriptor *type_chunks[NUM_TYPE_CHUNKS];
+static int num_types = 1; // type_id 0 means not registered yet
+
+static inline uint32_t obj_size(heap_object *p) {
+    return (uint32_t)(p->header >> GC_SIZE_SHIFT);
+}
+
+static inline void set_obj_size(heap_object *p, uint32_t size) {
+    p->header = (p->header & 0xFFFFFFFF) | ((uint64_t)size << GC_SIZE_SHIFT);
+}
+
+static inline type_descriptor *obj_desc(heap_object *p) {
+    uint32_t id = (uint32_t)(p->header >> GC_TYPE_ID_SHIFT) & TYPE_ID_MASK;
+    type_descriptor *chunk = __atomic_load_n(&type_chunks[id >> TYPE_CHUNK_LOG2], __ATOMIC_ACQUIRE);
+    return &chunk[id & (TYPE_CHUNK - 1)];
+}
+
+static inline object_metadata *obj_type(heap_object *p) {
+    return obj_desc(p)->metaclass;
+}
+
+/* Apply slot_fn to each managed pointer slot of p, whose descriptor is t */
+#define SCAN_PTR_SLOTS(h, p, t, slot_fn) \
+    { \
+        uint64_t _map = (t)->ptr_map; \
+        while ( _map != 0 ) { \
+            slot_fn(h, (heap_object **)(p) + lowest_set_bit(_map)); \
+            _map &= _map - 1; \
+        } \
+        if ( (t)->has_far_fields ) scan_far_slots(h, (heap_object *)(p), (t)->metaclass, slot_fn); \
+    }
+
+/* Gray objects: marked but whose pointer fields have not been scanned yet.
+ * Grows by doubling up to mark_stack_limit entries; if a push doesn't fit,
+ * the object stays marked but unscanned and we set overflowed so that
+ * gc_mark_live() rescans the heap for such objects instead of failing.
+ */
+typedef struct {
+    heap_object **data;
+    int next;       // next spot to push
+    int size;       // how big is array
+    bool overflowed;
+} mark_stack;
+
+/* GC worker threads. With more than one worker, gc_heap_new() starts
+ * num_workers-1 threads that sleep until gc() hands them a phase to run;
+ * gc()'s own thread is worker 0. Marking and LISP2 compaction run in
+ * parallel; threaded compaction is inherently sequential.
+ *
+ * Parallel marking: each marker owns a Chase-Lev work-stealing deque of gray
+ * objects: it pushes and pops at the bottom, and idle markers steal from
+ * the top of someone else's. Marking an object is an atomic test-and-set
+ * on its bit in mark_bits, so exactly one marker scans each object. A full
+ * deque sets mark_overflowed and we finish with the serial heap rescan.
+ */
+#define MAX_WORKERS			64
+#define MARK_DEQUE_SIZE		(64*1024) // entries; power of 2
+
+/* Parallel compaction divides the heap into regions of REGION_WORDS mark
+ * bitmap words (32K bytes). A region's summary is where its first object
+ * goes, which only needs the live granule counts of the regions below it,
+ * so workers can compute forwarding, fix pointers and slide objects region
+ * by region. Sliding region r overwrites the sources of lower regions, so
+ * it waits until every region from dep up, whose objects overlap r's
+ * destination, has been moved. The more garbage below r, the further down
+ * dep is and the more regions can slide at once.
+ */
+#define REGION_WORDS		64
+#define REGION_BYTES		(REGION_WORDS * BITS_PER_BITMAP_WORD * WORD_SIZE_IN_BYTES)
+#define MIN_PARALLEL_HEAP	(4 * REGION_BYTES) // smaller heaps aren't worth waking workers
+
+typedef struct {
+    uint8_t *first;     // first live object starting in region, or NULL
+    uint8_t *end;       // end of last live object starting in region
+    uint32_t live;      // live granules within region
+    uint32_t base;      // live granules in all regions below
+    size_t dep;         // lowest region we must wait on before sliding
+    bool done;          // objects moved
+} region;
+
+typedef struct {
+    _Alignas(64) long top;  // thieves take from here
+    _Alignas(64) long bottom; // owner pushes and pops here
+    heap_object **buf;
+    int num_live;           // objects this marker marked
+    unsigned seed;          // picks steal victims
+} mark_deque;
+
+typedef struct {
+    gc_heap *heap;
+    int id;
+    pthread_t thread;
+} gc_worker;
+
+static _Thread_local mark_deque *my_deque;
+
+/* Optional nursery. Small objects are bump allocated in a separate block
+ * and gc_minor() copies whatever is reachable into the compacting heap,
+ * Cheney style: the promoted objects are contiguous at the end of the heap,
+ * so we scan them in order for further nursery pointers. A promoted
+ * object's nursery header is overwritten with its new address; GC_HEADER_TAG
+ * tells the two apart.
+ *
+ * Nursery objects reachable only from the heap are found through the card
+ * table: gc_store_ptr() sets the byte for the 512-byte card holding any
+ * field it stores to, and gc_minor() scans the objects overlapping dirty
+ * cards. card_object[c] is the offset of the object covering card c's
+ * first byte, so scanning starts there. Survivors are promoted after one
+ * minor collection, so there are no old-to-young pointers afterwards and
+ * all cards start out clean.
+ */
+#define CARD_SIZE		((size_t)1 << GC_CARD_SHIFT)
+#define MAX_NURSERY_OBJECT_FRACTION	4 // bigger objects go straight to the heap
+
+/* Large object space. An object of large_object_size bytes or more gets
+ * pages of its own, behind a large_object link, instead of a place in the
+ * heap. Marking treats it like any other object, flagging it in the link
+ * since it's outside the mark bitmap; then the dead ones are unmapped and
+ * compaction leaves the live ones where they are, fixing only their
+ * pointer fields. A managed pointer that is in neither the heap nor the
+ * nursery must be to a large object. Without card marking for them,
+ * gc_minor() scans every large object that has pointer fields.
+ * Allocating past large_budget bytes of them triggers a gc().
+ */
+typedef struct large_object {
+    struct large_object *next;
+    size_t mapped;      // bytes mapped, including this link
+    bool marked;
+} large_object; // followed by the object, which is word aligned as the link is
+
+#define DEFAULT_LARGE_OBJECT_SIZE	(64*1024)
+#define MIN_LARGE_OBJECT_SIZE		(TLAB_SIZE + 8) // bigger than any TLAB so gc_alloc() never bumps one there
+#define MIN_LARGE_BUDGET			(4*1024*1024)
+
+/* Atomic space, for objects with no pointer fields from gc_alloc_atomic()
+ * and gc_alloc_string_atomic(). It's a separate reservation carved into
+ * blocks, each holding cells of one size class, with alloc and mark
+ * bitmaps per block on the side. Marking an atomic object just sets its
+ * bit; the object itself is never read, scanned or moved. Sweeping is a
+ * whole block at a time: its mark bitmap becomes its alloc bitmap, and a
+ * block with nothing marked goes back to the OS. Objects too big for the
+ * largest cell come from the heap as usual. Allocating past atomic_budget
+ * blocks triggers a gc().
+ */
+#define ATOMIC_BLOCK_SIZE		(16*1024)
+#define ATOMIC_BITMAP_WORDS		(ATOMIC_BLOCK_SIZE / 16 / BITS_PER_BITMAP_WORD) // 16 byte cells at the smallest
+#define MIN_ATOMIC_RESERVE		(1024*1024)
+#define MIN_ATOMIC_BUDGET		16 // blocks
+
+static const uint32_t atomic_cell_sizes[] = {16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048};
+#define NUM_ATOMIC_CLASSES		((int)(sizeof(atomic_cell_sizes) / sizeof(atomic_cell_sizes[0])))
+
+typedef struct {
+    uint32_t cell_size;     // 0 while the block is unused
+    uint32_t num_cells;
+    bitmap_word alloc[ATOMIC_BITMAP_WORDS];
+    bitmap_word mark[ATOMIC_BITMAP_WORDS];
+} atomic_block;
+
+/* Incremental marking. With a nonzero incremental_budget (and no nursery)
+ * gc()'s marking is spread over the allocations leading up to it instead
+ * of done all at once. Once the heap is past mark_trigger, the next
+ * allocation slow path stops the world, shades the roots gray and sets
+ * pub.marking; from then on each slow path stops the world for a slice
+ * that scans mark_rate bytes of gray objects per byte allocated since the
+ * last slice, or as many as fit in incremental_budget microseconds.
+ * Marking runs ahead of allocation so it's usually done by the time the
+ * heap fills.
+ *
+ * Mutators keep running between slices, so gc_heap_store_ptr() shades the
+ * pointer it stores while pub.marking is set (Dijkstra's insertion
+ * barrier): a black object can't come to point at a white one. Objects
+ * allocated during the cycle are above mark_top and implicitly black, and
+ * so are large and atomic objects, which get their mark when allocated.
+ * Roots have no barrier, so gc() finishes with a remark: shade the roots
+ * again, drain what's gray and set the mark bits of the objects above
+ * mark_top. Compaction is unchanged.
+ */
+#define MARK_SLICE_CHECK	64 // objects scanned between looks at the clock
+
+/* Concurrent marking. With concurrent set (and no nursery) a cycle starts
+ * at the same point, but instead of slices a background marker thread
+ * traces the gray objects while mutators run. The barrier is then
+ * Yuasa's snapshot-at-the-beginning one: gc_heap_store_ptr() shades the
+ * pointer a store overwrites, so everything reachable when the cycle
+ * started gets marked however mutators rearrange the graph, and new
+ * objects are allocated black as above. The marker and the barrier share
+ * the gray stack and mark bitmap under shade_lock, which the marker drops
+ * every MARK_BATCH objects; it reads pointer fields atomically as
+ * mutators may be storing to them. Objects at or above mark_top may be
+ * half built, so the marker never looks inside them. gc() stops the
+ * marker and finishes up with the same remark as incremental marking,
+ * which only finds what's left gray.
+ */
+#define MARK_BATCH			64
+
+/* Settings new heaps start with */
+static int requested_workers = 1;
+static int requested_nursery_size = 0;
+static gc_compaction requested_compaction = GC_COMPACT_LISP2;
+static int requested_mark_stack_limit = MARK_STACK_MAX_SIZE;
+static long requested_max_heap_size = 0; // 0: heaps stay the size gc_heap_new() gives
+static int requested_live_ratio = 50;
+static int requested_large_object_size = DEFAULT_LARGE_OBJECT_SIZE;
+static long requested_incremental_budget = 0;
+static bool requested_concurrent_marking = false;
+
+/* Heap memory is one mmap()ed reservation of max_heap_size bytes of address
+ * space, of which the first heap_size bytes are committed (readable and
+ * writable). After a full collection we commit more or give some back to
+ * keep live data at about live_ratio percent of the heap, and hand the
+ * pages past next_free back to the OS so RSS follows live data rather than
+ * the high water mark. The side tables are calloc()ed for the whole
+ * reservation; pages of them past heap_size are never touched so the OS
+ * never backs them. Sizes stay below 2G as object sizes and card offsets
+ * are 32 bits.
+ */
+#define MAX_HEAP_SIZE	((size_t)INT_MAX + 1 - (1 << 20))
+
+/* Everything about one heap. Heaps share nothing but the type table, so
+ * threads can use and collect separate heaps without synchronizing.
+ */
+struct gc_heap {
+    gc_heap_public pub;     // first; the inline allocator and gc_heap_store_ptr() read it
+
+    /* Stopping the world. A collecting thread sets pub.stop_requested and
+     * waits until every other mutator is counted in num_stopped, either
+     * parked in gc_heap_safepoint_slow() or between gc_heap_blocking_begin/end.
+     * world_changed signals both the collector (another thread stopped)
+     * and the stopped threads (collection over).
+     */
+    gc_mutator *mutators;
+    int num_mutators;
+    int num_stopped;
+    pthread_mutex_t world_lock;
+    pthread_cond_t world_changed;
+    unsigned num_collections;   // lets threads that raced to collect skip a redundant gc
+    pthread_mutex_t alloc_lock;
+
+    /* Roots of all mutators, gathered while the world is stopped */
+    heap_object ***roots;
+    int num_roots;              // index of next free space in roots for a root
+    int roots_size;             // how big is roots array
+
+    int heap_size;
+    uint8_t *start_of_heap;
+    uint8_t *end_of_heap;
+    uint8_t *next_free;
+    size_t min_heap_size;       // what gc_heap_new() was asked for; we never shrink below it
+    size_t max_heap_size;       // largest we may grow; we reserve address space for that much
+    int live_ratio;             // percent of the heap we'd like live data to fill after gc
+
+    bitmap_word *mark_bits;
+    size_t num_mark_words;
+    int num_live_objects;       // result of mark operation
+
+    /* LISP2 forwarding side table, built after marking. live_bits has a bit
+     * set for every granule covered by a live object and block_offset[b]
+     * counts the live granules in all 64-granule blocks before block b.
+     * Compaction keeps live objects in order and packs them tight, so an
+     * object's new address is just the number of live granules below it:
+     * one table lookup plus one popcount within its block.
+     */
+    bitmap_word *live_bits;
+    uint32_t *block_offset;
+
+    mark_stack gray;
+    int mark_stack_limit;
+    gc_compaction compaction;
+
+    int num_workers;
+    mark_deque *deques;
+    gc_worker *workers;         // 1..num_workers-1; gc's own thread is worker 0
+    pthread_mutex_t worker_lock;
+    pthread_cond_t worker_go;
+    pthread_cond_t worker_done;
+    unsigned phase_epoch;       // bumped to start each parallel phase
+    int workers_finished;
+    bool workers_exit;
+    void (*phase)(gc_heap *h, int id); // what workers run when woken
+    int active_markers;         // markers that might still find work
+    bool mark_overflowed;
+    long deque_capacity;
+    region *regions;
+    size_t num_regions;
+    long next_region;           // next region for a worker to claim
+
+    size_t nursery_size;
+    uint8_t *nursery_start;
+    uint8_t *nursery_next;
+    uint32_t *card_object;
+    size_t num_cards;
+
+    large_object *large_objects;
+    size_t large_object_size;   // 0 for no large object space
+    size_t large_bytes;         // mapped for large objects
+    size_t large_budget;
+
+    uint8_t *atomic_start;      // NULL until the first atomic allocation
+    size_t num_atomic_blocks;   // reserved
+    atomic_block *atomic_blocks;
+    size_t atomic_blocks_used;  // those with a cell size
+    size_t atomic_budget;
+    size_t atomic_cursor[NUM_ATOMIC_CLASSES]; // no free cells of the class below this block
+    pthread_mutex_t atomic_lock;
+
+    long incremental_budget;    // microseconds per marking slice; 0 to mark all at once in gc()
+    uint8_t *mark_trigger;      // start marking when next_free gets here
+    uint8_t *mark_top;          // next_free when marking started
+    uint8_t *slice_top;         // next_free at the last slice
+    size_t mark_rate;           // bytes to scan per byte allocated
+    pthread_mutex_t shade_lock; // serializes gc_heap_shade() between mutators and the marker
+
+    bool concurrent;            // a marker thread does the marking
+    pthread_t marker;
+    pthread_mutex_t marker_lock;
+    pthread_cond_t marker_changed;
+    bool marker_running;        // tracing this cycle's gray objects
+    bool marker_stop;           // gc() wants the gray stack back
+    bool marker_exit;
+};
+
+
+static void gc_collect(gc_heap *h);
+static void gc_collect_nursery(gc_heap *h);
+static void stop_the_world(gc_heap *h);
+static void resume_the_world(gc_heap *h);
+static gc_mutator *my_mutator(gc_heap *h);
+static void park_locked(gc_heap *h);
+static void gather_roots(gc_heap *h);
+static void retire_tlab(gc_heap *h, gc_tlab *t);
+static void retire_my_tlab(gc_heap *h);
+static bool refill_tlab(gc_heap *h, size_t size);
+static uint8_t *bump_heap(gc_heap *h, size_t size, size_t *n);
+static uint8_t *bump_nursery(gc_heap *h, size_t size, size_t *n);
+static void *alloc_old(gc_heap *h, size_t size);
+static bool collect_for_alloc(gc_heap *h, unsigned seen, bool young, size_t size);
+static void gc_mark_live(gc_heap *h);
+static uint8_t *gc_compute_forwarding(gc_heap *h);
+static void gc_update_ptrs(gc_heap *h);
+static void gc_slide(gc_heap *h);
+static uint8_t *gc_merge_dead_run(gc_heap *h, heap_object *p);
+static uint8_t *gc_thread_forward_ptrs(gc_heap *h);
+static void gc_thread_backward_ptrs_and_slide(gc_heap *h);
+static void thread_ptr(gc_heap *h, heap_object **ref);
+static void unthread(heap_object *p, uint8_t *addr);
+static void gc_mark_object(gc_heap *h, heap_object *p);
+static void gc_scan_gray(gc_heap *h);
+static void gc_rescan_heap(gc_heap *h);
+static void gc_scan_fields(gc_heap *h, heap_object *p);
+static bool mark_stack_push(gc_heap *h, heap_object *p);
+static void start_workers(gc_heap *h);
+static void stop_workers(gc_heap *h);
+static void *worker_main(void *arg);
+static bool parallel_gc(gc_heap *h);
+static void run_phase(gc_heap *h, void (*phase)(gc_heap *h, int id));
+static void gc_mark_parallel(gc_heap *h);
+static uint8_t *gc_compute_forwarding_parallel(gc_heap *h);
+static void gc_summarize_region(gc_heap *h, int id);
+static void gc_count_region(gc_heap *h, int id);
+static void gc_offset_region(gc_heap *h, int id);
+static void gc_update_ptrs_region(gc_heap *h, int id);
+static void gc_slide_region(gc_heap *h, int id);
+static size_t claim_region(gc_heap *h);
+static uint8_t *region_start(gc_heap *h, size_t r);
+static void set_bit_range_shared(bitmap_word *bits, size_t g, size_t n);
+static void gc_mark_worker(gc_heap *h, int id);
+static void par_mark_object(gc_heap *h, heap_object *p);
+static void par_mark_slot(gc_heap *h, heap_object **slot);
+static bool test_and_set_marked(gc_heap *h, heap_object *p);
+static bool deque_push(gc_heap *h, mark_deque *d, heap_object *p);
+static heap_object *deque_pop(mark_deque *d);
+static heap_object *deque_steal(mark_deque *d);
+static heap_object *steal_gray(gc_heap *h, int id);
+static bool gray_available(gc_heap *h);
+static void *grow_array(void *array, int *size, int initial_size, size_t elem_size);
+static bool is_marked(gc_heap *h, heap_object *p);
+static void set_marked(gc_heap *h, heap_object *p);
+static void clear_marks(gc_heap *h);
+static heap_object *next_marked(gc_heap *h, uint8_t *from);
+static inline size_t granule_of(gc_heap *h, uint8_t *p);
+static inline int popcount(bitmap_word w);
+static void set_bit_range(bitmap_word *bits, size_t g, size_t n);
+static heap_object *forwarding_addr(gc_heap *h, heap_object *p);
+static inline int lowest_set_bit(bitmap_word w);
+static void scan_far_slots(gc_heap *h, heap_object *p, object_metadata *metaclass, void (*slot_fn)(gc_heap *h, heap_object **));
+static void mark_slot(gc_heap *h, heap_object **slot);
+static void forward_slot(gc_heap *h, heap_object **slot);
+static void start_nursery(gc_heap *h);
+static void stop_nursery(gc_heap *h);
+static bool nursery_fits(gc_heap *h, size_t size);
+static bool in_nursery(gc_heap *h, heap_object *p);
+static size_t old_room(gc_heap *h);
+static heap_object *promote(gc_heap *h, heap_object *p);
+static void promote_slot(gc_heap *h, heap_object **slot);
+static void scan_card(gc_heap *h, size_t c, uint8_t *old_end);
+static void note_old_object(gc_heap *h, uint8_t *p, size_t size);
+static void dirty_cards(gc_heap *h, uint8_t *p, size_t size);
+static void rebuild_card_objects(gc_heap *h);
+static size_t page_size();
+static size_t round_to_page(size_t n);
+static size_t mark_words_for(size_t heap_size);
+static size_t cards_for(size_t heap_size);
+static bool set_heap_size(gc_heap *h, size_t size);
+static void resize_heap(gc_heap *h, size_t need);
+static void release_free_pages(gc_heap *h);
+static void *alloc_large(gc_heap *h, size_t size);
+static bool is_large(gc_heap *h, heap_object *p);
+static inline large_object *large_of(heap_object *p);
+static void mark_large_object(gc_heap *h, heap_object *p);
+static void sweep_large_objects(gc_heap *h);
+static void scan_large_objects(gc_heap *h, int id, int n, void (*slot_fn)(gc_heap *h, heap_object **));
+static void free_large_objects(gc_heap *h);
+static void *alloc_atomic(gc_heap *h, size_t size);
+static void reserve_atomic_space(gc_heap *h);
+static uint8_t *atomic_cell(gc_heap *h, int c);
+static inline bool in_atomic_space(gc_heap *h, heap_object *p);
+static bool set_atomic_marked(gc_heap *h, heap_object *p);
+static void sweep_atomic_space(gc_heap *h);
+static void unmark_atomic_space(gc_heap *h);
+static void mark_incrementally(gc_heap *h);
+static void start_marking(gc_heap *h);
+static void mark_slice(gc_heap *h);
+static void finish_marking(gc_heap *h);
+static void set_mark_trigger(gc_heap *h);
+static long long now_usec();
+static void start_marker(gc_heap *h);
+static void stop_marker(gc_heap *h);
+static void *marker_main(void *arg);
+static void mark_concurrently(gc_heap *h);
+static void wait_for_marker(gc_heap *h);
+static void mark_slot_shared(gc_heap *h, heap_object **slot);
+
+static int  gc_object_size(heap_object *p);
+static void *gc_alloc_space(gc_heap *h, size_t size);
+static void gc_dump(gc_heap *h);
+static bool gc_in_heap(gc_heap *h, heap_object *p);
+static char *gc_viz_heap(gc_heap *h);
+static void print_ptr(gc_heap *h, heap_object *p);
+static void print_addr_array(gc_heap *h, heap_object **array, int len);
+static char *long_array_to_str(unsigned long *array, int len);
+static unsigned long gc_rel_addr(gc_heap *h, heap_object *p);
+static void unmark_objects(gc_heap *h);
+static char *ptr_to_str(gc_heap *h, heap_object *p);
+
+/* Make a heap of size bytes with the current gc_set_*() settings and
+ * register the calling thread with it.
+ */
+gc_heap *gc_heap_new(int size) {
+    gc_heap *h = calloc(1, sizeof(gc_heap));
+    if ( h == NULL ) {
+        fprintf(stderr, "gc: out of memory allocating heap\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&h->world_lock, NULL);
+    pthread_cond_init(&h->world_changed, NULL);
+    pthread_mutex_init(&h->alloc_lock, NULL);
+    pthread_mutex_init(&h->worker_lock, NULL);
+    pthread_cond_init(&h->worker_go, NULL);
+    pthread_cond_init(&h->worker_done, NULL);
+    pthread_mutex_init(&h->atomic_lock, NULL);
+    pthread_mutex_init(&h->shade_lock, NULL);
+    h->min_heap_size = size < 0 ? 0 : (size_t)size;
+    if ( h->min_heap_size > MAX_HEAP_SIZE ) h->min_heap_size = MAX_HEAP_SIZE;
+    h->max_heap_size = (size_t)requested_max_heap_size;
+    if ( h->max_heap_size < h->min_heap_size ) h->max_heap_size = h->min_heap_size;
+    if ( h->max_heap_size > MAX_HEAP_SIZE ) h->max_heap_size = MAX_HEAP_SIZE;
+    h->start_of_heap = mmap(NULL, round_to_page(h->max_heap_size), PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if ( h->start_of_heap == MAP_FAILED ) {
+        fprintf(stderr, "gc: can't reserve %zu bytes of address space for the heap\n", h->max_heap_size);
+        exit(EXIT_FAILURE);
+    }
+    h->live_ratio = requested_live_ratio;
+    h->compaction = requested_compaction;
+    h->mark_stack_limit = requested_mark_stack_limit;
+    gc_heap_register_thread(h);
+    size_t max_mark_words = mark_words_for(h->max_heap_size);
+    h->mark_bits = calloc(max_mark_words, sizeof(bitmap_word));
+    h->live_bits = calloc(max_mark_words, sizeof(bitmap_word));
+    h->block_offset = calloc(max_mark_words, sizeof(uint32_t));
+    if ( h->mark_bits == NULL || h->live_bits == NULL || h->block_offset == NULL ) {
+        fprintf(stderr, "gc: out of memory allocating side tables for a %zu byte heap\n", h->max_heap_size);
+        exit(EXIT_FAILURE);
+    }
+    h->next_free = h->start_of_heap;
+    if ( !set_heap_size(h, h->min_heap_size) ) {
+        fprintf(stderr, "gc: out of memory allocating %zu byte heap\n", h->min_heap_size);
+        exit(EXIT_FAILURE);
+    }
+    h->num_workers = requested_workers;
+    if ( h->num_workers > 1 ) start_workers(h);
+    h->nursery_size = (size_t)requested_nursery_size;
+    if ( h->nursery_size > 0 ) start_nursery(h);
+    h->large_object_size = (size_t)requested_large_object_size;
+    h->large_budget = h->min_heap_size > MIN_LARGE_BUDGET ? h->min_heap_size : MIN_LARGE_BUDGET;
+    gc_heap_set_incremental_budget(h, requested_incremental_budget);
+    if ( requested_concurrent_marking && h->nursery_start == NULL ) start_marker(h);
+    set_mark_trigger(h);
+    return h;
+}
+
+/* Throw away h and everything in it. Threads other than the caller must
+ * have unregistered.
+ */
+void gc_heap_free(gc_heap *h) {
+    if ( h->concurrent ) stop_marker(h);
+    if ( h->num_workers > 1 ) stop_workers(h);
+    if ( h->nursery_start != NULL ) stop_nursery(h);
+    if ( gc_my_tlab != NULL && gc_my_tlab->heap == h ) gc_my_tlab = NULL;
+    while ( h->mutators != NULL ) {
+        gc_mutator *m = h->mutators;
+        h->mutators = m->next;
+        free(m->roots);
+        free(m);
+    }
+    munmap(h->start_of_heap, round_to_page(h->max_heap_size));
+    free_large_objects(h);
+    if ( h->atomic_start != NULL ) munmap(h->atomic_start, h->num_atomic_blocks * ATOMIC_BLOCK_SIZE);
+    free(h->atomic_blocks);
+    free(h->gray.data);
+    free(h->roots);
+    free(h->mark_bits);
+    free(h->live_bits);
+    free(h->block_offset);
+    pthread_mutex_destroy(&h->world_lock);
+    pthread_cond_destroy(&h->world_changed);
+    pthread_mutex_destroy(&h->alloc_lock);
+    pthread_mutex_destroy(&h->worker_lock);
+    pthread_cond_destroy(&h->worker_go);
+    pthread_cond_destroy(&h->worker_done);
+    pthread_mutex_destroy(&h->atomic_lock);
+    pthread_mutex_destroy(&h->shade_lock);
+    free(h);
+}
+
+/* Initialize a heap with a certain size for use with the garbage collector */
+void gc_init(int size) {
+    gc_default_heap = gc_heap_new(size);
+}
+
+/* Announce you are done with the heap managed by the garbage collector */
+void gc_done() {
+    gc_heap_free(gc_default_heap);
+    gc_default_heap = NULL;
+}
+
+void gc_heap_add_addr_of_root(gc_heap *h, heap_object **p)
+{
+    gc_mutator *m = my_mutator(h);
+    if ( m->num_roots >= m->roots_size ) {
+        m->roots = grow_array(m->roots, &m->roots_size, ROOTS_INITIAL_SIZE, sizeof(heap_object **));
+    }
+    m->roots[m->num_roots++] = p;
+}
+
+void gc_add_addr_of_root(heap_object **p) {
+    gc_heap_add_addr_of_root(gc_default_heap, p);
+}
+
+void gc_heap_register_thread(gc_heap *h) {
+    gc_mutator *m = calloc(1, sizeof(gc_mutator));
+    if ( m == NULL ) {
+        fprintf(stderr, "gc: out of memory registering thread\n");
+        exit(EXIT_FAILURE);
+    }
+    m->tlab.heap = h;
+    m->thread = pthread_self();
+    pthread_mutex_lock(&h->world_lock);
+    while ( h->pub.stop_requested ) pthread_cond_wait(&h->world_changed, &h->world_lock); // don't join mid-collection
+    m->next = h->mutators;
+    h->mutators = m;
+    h->num_mutators++;
+    pthread_mutex_unlock(&h->world_lock);
+    gc_my_tlab = &m->tlab;
+}
+
+void gc_heap_unregister_thread(gc_heap *h) {
+    gc_mutator *m = my_mutator(h);
+    retire_my_tlab(h);
+    pthread_mutex_lock(&h->world_lock);
+    while ( h->pub.stop_requested ) park_locked(h);
+    gc_mutator **q;
+    for (q = &h->mutators; *q != m; q = &(*q)->next) { }
+    *q = m->next;
+    h->num_mutators--;
+    pthread_cond_broadcast(&h->world_changed); // a collector may be waiting on one fewer thread
+    pthread_mutex_unlock(&h->world_lock);
+    free(m->roots);
+    free(m);
+    gc_my_tlab = NULL;
+}
+
+void gc_register_thread() { gc_heap_register_thread(gc_default_heap); }
+void gc_unregister_thread() { gc_heap_unregister_thread(gc_default_heap); }
+
+void gc_heap_blocking_begin(gc_heap *h) {
+    pthread_mutex_lock(&h->world_lock);
+    h->num_stopped++;
+    pthread_cond_broadcast(&h->world_changed);
+    pthread_mutex_unlock(&h->world_lock);
+}
+
+void gc_heap_blocking_end(gc_heap *h) {
+    pthread_mutex_lock(&h->world_lock);
+    while ( h->pub.stop_requested ) pthread_cond_wait(&h->world_changed, &h->world_lock);
+    h->num_stopped--;
+    pthread_mutex_unlock(&h->world_lock);
+}
+
+void gc_blocking_begin() { gc_heap_blocking_begin(gc_default_heap); }
+void gc_blocking_end() { gc_heap_blocking_end(gc_default_heap); }
+
+void gc_heap_safepoint_slow(gc_heap *h) {
+    pthread_mutex_lock(&h->world_lock);
+    while ( h->pub.stop_requested ) park_locked(h);
+    pthread_mutex_unlock(&h->world_lock);
+}
+
+/* The calling thread's mutator in h. Cached in gc_my_tlab, so this only
+ * searches when the thread switches heaps.
+ */
+static gc_mutator *my_mutator(gc_heap *h) {
+    gc_tlab *t = gc_my_tlab;
+    if ( t != NULL && t->heap == h ) return (gc_mutator *)t;
+    pthread_mutex_lock(&h->world_lock);
+    gc_mutator *m;
+    for (m = h->mutators; m != NULL && !pthread_equal(m->thread, pthread_self()); m = m->next) { }
+    pthread_mutex_unlock(&h->world_lock);
+    if ( m == NULL ) {
+        fprintf(stderr, "gc: thread used a heap it didn't register with\n");
+        exit(EXIT_FAILURE);
+    }
+    gc_my_tlab = &m->tlab;
+    return m;
+}
+
+/* Count ourselves stopped until the collection in progress is over */
+static void park_locked(gc_heap *h) {
+    h->num_stopped++;
+    pthread_cond_broadcast(&h->world_changed);
+    while ( h->pub.stop_requested ) pthread_cond_wait(&h->world_changed, &h->world_lock);
+    h->num_stopped--;
+}
+
+/* Wait for every other mutator to stop, then retire all TLABs, so the heap
+ * is walkable, and gather everyone's roots. If another thread is already
+ * collecting, stop for that one first.
+ */
+static void stop_the_world(gc_heap *h) {
+    pthread_mutex_lock(&h->world_lock);
+    while ( h->pub.stop_requested ) park_locked(h);
+    __atomic_store_n(&h->pub.stop_requested, 1, __ATOMIC_RELEASE);
+    while ( h->num_stopped < h->num_mutators - 1 ) pthread_cond_wait(&h->world_changed, &h->world_lock);
+    pthread_mutex_unlock(&h->world_lock);
+
+    gc_mutator *m;
+    for (m = h->mutators; m != NULL; m = m->next) retire_tlab(h, &m->tlab);
+    gather_roots(h);
+}
+
+static void resume_the_world(gc_heap *h) {
+    pthread_mutex_lock(&h->world_lock);
+    __atomic_store_n(&h->pub.stop_requested, 0, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&h->world_changed);
+    pthread_mutex_unlock(&h->world_lock);
+}
+
+static void gather_roots(gc_heap *h) {
+    h->num_roots = 0;
+    gc_mutator *m;
+    for (m = h->mutators; m != NULL; m = m->next) {
+        int i;
+        for (i = 0; i < m->num_roots; i++) {
+            if ( h->num_roots >= h->roots_size ) {
+                h->roots = grow_array(h->roots, &h->roots_size, ROOTS_INITIAL_SIZE, sizeof(heap_object **));
+            }
+            h->roots[h->num_roots++] = m->roots[i];
+        }
+    }
+}
+
+/* Perform a mark-and-compact garbage collection, moving all live objects
+ * to the start of the heap. Anything that we don't mark is dead. The mark
+ * operation sets a bit in the mark bitmap for each live object. We then
+ * compact LISP2 style: each of the remaining passes is a single low-to-high
+ * walk over the live objects, which is the order we need to compact without
+ * stepping on a live object.
+ *
+ * 1. Walk object graph, marking live objects as with mark-sweep.
+ *
+ * 2. Walk the live objects and build the forwarding side table.
+ *
+ * 3. Alter all roots pointing to live objects to point at forwarding address,
+ *    then walk the heap altering all non-NULL managed pointer fields of
+ *    live objects to point to the forwarding addresses.
+ *
+ * 4. Walk the heap sliding live objects down to their forwarding address.
+ *    Source and destination can overlap so use memmove.
+ *
+ * With GC_COMPACT_THREADED, steps 2-4 are Jonkers' two-pass threaded
+ * compaction instead, which needs no forwarding table. Every slot pointing
+ * at an object is linked into a list (a "thread") rooted in that object's
+ * header word. When the sweep reaches the object we know its new address,
+ * so we walk its thread storing that address into each slot and put the
+ * header back. These passes walk the heap by header size, folding each run
+ * of dead objects into one big dead object so the second pass hops over
+ * garbage in one step.
+ *
+ * 2. Thread the roots. Walk the heap; for each live object, unthread it
+ *    (fixing roots and lower objects that point up at it) and then thread
+ *    its own pointer fields.
+ *
+ * 3. Walk the heap again; for each live object, unthread it (fixing objects
+ *    at the same or higher addresses that point back at it) and slide it down.
+ *
+ * With more than one gc thread, marking and the LISP2 passes run in
+ * parallel; see GC worker threads below.
+ */
+void gc_heap_collect(gc_heap *h) {
+    stop_the_world(h);
+    gc_collect(h);
+    resume_the_world(h);
+}
+
+void gc() {
+    gc_heap_collect(gc_default_heap);
+}
+
+/* gc_heap_collect() once the world is stopped */
+static void gc_collect(gc_heap *h) {
+    if (DEBUG) printf("gc_compact\n");
+    gc_collect_nursery(h); // empty the nursery so only the heap needs compacting
+    if ( h->pub.marking ) finish_marking(h);
+    else gc_mark_live(h); // fills mark_bits
+    sweep_large_objects(h); // so compaction sees only live ones
+    sweep_atomic_space(h);
+
+    uint8_t *to;
+    if ( h->compaction == GC_COMPACT_THREADED ) {
+        to = gc_thread_forward_ptrs(h);
+        gc_thread_backward_ptrs_and_slide(h);
+    }
+    else if ( parallel_gc(h) ) {
+        to = gc_compute_forwarding_parallel(h);
+        run_phase(h, gc_update_ptrs_region);
+        run_phase(h, gc_slide_region);
+    }
+    else {
+        to = gc_compute_forwarding(h);
+        gc_update_ptrs(h);
+        gc_slide(h);
+    }
+
+    h->next_free = to;
+    clear_marks(h);
+    if ( h->nursery_start != NULL ) rebuild_card_objects(h);
+    resize_heap(h, 0);
+    release_free_pages(h);
+    set_mark_trigger(h);
+    __atomic_add_fetch(&h->num_collections, 1, __ATOMIC_RELEASE);
+}
+
+/* Copy nursery objects reachable from roots or dirty cards into the heap,
+ * then everything reachable from those, and reset the nursery. gc_alloc()
+ * keeps enough room free in the heap to promote the whole nursery.
+ */
+void gc_heap_minor(gc_heap *h) {
+    if ( h->nursery_start == NULL ) return;
+    stop_the_world(h);
+    gc_collect_nursery(h);
+    resume_the_world(h);
+}
+
+void gc_minor() {
+    gc_heap_minor(gc_default_heap);
+}
+
+static void gc_collect_nursery(gc_heap *h) {
+    if ( h->nursery_start == NULL ) return;
+    if (DEBUG) printf("gc_minor\n");
+    uint8_t *old_end = h->next_free;
+    int i;
+    for (i = 0; i < h->num_roots; i++) promote_slot(h, h->roots[i]);
+    size_t c;
+    for (c = 0; c < h->num_cards; c++) {
+        if ( h->pub.cards[c] ) {
+            h->pub.cards[c] = 0;
+            scan_card(h, c, old_end);
+        }
+    }
+    scan_large_objects(h, 0, 1, promote_slot);
+    uint8_t *scan = old_end;
+    while ( scan < h->next_free ) {
+        heap_object *p = (heap_object *)scan;
+        type_descriptor *t = obj_desc(p);
+        SCAN_PTR_SLOTS(h, p, t, promote_slot);
+        scan += obj_size(p);
+    }
+    h->nursery_next = h->nursery_start;
+    __atomic_add_fetch(&h->num_collections, 1, __ATOMIC_RELEASE);
+}
+
+/* Return p's copy in the heap, copying it there if it hasn't been yet */
+static heap_object *promote(gc_heap *h, heap_object *p) {
+    if ( (p->header & GC_HEADER_TAG) == 0 ) return (heap_object *)(uintptr_t)p->header;
+    uint32_t size = obj_size(p);
+    heap_object *copy = (heap_object *)h->next_free;
+    h->next_free += size;
+    memcpy(copy, p, size);
+    note_old_object(h, (uint8_t *)copy, size);
+    p->header = (uint64_t)(uintptr_t)copy; // forwarding address
+    return copy;
+}
+
+static void promote_slot(gc_heap *h, heap_object **slot) {
+    if ( in_nursery(h, *slot) ) *slot = promote(h, *slot);
+}
+
+/* Promote from all pointer fields of objects overlapping card c. Objects
+ * at or past old_end were promoted by this gc_minor() and get scanned anyway.
+ */
+static void scan_card(gc_heap *h, size_t c, uint8_t *old_end) {
+    uint8_t *hi = h->start_of_heap + ((c + 1) << GC_CARD_SHIFT);
+    uint8_t *q = h->start_of_heap + h->card_object[c];
+    while ( q < hi && q < old_end ) {
+        heap_object *p = (heap_object *)q;
+        type_descriptor *t = obj_desc(p);
+        SCAN_PTR_SLOTS(h, p, t, promote_slot);
+        q += obj_size(p);
+    }
+}
+
+/* Fill live_bits and block_offset from the mark bitmap and return where
+ * the compacted heap will end.
+ */
+static uint8_t *gc_compute_forwarding(gc_heap *h) {
+    memset(h->live_bits, 0, h->num_mark_words * sizeof(bitmap_word));
+    heap_object *p;
+    for (p = next_marked(h, h->start_of_heap); p != NULL; p = next_marked(h, (uint8_t *)p + obj_size(p))) {
+        set_bit_range(h->live_bits, granule_of(h, (uint8_t *)p), obj_size(p) / WORD_SIZE_IN_BYTES);
+    }
+    uint32_t n = 0;
+    size_t b;
+    for (b = 0; b < h->num_mark_words; b++) {
+        h->block_offset[b] = n;
+        n += popcount(h->live_bits[b]);
+    }
+    return h->start_of_heap + (size_t)n * WORD_SIZE_IN_BYTES;
+}
+
+/* p is dead; grow its size to cover any dead objects that follow it and
+ * return the address just past the run.
+ */
+static uint8_t *gc_merge_dead_run(gc_heap *h, heap_object *p) {
+    uint8_t *r = (uint8_t *)p + obj_size(p);
+    while ( r < h->next_free && !is_marked(h, (heap_object *)r) ) {
+        r += obj_size((heap_object *)r);
+    }
+    set_obj_size(p, (uint32_t)(r - (uint8_t *)p));
+    return r;
+}
+
+static void gc_update_ptrs(gc_heap *h) {
+    // alter roots that point to live objects
+    int i;
+    for (i = 0; i < h->num_roots; i++) {
+        if (DEBUG) printf("move root[%d]=%p\n", i, h->roots[i]);
+        heap_object *p = *h->roots[i];
+        if (p != NULL && gc_in_heap(h, p) && is_marked(h, p)) {
+            *h->roots[i] = forwarding_addr(h, p); // move root to new address
+        }
+    }
+    scan_large_objects(h, 0, 1, forward_slot);
+
+    // alter fields; walk all live objects and set their ptr fields
+    heap_object *p;
+    for (p = next_marked(h, h->start_of_heap); p != NULL; p = next_marked(h, (uint8_t *)p + obj_size(p))) {
+        type_descriptor *t = obj_desc(p);
+        if (DEBUG) printf("move ptr fields of %s@%p\n", t->metaclass->name, p);
+        SCAN_PTR_SLOTS(h, p, t, forward_slot);
+    }
+}
+
+static void forward_slot(gc_heap *h, heap_object **slot) {
+    if ( *slot != NULL && gc_in_heap(h, *slot) ) *slot = forwarding_addr(h, *slot);
+}
+
+/* Thread roots and forward pointers; return where the compacted heap will end */
+static uint8_t *gc_thread_forward_ptrs(gc_heap *h) {
+    int i;
+    for (i = 0; i < h->num_roots; i++) {
+        heap_object *p = *h->roots[i];
+        if (p != NULL && gc_in_heap(h, p) && is_marked(h, p)) {
+            thread_ptr(h, h->roots[i]);
+        }
+    }
+    scan_large_objects(h, 0, 1, thread_ptr); // they don't move, so they're like roots
+
+    uint8_t *to = h->start_of_heap;
+    uint8_t *q = h->start_of_heap;
+    while ( q < h->next_free ) {
+        heap_object *p = (heap_object *)q;
+        if ( is_marked(h, p) ) {
+            unthread(p, to);
+            // grab header info now; a field pointing at p itself rethreads it
+            uint32_t size = obj_size(p);
+            type_descriptor *t = obj_desc(p);
+            SCAN_PTR_SLOTS(h, p, t, thread_ptr);
+            to += size;
+            q += size;
+        }
+        else {
+            q = gc_merge_dead_run(h, p);
+        }
+    }
+    return to;
+}
+
+/* Fix up backward pointers and move objects to compact heap */
+static void gc_thread_backward_ptrs_and_slide(gc_heap *h) {
+    uint8_t *to = h->start_of_heap;
+    uint8_t *q = h->start_of_heap;
+    while ( q < h->next_free ) {
+        heap_object *p = (heap_object *)q;
+        if ( is_marked(h, p) ) {
+            unthread(p, to); // header isn't valid until we do this
+            uint32_t size = obj_size(p);
+            if ( to != q ) memmove(to, p, size);
+            to += size;
+            q += size;
+        }
+        else {
+            q += obj_size(p);
+        }
+    }
+}
+
+/* Link slot ref into the thread of the object it points at. Slots hold
+ * word aligned addresses, which GC_HEADER_TAG distinguishes from a header.
+ */
+static void thread_ptr(gc_heap *h, heap_object **ref) {
+    heap_object *target = *ref;
+    if ( target == NULL || !gc_in_heap(h, target) ) return;
+    *(uint64_t *)ref = target->header;
+    target->header = (uint64_t)(uintptr_t)ref;
+}
+
+/* Point every slot threaded onto p at addr and restore p's header */
+static void unthread(heap_object *p, uint8_t *addr) {
+    uint64_t w = p->header;
+    while ( (w & GC_HEADER_TAG) == 0 ) {
+        uint64_t *slot = (uint64_t *)(uintptr_t)w;
+        w = *slot;
+        *slot = (uint64_t)(uintptr_t)addr;
+    }
+    p->header = w;
+}
+
+/* move objects to compact heap */
+static void gc_slide(gc_heap *h) {
+    heap_object *p;
+    heap_object *next;
+    for (p = next_marked(h, h->start_of_heap); p != NULL; p = next) {
+        uint32_t size = obj_size(p);
+        next = next_marked(h, (uint8_t *)p + size); // before we overwrite p
+        heap_object *to = forwarding_addr(h, p);
+        if ( to != p ) memmove(to, p, size);
+    }
+}
+
+object_metadata String_metaclass = {.name = "String", .size = sizeof(String), .num_fields = 0};
+
+/* gc_heap_alloc() when the TLAB is out of room or the type isn't registered */
+heap_object *gc_heap_alloc_slow(gc_heap *h, object_metadata *metaclass) {
+    uint32_t type_id = gc_register_type(metaclass);
+    size_t size = align_to_word_boundary((size_t)metaclass->size);
+    heap_object *p = gc_alloc_space(h, size);
+    if ( p==NULL ) return NULL;
+
+    memset(p, 0, size);
+    p->header = gc_make_header((uint32_t)size, type_id);
+    return p; // spend hour looking for bug; forgot this
+}
+
+String *gc_heap_alloc_string_slow(gc_heap *h, int size) {
+    uint32_t type_id = gc_register_type(&String_metaclass);
+    String *s;
+    /* size for struct String, the String itself, and null char */
+    size_t n = align_to_word_boundary(sizeof (String) + size + 1);
+    s = (String *) gc_alloc_space(h, n);
+    if ( s==NULL ) return NULL;
+    memset(s, 0, n);
+    s->header.header = gc_make_header((uint32_t)n, type_id);
+    s->length = size;
+    return s;
+}
+
+/* Like gc_heap_alloc() but in the atomic space, so metaclass must have
+ * no pointer fields.
+ */
+heap_object *gc_heap_alloc_atomic(gc_heap *h, object_metadata *metaclass) {
+    if ( metaclass->num_fields != 0 ) {
+        fprintf(stderr, "gc: %s has pointer fields so it can't be allocated atomic\n", metaclass->name);
+        exit(EXIT_FAILURE);
+    }
+    gc_heap_safepoint(h);
+    uint32_t type_id = gc_register_type(metaclass);
+    size_t size = align_to_word_boundary((size_t)metaclass->size);
+    heap_object *p = alloc_atomic(h, size);
+    if ( p == NULL ) return gc_heap_alloc_slow(h, metaclass);
+    p->header = gc_make_header((uint32_t)size, type_id);
+    return p;
+}
+
+String *gc_heap_alloc_string_atomic(gc_heap *h, int size) {
+    gc_heap_safepoint(h);
+    uint32_t type_id = gc_register_type(&String_metaclass);
+    size_t n = align_to_word_boundary(sizeof (String) + size + 1);
+    String *s = alloc_atomic(h, n);
+    if ( s == NULL ) return gc_heap_alloc_string_slow(h, size);
+    s->header.header = gc_make_header((uint32_t)n, type_id);
+    s->length = size;
+    return s;
+}
+
+heap_object *gc_alloc_atomic(object_metadata *metaclass) {
+    return gc_heap_alloc_atomic(gc_default_heap, metaclass);
+}
+
+String *gc_alloc_string_atomic(int size) {
+    return gc_heap_alloc_string_atomic(gc_default_heap, size);
+}
+
+uint32_t gc_register_type(object_metadata *metaclass) {
+    uint32_t id = __atomic_load_n(&metaclass->type_id, __ATOMIC_ACQUIRE);
+    if ( id != 0 ) return id;
+
+    pthread_mutex_lock(&type_lock);
+    if ( metaclass->type_id != 0 ) { // another thread beat us to it
+        pthread_mutex_unlock(&type_lock);
+        return metaclass->type_id;
+    }
+    if ( num_types > TYPE_ID_MASK ) {
+        fprintf(stderr, "gc: too many types to register %s\n", metaclass->name);
+        exit(EXIT_FAILURE);
+    }
+    type_descriptor *chunk = type_chunks[num_types >> TYPE_CHUNK_LOG2];
+    if ( chunk == NULL ) {
+        chunk = calloc(TYPE_CHUNK, sizeof(type_descriptor)); // fillers are type 0, all zero
+        if ( chunk == NULL ) {
+            fprintf(stderr, "gc: out of memory registering %s\n", metaclass->name);
+            exit(EXIT_FAILURE);
+        }
+        __atomic_store_n(&type_chunks[num_types >> TYPE_CHUNK_LOG2], chunk, __ATOMIC_RELEASE);
+    }
+    type_descriptor *t = &chunk[num_types & (TYPE_CHUNK - 1)];
+    t->metaclass = metaclass;
+    t->ptr_map = 0;
+    t->has_far_fields = false;
+    int f;
+    for (f = 0; f < metaclass->num_fields; f++) {
+        int offset = metaclass->field_offsets[f];
+        if ( offset % WORD_SIZE_IN_BYTES != 0 || offset < (int)sizeof(heap_object) ||
+             offset + (int)sizeof(heap_object *) > metaclass->size ) {
+            fprintf(stderr, "gc: %s field offset %d isn't a word aligned slot in the instance\n",
+                    metaclass->name, offset);
+            exit(EXIT_FAILURE);
+        }
+        int word = offset / (int)WORD_SIZE_IN_BYTES;
+        if ( word < PTR_MAP_WORDS ) t->ptr_map |= (uint64_t)1 << word;
+        else t->has_far_fields = true;
+    }
+    id = (uint32_t)num_types++;
+    __atomic_store_n(&metaclass->type_id, id, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&type_lock);
+    return id;
+}
+
+/* Apply slot_fn to managed pointer slots beyond what ptr_map covers */
+static void scan_far_slots(gc_heap *h, heap_object *p, object_metadata *metaclass, void (*slot_fn)(gc_heap *h, heap_object **)) {
+    int f;
+    for (f = 0; f < metaclass->num_fields; f++) {
+        int offset = metaclass->field_offsets[f];
+        if ( offset / (int)WORD_SIZE_IN_BYTES >= PTR_MAP_WORDS ) {
+            slot_fn(h, (heap_object **)((uint8_t *)p + offset));
+        }
+    }
+}
+
+int gc_heap_num_roots(gc_heap *h) {
+    return my_mutator(h)->num_roots;
+}
+
+void gc_heap_set_num_roots(gc_heap *h, int roots)
+{
+    my_mutator(h)->num_roots = roots;
+}
+
+int gc_num_roots() {
+    return gc_heap_num_roots(gc_default_heap);
+}
+
+void gc_set_num_roots(int roots) {
+    gc_heap_set_num_roots(gc_default_heap, roots);
+}
+
+long gc_heap_highwater_of(gc_heap *h) {
+    retire_my_tlab(h); // give back the part we haven't used
+    return h->next_free - h->start_of_heap;
+}
+
+long gc_heap_highwater() {
+    return gc_heap_highwater_of(gc_default_heap);
+}
+
+long gc_heap_size_of(gc_heap *h) {
+    return h->heap_size;
+}
+
+long gc_heap_size() {
+    return gc_heap_size_of(gc_default_heap);
+}
+
+void gc_heap_set_live_ratio(gc_heap *h, int percent) {
+    h->live_ratio = percent < 1 ? 1 : percent > 100 ? 100 : percent;
+}
+
+void gc_heap_set_large_object_size(gc_heap *h, int size) {
+    h->large_object_size = size <= 0 ? 0 : size < MIN_LARGE_OBJECT_SIZE ? MIN_LARGE_OBJECT_SIZE : (size_t)size;
+}
+
+/* Incremental marking needs every old pointer to have been stored through
+ * the barrier, which a nursery doesn't ask for of objects it allocates, so
+ * heaps with one always mark all at once.
+ */
+void gc_heap_set_incremental_budget(gc_heap *h, long usec) {
+    h->incremental_budget = h->nursery_start != NULL || usec < 0 ? 0 : usec;
+}
+
+void gc_heap_set_compaction(gc_heap *h, gc_compaction c) {
+    h->compaction = c;
+}
+
+void gc_heap_set_mark_stack_limit(gc_heap *h, int n) {
+    h->mark_stack_limit = n;
+}
+
+void gc_set_compaction(gc_compaction c) {
+    requested_compaction = c;
+    if ( gc_default_heap != NULL ) gc_heap_set_compaction(gc_default_heap, c);
+}
+
+void gc_set_mark_stack_limit(int n) {
+    requested_mark_stack_limit = n;
+    if ( gc_default_heap != NULL ) gc_heap_set_mark_stack_limit(gc_default_heap, n);
+}
+
+void gc_set_live_ratio(int percent) {
+    requested_live_ratio = percent < 1 ? 1 : percent > 100 ? 100 : percent;
+    if ( gc_default_heap != NULL ) gc_heap_set_live_ratio(gc_default_heap, percent);
+}
+
+void gc_set_large_object_size(int size) {
+    requested_large_object_size = size <= 0 ? 0 : size < MIN_LARGE_OBJECT_SIZE ? MIN_LARGE_OBJECT_SIZE : size;
+    if ( gc_default_heap != NULL ) gc_heap_set_large_object_size(gc_default_heap, size);
+}
+
+void gc_set_incremental_budget(long usec) {
+    requested_incremental_budget = usec < 0 ? 0 : usec;
+    if ( gc_default_heap != NULL ) gc_heap_set_incremental_budget(gc_default_heap, usec);
+}
+
+void gc_set_max_heap_size(long size) {
+    requested_max_heap_size = size < 0 ? 0 : size;
+}
+
+void gc_set_nursery_size(int size) {
+    requested_nursery_size = size < 0 ? 0 : (int)align_to_word_boundary((size_t)size);
+}
+
+void gc_set_gc_threads(int n) {
+    if ( n < 1 ) n = 1;
+    if ( n > MAX_WORKERS ) n = MAX_WORKERS;
+    requested_workers = n;
+}
+
+char *gc_get_state() {
+    return gc_heap_get_state(gc_default_heap);
+}
+
+/* Fill mark_bits with exactly what's reachable now, for the dumps below;
+ * unmark_objects() clears them again. Remarking from scratch would throw
+ * away the gray stack and mark bits of a cycle under way, and its objects
+ * allocated black would never be scanned, so finish that cycle first and
+ * let the next one start over.
+ */
+static void mark_for_inspection(gc_heap *h) {
+    if ( h->pub.marking ) {
+        finish_marking(h);
+        unmark_objects(h);
+    }
+    gc_mark_live(h);
+}
+
+char *gc_heap_get_state(gc_heap *h) {
+    stop_the_world(h);
+    mark_for_inspection(h);
+    charbuf state = charbuf_new(1000);
+    char buf[1000];
+    sprintf(buf, "next_free=%ld\n", gc_rel_addr(h, (heap_object *) h->next_free));
+    charbuf_add_str(&state, buf);
+    sprintf(buf, "objects:\n");
+    charbuf_add_str(&state, buf);
+    heap_object *p;
+    for (p = next_marked(h, h->start_of_heap); p != NULL; p = next_marked(h, (uint8_t *)p + obj_size(p))) {
+        charbuf_add_str(&state, "  ");
+        char *s = ptr_to_str(h, p);
+        s[strlen(s)-1] = '\0'; // strip \n
+        charbuf_add_str(&state, s);
+        free(s);
+        {
+            // print ptr fields
+            if ( obj_type(p)->num_fields>0 ) {
+                charbuf_add_str(&state, "->[");
+                int i;
+                for (i = 0; i < obj_type(p)->num_fields; i++) {
+                    int offset_of_ptr_field = obj_type(p)->field_offsets[i];
+                    uint8_t *ptr_to_ptr_field = ((uint8_t *) p) + offset_of_ptr_field;
+                    heap_object **obj_ptr_to_ptr_field = (heap_object **) ptr_to_ptr_field;
+                    heap_object *target_obj = *obj_ptr_to_ptr_field;
+                    if ( i>0 ) charbuf_add(&state, ',');
+                    if ( target_obj!=NULL ) {
+                        sprintf(buf, "%ld", gc_rel_addr(h, (heap_object *) target_obj));
+                        charbuf_add_str(&state, buf);
+                    }
+                    else {
+                        charbuf_add_str(&state, "NULL");
+                    }
+                }
+                charbuf_add_str(&state, "]");
+            }
+            charbuf_add(&state, '\n');
+        }
+    }
+    char *s = charbuf_to_str(state);
+    charbuf_free(state);
+    unmark_objects(h);
+    resume_the_world(h);
+    return s;
+}
+
+
+
+
+/* Walk all roots and traverse object graph. Set mark bit for each
+   reachable p, leaving num_live_objects set at number of live.
+   Traversal is iterative, driven by the gray mark stack, so deep graphs such
+   as long mgr chains don't recurse on the C stack.
+ */
+static void gc_mark_live(gc_heap *h) {
+    if ( parallel_gc(h) ) {
+        gc_mark_parallel(h);
+        return;
+    }
+    h->num_live_objects = 0;
+    h->gray.next = 0;
+    h->gray.overflowed = false;
+    for (int i = 0; i < h->num_roots; i++) {
+        if (DEBUG) printf("root[%d]=%p\n", i, h->roots[i]);
+        heap_object *p = *h->roots[i];
+        if (p != NULL) {
+            if (DEBUG) printf("root=%s@%p\n", obj_type(p)->name, p);
+            gc_mark_object(h, p);
+        }
+    }
+    gc_scan_gray(h);
+    while ( h->gray.overflowed ) {
+        h->gray.overflowed = false;
+        gc_rescan_heap(h);
+        gc_scan_gray(h);
+    }
+}
+
+/* Mark p live and push it gray so its fields get scanned later */
+static void gc_mark_object(gc_heap *h, heap_object *p) {
+    if ( !gc_in_heap(h, p) ) {
+        if ( !in_atomic_space(h, p) ) mark_large_object(h, p);
+        else if ( !set_atomic_marked(h, p) ) h->num_live_objects++;
+        return;
+    }
+    if ( h->pub.marking && (uint8_t *)p >= h->mark_top ) return; // allocated black
+    if (!is_marked(h, p)) {
+        if (DEBUG) printf("mark %s@%p\n", obj_type(p)->name, p);
+        set_marked(h, p);
+        h->num_live_objects++;
+        if ( !mark_stack_push(h, p) ) h->gray.overflowed = true;
+    }
+}
+
+/* Pop gray objects until there are none left, marking what they point to */
+static void gc_scan_gray(gc_heap *h) {
+    while ( h->gray.next > 0 ) {
+        heap_object *p = h->gray.data[--h->gray.next];
+        gc_scan_fields(h, p);
+    }
+}
+
+/* Mark stack overflowed so some marked objects never had their fields
+ * scanned. Walk the heap in address order and rescan every marked object;
+ * gc_mark_object() ignores already-marked targets so this only pushes
+ * what was lost.
+ */
+static void gc_rescan_heap(gc_heap *h) {
+    if (DEBUG) printf("mark stack overflow; rescanning heap\n");
+    uint8_t *q = h->start_of_heap;
+    while ( q < h->next_free ) {
+        heap_object *p = (heap_object *)q;
+        if ( is_marked(h, p) ) {
+            gc_scan_fields(h, p);
+            gc_scan_gray(h); // drain as we go to keep the stack small
+        }
+        q += obj_size(p);
+    }
+    large_object *l;
+    for (l = h->large_objects; l != NULL; l = l->next) {
+        if ( l->marked ) {
+            gc_scan_fields(h, (heap_object *)(l + 1));
+            gc_scan_gray(h);
+        }
+    }
+}
+
+/* check for tracked heap ptrs in this object */
+static void gc_scan_fields(gc_heap *h, heap_object *p) {
+    type_descriptor *t = obj_desc(p);
+    SCAN_PTR_SLOTS(h, p, t, mark_slot);
+}
+
+static void mark_slot(gc_heap *h, heap_object **slot) {
+    if ( *slot != NULL ) gc_mark_object(h, *slot);
+}
+
+/* Push p onto gray stack, growing it if needed. Return false if we've hit
+ * mark_stack_limit or can't get more memory.
+ */
+static bool mark_stack_push(gc_heap *h, heap_object *p) {
+    if ( h->gray.next >= h->gray.size ) {
+        int n = h->gray.size == 0 ? MARK_STACK_INITIAL_SIZE : h->gray.size * 2;
+        if ( n > h->mark_stack_limit ) n = h->mark_stack_limit;
+        if ( n <= h->gray.size ) return false;
+        heap_object **bigger = realloc(h->gray.data, n * sizeof(heap_object *));
+        if ( bigger == NULL ) return false;
+        h->gray.data = bigger;
+        h->gray.size = n;
+    }
+    PREFETCH(p); // we'll scan its fields soon; start the cache miss now
+    h->gray.data[h->gray.next++] = p;
+    return true;
+}
+
+/* The barrier half of incremental and concurrent marking: make p gray if it's white */
+void gc_heap_shade(gc_heap *h, heap_object *p) {
+    if ( p == NULL ) return;
+    pthread_mutex_lock(&h->shade_lock);
+    if ( h->pub.marking ) gc_mark_object(h, p);
+    pthread_mutex_unlock(&h->shade_lock);
+}
+
+void gc_set_concurrent_marking(bool on) {
+    requested_concurrent_marking = on;
+}
+
+/* Called from allocation slow paths: start a marking cycle if the heap is
+ * full enough, or run a slice of the one under way.
+ */
+static void mark_incrementally(gc_heap *h) {
+    if ( h->pub.marking ? h->concurrent : __atomic_load_n(&h->next_free, __ATOMIC_RELAXED) < h->mark_trigger ) return;
+    stop_the_world(h);
+    if ( h->pub.marking ) mark_slice(h);
+    else if ( h->next_free >= h->mark_trigger ) start_marking(h); // unless someone collected while we stopped
+    resume_the_world(h);
+}
+
+/* Shade the roots and pace marking so it's done before the rest of the
+ * heap is: twice as fast as the ratio of what's there to what's free.
+ */
+static void start_marking(gc_heap *h) {
+    if (DEBUG) printf("start incremental mark\n");
+    pthread_mutex_lock(&h->atomic_lock); // so shading never sees the atomic space appear
+    if ( h->atomic_start == NULL ) reserve_atomic_space(h);
+    pthread_mutex_unlock(&h->atomic_lock);
+    h->num_live_objects = 0;
+    h->gray.next = 0;
+    h->gray.overflowed = false;
+    h->mark_top = h->slice_top = h->next_free;
+    size_t used = (size_t)(h->next_free - h->start_of_heap);
+    size_t room = (size_t)(h->end_of_heap - h->next_free) + 1;
+    h->mark_rate = 2 * used / room + 1;
+    h->pub.marking = h->concurrent ? GC_MARKING_SATB : GC_MARKING_INCREMENTAL;
+    int i;
+    for (i = 0; i < h->num_roots; i++) {
+        if ( *h->roots[i] != NULL ) gc_mark_object(h, *h->roots[i]);
+    }
+    if ( h->concurrent ) {
+        pthread_mutex_lock(&h->marker_lock);
+        h->marker_running = true;
+        h->marker_stop = false;
+        pthread_cond_broadcast(&h->marker_changed);
+        pthread_mutex_unlock(&h->marker_lock);
+    }
+}
+
+/* Scan gray objects in proportion to what was allocated since the last
+ * slice, stopping early at the time budget.
+ */
+static void mark_slice(gc_heap *h) {
+    size_t work = (size_t)(h->next_free - h->slice_top) * h->mark_rate;
+    h->slice_top = h->next_free;
+    long long deadline = now_usec() + h->incremental_budget;
+    size_t done = 0;
+    int n = 0;
+    while ( h->gray.next > 0 && done < work ) {
+        heap_object *p = h->gray.data[--h->gray.next];
+        gc_scan_fields(h, p);
+        done += obj_size(p);
+        if ( ++n % MARK_SLICE_CHECK == 0 && now_usec() >= deadline ) break;
+    }
+}
+
+/* The remark at the start of gc(): mark everything allocated since
+ * marking started, which is black so we don't scan it, then whatever
+ * the roots reach now.
+ */
+static void finish_marking(gc_heap *h) {
+    if (DEBUG) printf("finish incremental mark\n");
+    if ( h->concurrent ) wait_for_marker(h);
+    uint8_t *q = h->mark_top;
+    while ( q < h->next_free ) {
+        heap_object *p = (heap_object *)q;
+        bool filler = ((p->header >> GC_TYPE_ID_SHIFT) & TYPE_ID_MASK) == 0;
+        if ( !filler && !is_marked(h, p) ) {
+            set_marked(h, p);
+            h->num_live_objects++;
+        }
+        q += obj_size(p);
+    }
+    int i;
+    for (i = 0; i < h->num_roots; i++) {
+        if ( *h->roots[i] != NULL ) gc_mark_object(h, *h->roots[i]);
+    }
+    gc_scan_gray(h);
+    while ( h->gray.overflowed ) {
+        h->gray.overflowed = false;
+        gc_rescan_heap(h);
+        gc_scan_gray(h);
+    }
+    h->pub.marking = 0;
+}
+
+static void start_marker(gc_heap *h) {
+    h->concurrent = true;
+    pthread_mutex_init(&h->marker_lock, NULL);
+    pthread_cond_init(&h->marker_changed, NULL);
+    if ( pthread_create(&h->marker, NULL, marker_main, h) != 0 ) {
+        fprintf(stderr, "gc: can't start marker thread\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void stop_marker(gc_heap *h) {
+    pthread_mutex_lock(&h->marker_lock);
+    h->marker_exit = true;
+    __atomic_store_n(&h->marker_stop, true, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&h->marker_changed);
+    pthread_mutex_unlock(&h->marker_lock);
+    pthread_join(h->marker, NULL);
+    pthread_mutex_destroy(&h->marker_lock);
+    pthread_cond_destroy(&h->marker_changed);
+    h->concurrent = false;
+}
+
+static void *marker_main(void *arg) {
+    gc_heap *h = arg;
+    pthread_mutex_lock(&h->marker_lock);
+    for (;;) {
+        while ( !h->marker_running && !h->marker_exit ) pthread_cond_wait(&h->marker_changed, &h->marker_lock);
+        if ( h->marker_exit ) break;
+        pthread_mutex_unlock(&h->marker_lock);
+        mark_concurrently(h);
+        pthread_mutex_lock(&h->marker_lock);
+        h->marker_running = false;
+        pthread_cond_broadcast(&h->marker_changed);
+    }
+    pthread_mutex_unlock(&h->marker_lock);
+    return NULL;
+}
+
+/* Trace gray objects until there are none or gc() asks for them */
+static void mark_concurrently(gc_heap *h) {
+    bool more = true;
+    while ( more && !__atomic_load_n(&h->marker_stop, __ATOMIC_ACQUIRE) ) {
+        pthread_mutex_lock(&h->shade_lock);
+        int n;
+        for (n = 0; n < MARK_BATCH && h->gray.next > 0; n++) {
+            heap_object *p = h->gray.data[--h->gray.next];
+            type_descriptor *t = obj_desc(p);
+            SCAN_PTR_SLOTS(h, p, t, mark_slot_shared);
+        }
+        more = h->gray.next > 0;
+        pthread_mutex_unlock(&h->shade_lock);
+    }
+}
+
+/* Take the gray stack back from the marker, if it's still tracing */
+static void wait_for_marker(gc_heap *h) {
+    pthread_mutex_lock(&h->marker_lock);
+    __atomic_store_n(&h->marker_stop, true, __ATOMIC_RELEASE);
+    while ( h->marker_running ) pthread_cond_wait(&h->marker_changed, &h->marker_lock);
+    pthread_mutex_unlock(&h->marker_lock);
+}
+
+/* mark_slot() for when a mutator may be storing to slot */
+static void mark_slot_shared(gc_heap *h, heap_object **slot) {
+    heap_object *p = __atomic_load_n(slot, __ATOMIC_RELAXED);
+    if ( p != NULL ) gc_mark_object(h, p);
+}
+
+/* Start the next marking cycle when half the heap's free space is gone */
+static void set_mark_trigger(gc_heap *h) {
+    h->mark_trigger = h->next_free + (h->end_of_heap - h->next_free) / 2;
+}
+
+static long long now_usec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void start_workers(gc_heap *h) {
+    size_t n = (size_t)h->num_workers * sizeof(mark_deque);
+    h->deques = aligned_alloc(_Alignof(mark_deque), n);
+    h->workers = malloc((h->num_workers - 1) * sizeof(gc_worker));
+    if ( h->deques == NULL || h->workers == NULL ) {
+        fprintf(stderr, "gc: out of memory starting %d workers\n", h->num_workers);
+        exit(EXIT_FAILURE);
+    }
+    memset(h->deques, 0, n);
+    int i;
+    for (i = 0; i < h->num_workers; i++) {
+        h->deques[i].buf = malloc(MARK_DEQUE_SIZE * sizeof(heap_object *));
+        h->deques[i].seed = (unsigned)i + 1;
+        if ( h->deques[i].buf == NULL ) {
+            fprintf(stderr, "gc: out of memory starting %d workers\n", h->num_workers);
+            exit(EXIT_FAILURE);
+        }
+    }
+    h->num_regions = (h->num_mark_words + REGION_WORDS - 1) / REGION_WORDS;
+    h->regions = calloc((mark_words_for(h->max_heap_size) + REGION_WORDS - 1) / REGION_WORDS, sizeof(region));
+    if ( h->regions == NULL ) {
+        fprintf(stderr, "gc: out of memory starting %d workers\n", h->num_workers);
+        exit(EXIT_FAILURE);
+    }
+    h->phase_epoch = 0;
+    h->workers_exit = false;
+    for (i = 1; i < h->num_workers; i++) {
+        gc_worker *w = &h->workers[i - 1];
+        w->heap = h;
+        w->id = i;
+        if ( pthread_create(&w->thread, NULL, worker_main, w) != 0 ) {
+            fprintf(stderr, "gc: can't start gc thread %d\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
 
-static int  gc_object_size(heap_object *p);
-static void gc_compact_object_list();
-static void *gc_alloc_space(size_t size);
-static void gc_dump();
-static bool gc_in_heap(heap_object *p);
-static char *gc_viz_heap();
-static void gc_free_object(heap_object *p);
-static void print_ptr(heap_object *p);
-static void print_addr_array(heap_object **array, int len);
-static char *long_array_to_str(unsigned long *array, int len);
-static unsigned long gc_rel_addr(heap_object *p);
-static int addrcmp(const void *a, const void *b);
-static void unmark_objects();
-static char *ptr_to_str(heap_object *p);
+static void stop_workers(gc_heap *h) {
+    pthread_mutex_lock(&h->worker_lock);
+    h->workers_exit = true;
+    pthread_cond_broadcast(&h->worker_go);
+    pthread_mutex_unlock(&h->worker_lock);
+    int i;
+    for (i = 1; i < h->num_workers; i++) pthread_join(h->workers[i - 1].thread, NULL);
+    for (i = 0; i < h->num_workers; i++) free(h->deques[i].buf);
+    free(h->deques);
+    h->deques = NULL;
+    free(h->workers);
+    h->workers = NULL;
+    free(h->regions);
+    h->regions = NULL;
+    h->num_regions = 0;
+    h->num_workers = 1;
+}
 
-/* Initialize a heap with a certain size for use with the garbage collector */
-void gc_init(int size) {
-    heap_size = size;
-    start_of_heap = malloc((size_t)size); //TODO: should this be morecore()?
-    end_of_heap = start_of_heap + size - 1;
-    next_free = start_of_heap;
-    num_live_objects = num_roots = 0;
+/* Worker threads 1..num_workers-1 run this until gc_heap_free() */
+static void *worker_main(void *arg) {
+    gc_heap *h = ((gc_worker *)arg)->heap;
+    int id = ((gc_worker *)arg)->id;
+    unsigned seen = 0;
+    for (;;) {
+        pthread_mutex_lock(&h->worker_lock);
+        while ( h->phase_epoch == seen && !h->workers_exit ) pthread_cond_wait(&h->worker_go, &h->worker_lock);
+        if ( h->workers_exit ) {
+            pthread_mutex_unlock(&h->worker_lock);
+            return NULL;
+        }
+        seen = h->phase_epoch;
+        pthread_mutex_unlock(&h->worker_lock);
+
+        h->phase(h, id);
+
+        pthread_mutex_lock(&h->worker_lock);
+        if ( ++h->workers_finished == h->num_workers - 1 ) pthread_cond_signal(&h->worker_done);
+        pthread_mutex_unlock(&h->worker_lock);
+    }
 }
 
-/* Announce you are done with the heap managed by the garbage collector */
-void gc_done() {
-    free(start_of_heap);
+static bool parallel_gc(gc_heap *h) {
+    return h->num_workers > 1 && (size_t)h->heap_size >= MIN_PARALLEL_HEAP;
 }
 
-void gc_add_addr_of_root(heap_object **p)
-{
-    _roots[num_roots++] = p;
+/* Run phase on every worker, this thread as worker 0, and wait for all */
+static void run_phase(gc_heap *h, void (*phase)(gc_heap *h, int id)) {
+    h->next_region = 0;
+    pthread_mutex_lock(&h->worker_lock);
+    h->phase = phase;
+    h->workers_finished = 0;
+    h->phase_epoch++;
+    pthread_cond_broadcast(&h->worker_go);
+    pthread_mutex_unlock(&h->worker_lock);
+
+    phase(h, 0);
+
+    pthread_mutex_lock(&h->worker_lock);
+    while ( h->workers_finished < h->num_workers - 1 ) pthread_cond_wait(&h->worker_done, &h->worker_lock);
+    pthread_mutex_unlock(&h->worker_lock);
 }
 
-/* Perform a mark-and-compact garbage collection, moving all live objects
- * to the start of the heap. Anything that we don't mark is dead. Unlike
- * mark-n-sweep, we do not walk the garbage. The mark operation
- * results in a temporary array called live_objects with objects in random
- * address order. We sort by address order from low to high in order to
- * compact the heap without stepping on a live object. During one of the
- * passes over the live object list, reset p->marked = 0. I do it here in #5.
- *
- * 1. Walk object graph, marking live objects as with mark-sweep.
- *
- * 2. Then sort live object list by address. We have to compact by walking
- *    the objects in address order, low to high.
- *
- * 3. Next we walk all live objects and compute their forwarding addresses.
- *
- * 4. Alter all roots pointing to live objects to point at forwarding address.
- *
- * 5. Walk the live objects and alter all non-NULL managed pointer fields
- *    to point to the forwarding addresses.
- *
- * 6. Move all live objects to the start of the heap in ascending address order.
- */
-void gc() {
-    if (DEBUG) printf("gc_compact\n");
-    gc_mark_live(); // fills live_objects
+/* gc_mark_live() with all markers; returns once the graph is marked */
+static void gc_mark_parallel(gc_heap *h) {
+    int i;
+    for (i = 0; i < h->num_workers; i++) {
+        h->deques[i].top = h->deques[i].bottom = 0;
+        h->deques[i].num_live = 0;
+    }
+    h->deque_capacity = h->mark_stack_limit < MARK_DEQUE_SIZE ? h->mark_stack_limit : MARK_DEQUE_SIZE;
+    h->active_markers = h->num_workers;
+    h->mark_overflowed = false;
+    run_phase(h, gc_mark_worker);
 
-    // sort objects by address
-    qsort(live_objects, num_live_objects, sizeof(heap_object *), addrcmp);
+    h->num_live_objects = 0;
+    for (i = 0; i < h->num_workers; i++) h->num_live_objects += h->deques[i].num_live;
 
+    // some marked objects never got scanned; finish up single threaded
+    h->gray.next = 0;
+    h->gray.overflowed = h->mark_overflowed;
+    while ( h->gray.overflowed ) {
+        h->gray.overflowed = false;
+        gc_rescan_heap(h);
+        gc_scan_gray(h);
+    }
+}
 
-    // compute forwarding addresses
-    next_free = start_of_heap; // reset to have no allocated space then realloc at start
+/* Mark from this marker's share of the roots, then scan gray objects,
+ * stealing when our deque runs dry, until every marker is out of work.
+ * Only a marker counted in active_markers can hold or create gray objects,
+ * so once the count hits zero all deques are empty for good.
+ */
+static void gc_mark_worker(gc_heap *h, int id) {
+    mark_deque *d = &h->deques[id];
+    my_deque = d;
     int i;
-    for (i = 0; i < num_live_objects; i++) {
-        heap_object *p = live_objects[i];
-        p->forwarded = gc_alloc_space(gc_object_size(p));
+    for (i = id * h->num_roots / h->num_workers; i < (id + 1) * h->num_roots / h->num_workers; i++) {
+        heap_object *p = *h->roots[i];
+        if ( p != NULL ) par_mark_object(h, p);
     }
 
-    // alter roots that point to live objects
-    for (i = 0; i < num_roots; i++) {
-        if (DEBUG) printf("move root[%d]=%p\n", i, _roots[i]);
-        heap_object *p = *_roots[i];
-        if (p != NULL && p->marked) {
-            *_roots[i] = p->forwarded; // move root to new address
+    for (;;) {
+        heap_object *p;
+        while ( (p = deque_pop(d)) != NULL ) {
+            type_descriptor *t = obj_desc(p);
+            SCAN_PTR_SLOTS(h, p, t, par_mark_slot);
+        }
+        p = steal_gray(h, id);
+        if ( p != NULL ) {
+            type_descriptor *t = obj_desc(p);
+            SCAN_PTR_SLOTS(h, p, t, par_mark_slot);
+            continue;
+        }
+        __atomic_sub_fetch(&h->active_markers, 1, __ATOMIC_SEQ_CST);
+        for (;;) {
+            if ( __atomic_load_n(&h->active_markers, __ATOMIC_SEQ_CST) == 0 ) return;
+            if ( gray_available(h) ) {
+                __atomic_add_fetch(&h->active_markers, 1, __ATOMIC_SEQ_CST);
+                break;
+            }
+            sched_yield();
         }
     }
+}
 
-    // alter fields; walk all live objects and set their ptr fields
-    for (i = 0; i < num_live_objects; i++) {
-        heap_object *p = live_objects[i];
-        p->marked = 0;
-        int f;
-        if (DEBUG) printf("move ptr fields of %s@%p\n", p->metaclass->name, p);
-        for (f = 0; f < p->metaclass->num_fields; f++) {
-            int offset_of_ptr_field = p->metaclass->field_offsets[f];
-            uint8_t *ptr_to_ptr_field = ((uint8_t *) p) + offset_of_ptr_field;
-            heap_object **ptr_to_obj_ptr_field = (heap_object **) ptr_to_ptr_field;
-            heap_object *target_obj = *ptr_to_obj_ptr_field;
-            if (target_obj != NULL) {
-                *ptr_to_obj_ptr_field = target_obj->forwarded;
-            }
+static void par_mark_object(gc_heap *h, heap_object *p) {
+    if ( in_atomic_space(h, p) ) { // nothing to scan
+        if ( !set_atomic_marked(h, p) ) my_deque->num_live++;
+        return;
+    }
+    if ( test_and_set_marked(h, p) ) return;
+    my_deque->num_live++;
+    if ( !deque_push(h, my_deque, p) ) __atomic_store_n(&h->mark_overflowed, true, __ATOMIC_RELAXED);
+}
+
+static void par_mark_slot(gc_heap *h, heap_object **slot) {
+    if ( *slot != NULL ) par_mark_object(h, *slot);
+}
+
+/* Set p's mark bit and return whether it was already set */
+static bool test_and_set_marked(gc_heap *h, heap_object *p) {
+    if ( !gc_in_heap(h, p) ) {
+        if ( !is_large(h, p) ) return true; // not ours to mark
+        return __atomic_exchange_n(&large_of(p)->marked, true, __ATOMIC_RELAXED);
+    }
+    size_t g = granule_of(h, (uint8_t *)p);
+    bitmap_word bit = (bitmap_word)1 << (g % BITS_PER_BITMAP_WORD);
+    bitmap_word *w = &h->mark_bits[g / BITS_PER_BITMAP_WORD];
+    if ( (__atomic_load_n(w, __ATOMIC_RELAXED) & bit) != 0 ) return true; // skip the locked op
+    return (__atomic_fetch_or(w, bit, __ATOMIC_RELAXED) & bit) != 0;
+}
+
+/* Owner only. Return false if the deque is full. */
+static bool deque_push(gc_heap *h, mark_deque *d, heap_object *p) {
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+    long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    if ( b - t >= h->deque_capacity ) return false;
+    PREFETCH(p);
+    __atomic_store_n(&d->buf[b & (MARK_DEQUE_SIZE - 1)], p, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+/* Owner only. Return NULL if empty or a thief took the last entry. */
+static heap_object *deque_pop(mark_deque *d) {
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+    if ( t > b ) {
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    heap_object *p = __atomic_load_n(&d->buf[b & (MARK_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+    if ( t == b ) { // last one; race thieves for it
+        if ( !__atomic_compare_exchange_n(&d->top, &t, t + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED) ) {
+            p = NULL;
         }
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
     }
+    return p;
+}
 
-    // move objects to compact heap
-    for (i = 0; i < num_live_objects; i++) {
-        heap_object *p = live_objects[i];
-        memcpy(p->forwarded, p, gc_object_size(p));
+/* Any thread. Return NULL if empty or we lost a race for the top entry. */
+static heap_object *deque_steal(mark_deque *d) {
+    long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+    if ( t >= b ) return NULL;
+    heap_object *p = __atomic_load_n(&d->buf[t & (MARK_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+    if ( !__atomic_compare_exchange_n(&d->top, &t, t + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED) ) {
+        return NULL;
     }
+    return p;
 }
 
-extern heap_object *gc_alloc(size_t size, void (*chase_ptrs)(struct _heap_object *p)) {
-    heap_object *p = gc_alloc_space(size);
+/* Try each other marker once, starting at a random one */
+static heap_object *steal_gray(gc_heap *h, int id) {
+    mark_deque *d = &h->deques[id];
+    d->seed = d->seed * 1103515245 + 12345;
+    int start = (int)((d->seed >> 16) % (unsigned)h->num_workers);
+    int i;
+    for (i = 0; i < h->num_workers; i++) {
+        int victim = (start + i) % h->num_workers;
+        if ( victim == id ) continue;
+        heap_object *p = deque_steal(&h->deques[victim]);
+        if ( p != NULL ) return p;
+    }
+    return NULL;
+}
 
-    memset(p, 0, size+sizeof(heap_object));
-    p->size = (uint32_t)size;
-    p->chase_ptrs = chase_ptrs;
-    return p; // spend hour looking for bug; forgot this
+static bool gray_available(gc_heap *h) {
+    int i;
+    for (i = 0; i < h->num_workers; i++) {
+        if ( __atomic_load_n(&h->deques[i].top, __ATOMIC_ACQUIRE) <
+             __atomic_load_n(&h->deques[i].bottom, __ATOMIC_ACQUIRE) ) {
+            return true;
+        }
+    }
+    return false;
 }
 
-//String *gc_alloc_string(int size) {
-//    String *s;
-//    /* size for struct String, the String itself, and null char */
-//    s = (String *) gc_alloc_space(sizeof (String) + size + 1);
-//    s->metaclass = &String_metaclass;
-//    s->marked = 0;
-//    memset(s->str, 0, size);
-//    s->length = size;
-//    return s;
-//}
+/* gc_compute_forwarding() region by region. Marked objects can straddle
+ * region boundaries, so all of live_bits must be set before any region's
+ * live granules can be counted.
+ */
+static uint8_t *gc_compute_forwarding_parallel(gc_heap *h) {
+    memset(h->live_bits, 0, h->num_mark_words * sizeof(bitmap_word));
+    run_phase(h, gc_summarize_region);
+    run_phase(h, gc_count_region);
 
-int gc_num_roots() {
-    return num_roots;
+    uint32_t n = 0;
+    size_t r;
+    for (r = 0; r < h->num_regions; r++) {
+        h->regions[r].base = n;
+        n += h->regions[r].live;
+    }
+    run_phase(h, gc_offset_region);
+
+    // regions at or above dep have objects overlapping r's destination
+    size_t q = 0;
+    for (r = 0; r < h->num_regions; r++) {
+        if ( h->regions[r].first == NULL ) continue;
+        uint8_t *dest = (uint8_t *)forwarding_addr(h, (heap_object *)h->regions[r].first);
+        while ( q < r && (h->regions[q].first == NULL || h->regions[q].end <= dest) ) q++;
+        h->regions[r].dep = q;
+    }
+    return h->start_of_heap + (size_t)n * WORD_SIZE_IN_BYTES;
 }
 
-void gc_set_num_roots(int roots)
-{
-    num_roots = roots;
+/* Set live_bits for objects starting in each region we claim */
+static void gc_summarize_region(gc_heap *h, int id) {
+    (void)id; // regions are claimed, not assigned by id
+    size_t r;
+    while ( (r = claim_region(h)) < h->num_regions ) {
+        uint8_t *hi = region_start(h, r + 1);
+        region *g = &h->regions[r];
+        g->first = g->end = NULL;
+        g->done = false;
+        heap_object *p;
+        for (p = next_marked(h, region_start(h, r)); p != NULL && (uint8_t *)p < hi; p = next_marked(h, g->end)) {
+            if ( g->first == NULL ) g->first = (uint8_t *)p;
+            set_bit_range_shared(h->live_bits, granule_of(h, (uint8_t *)p), obj_size(p) / WORD_SIZE_IN_BYTES);
+            g->end = (uint8_t *)p + obj_size(p);
+        }
+        if ( g->first == NULL ) g->done = true; // nothing to slide
+    }
 }
 
-char *gc_get_state() {
-    gc_mark_live(); // fill live_objects[]
-    qsort(live_objects, num_live_objects, sizeof (heap_object *), addrcmp);
-    charbuf state = charbuf_new(1000);
-    char buf[1000];
-    sprintf(buf, "next_free=%ld\n", gc_rel_addr((heap_object *) next_free));
-    charbuf_add_str(&state, buf);
-    sprintf(buf, "objects:\n");
-    charbuf_add_str(&state, buf);
+static void gc_count_region(gc_heap *h, int id) {
+    (void)id; // regions are claimed, not assigned by id
+    size_t r;
+    while ( (r = claim_region(h)) < h->num_regions ) {
+        size_t w = r * REGION_WORDS;
+        size_t hi = w + REGION_WORDS < h->num_mark_words ? w + REGION_WORDS : h->num_mark_words;
+        uint32_t n = 0;
+        for (; w < hi; w++) n += popcount(h->live_bits[w]);
+        h->regions[r].live = n;
+    }
+}
+
+static void gc_offset_region(gc_heap *h, int id) {
+    (void)id; // regions are claimed, not assigned by id
+    size_t r;
+    while ( (r = claim_region(h)) < h->num_regions ) {
+        size_t w = r * REGION_WORDS;
+        size_t hi = w + REGION_WORDS < h->num_mark_words ? w + REGION_WORDS : h->num_mark_words;
+        uint32_t n = h->regions[r].base;
+        for (; w < hi; w++) {
+            h->block_offset[w] = n;
+            n += popcount(h->live_bits[w]);
+        }
+    }
+}
+
+/* gc_update_ptrs() for our share of the roots and the regions we claim */
+static void gc_update_ptrs_region(gc_heap *h, int id) {
     int i;
-    for (i = 0; i < num_live_objects; i++) {
-        heap_object *p = live_objects[i];
-        if (p == NULL) {
-            charbuf_add_str(&state, "  NULL\n");
+    for (i = id * h->num_roots / h->num_workers; i < (id + 1) * h->num_roots / h->num_workers; i++) {
+        heap_object *p = *h->roots[i];
+        if (p != NULL && gc_in_heap(h, p) && is_marked(h, p)) {
+            *h->roots[i] = forwarding_addr(h, p);
+        }
+    }
+    scan_large_objects(h, id, h->num_workers, forward_slot);
+    size_t r;
+    while ( (r = claim_region(h)) < h->num_regions ) {
+        uint8_t *hi = region_start(h, r + 1);
+        heap_object *p;
+        for (p = (heap_object *)h->regions[r].first; p != NULL && (uint8_t *)p < hi;
+             p = next_marked(h, (uint8_t *)p + obj_size(p))) {
+            type_descriptor *t = obj_desc(p);
+            SCAN_PTR_SLOTS(h, p, t, forward_slot);
+        }
+    }
+}
+
+/* gc_slide() for the regions we claim. Regions are claimed in increasing
+ * order and a region only waits on lower ones, so some worker is always
+ * making progress.
+ */
+static void gc_slide_region(gc_heap *h, int id) {
+    (void)id; // regions are claimed, not assigned by id
+    size_t r;
+    while ( (r = claim_region(h)) < h->num_regions ) {
+        region *g = &h->regions[r];
+        if ( g->first == NULL ) continue;
+        size_t q;
+        for (q = g->dep; q < r; q++) {
+            while ( !__atomic_load_n(&h->regions[q].done, __ATOMIC_ACQUIRE) ) sched_yield();
+        }
+        uint8_t *hi = region_start(h, r + 1);
+        heap_object *p;
+        heap_object *next;
+        for (p = (heap_object *)g->first; p != NULL && (uint8_t *)p < hi; p = next) {
+            uint32_t size = obj_size(p);
+            next = next_marked(h, (uint8_t *)p + size); // before we overwrite p
+            heap_object *to = forwarding_addr(h, p);
+            if ( to != p ) memmove(to, p, size);
+        }
+        __atomic_store_n(&g->done, true, __ATOMIC_RELEASE);
+    }
+}
+
+static size_t claim_region(gc_heap *h) {
+    return (size_t)__atomic_fetch_add(&h->next_region, 1, __ATOMIC_RELAXED);
+}
+
+static uint8_t *region_start(gc_heap *h, size_t r) {
+    return h->start_of_heap + r * REGION_BYTES;
+}
+
+static size_t page_size() {
+    return (size_t)sysconf(_SC_PAGESIZE);
+}
+
+static size_t round_to_page(size_t n) {
+    size_t page = page_size();
+    return (n + page - 1) / page * page;
+}
+
+static size_t mark_words_for(size_t heap_size) {
+    size_t num_granules = (heap_size + WORD_SIZE_IN_BYTES - 1) / WORD_SIZE_IN_BYTES;
+    return (num_granules + BITS_PER_BITMAP_WORD - 1) / BITS_PER_BITMAP_WORD;
+}
+
+static size_t cards_for(size_t heap_size) {
+    return (heap_size + CARD_SIZE - 1) >> GC_CARD_SHIFT;
+}
+
+/* Commit or decommit the memory past heap_size so the heap is size bytes,
+ * and size the side tables' in-use parts to match. Returns false if the OS
+ * won't give us the memory. Only while the world is stopped, and nothing
+ * is allocated past size.
+ */
+static bool set_heap_size(gc_heap *h, size_t size) {
+    size_t committed = round_to_page((size_t)h->heap_size);
+    size_t want = round_to_page(size);
+    if ( want > committed &&
+         mprotect(h->start_of_heap + committed, want - committed, PROT_READ | PROT_WRITE) != 0 ) {
+        return false;
+    }
+    if ( want < committed ) {
+        madvise(h->start_of_heap + want, committed - want, MADV_DONTNEED);
+        mprotect(h->start_of_heap + want, committed - want, PROT_NONE);
+    }
+    h->heap_size = (int)size;
+    h->end_of_heap = h->start_of_heap + size - 1;
+    h->num_mark_words = mark_words_for(size);
+    if ( h->regions != NULL ) h->num_regions = (h->num_mark_words + REGION_WORDS - 1) / REGION_WORDS;
+    if ( h->nursery_start != NULL ) {
+        h->num_cards = cards_for(size);
+        h->pub.card_heap_size = size;
+    }
+    return true;
+}
+
+/* After a full collection, size the heap so live data fills live_ratio
+ * percent of it, leaving room for need more bytes and for promoting a full
+ * nursery, within min_heap_size..max_heap_size. Shrink only once that's
+ * half the heap or less, so a heap near the line doesn't flip flop. If
+ * the OS won't commit more, the heap stays as it is and allocations that
+ * don't fit fail, as in a fixed size heap.
+ */
+static void resize_heap(gc_heap *h, size_t need) {
+    size_t live = (size_t)(h->next_free - h->start_of_heap);
+    size_t want = live * 100 / h->live_ratio + need + h->nursery_size + 1; // old_room() excludes the last byte
+    want = round_to_page(want);
+    if ( want < h->min_heap_size ) want = h->min_heap_size;
+    if ( want > h->max_heap_size ) want = h->max_heap_size;
+    if ( want > (size_t)h->heap_size || want <= (size_t)h->heap_size / 2 ) {
+        if (DEBUG) printf("resize heap from %d to %zu\n", h->heap_size, want);
+        if ( !set_heap_size(h, want) ) {
+            if (DEBUG) printf("can't grow heap to %zu; staying at %d\n", want, h->heap_size);
+        }
+    }
+}
+
+/* Hand the pages past next_free back to the OS. They read as zeros when
+ * next touched, which is how TLABs want them anyway.
+ */
+static void release_free_pages(gc_heap *h) {
+    size_t from = round_to_page((size_t)(h->next_free - h->start_of_heap));
+    size_t to = round_to_page((size_t)h->heap_size);
+    if ( from < to ) madvise(h->start_of_heap + from, to - from, MADV_DONTNEED);
+}
+
+/* Map pages for an object of size bytes, collecting first if that would
+ * take the large object space past its budget. The pages come zeroed.
+ */
+static void *alloc_large(gc_heap *h, size_t size) {
+    unsigned seen = __atomic_load_n(&h->num_collections, __ATOMIC_ACQUIRE);
+    size_t mapped = round_to_page(sizeof(large_object) + size);
+    pthread_mutex_lock(&h->alloc_lock);
+    bool over = h->large_bytes + mapped > h->large_budget;
+    pthread_mutex_unlock(&h->alloc_lock);
+    if ( over ) {
+        stop_the_world(h);
+        if ( __atomic_load_n(&h->num_collections, __ATOMIC_ACQUIRE) == seen ) gc_collect(h);
+        resume_the_world(h);
+    }
+    large_object *l = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if ( l == MAP_FAILED ) return NULL;
+    l->mapped = mapped;
+    l->marked = h->pub.marking; // allocated black
+    pthread_mutex_lock(&h->alloc_lock);
+    l->next = h->large_objects;
+    __atomic_store_n(&h->large_objects, l, __ATOMIC_RELEASE); // a concurrent marker may be looking
+    h->large_bytes += mapped;
+    pthread_mutex_unlock(&h->alloc_lock);
+    return l + 1;
+}
+
+static bool is_large(gc_heap *h, heap_object *p) {
+    if ( __atomic_load_n(&h->large_objects, __ATOMIC_ACQUIRE) == NULL || gc_in_heap(h, p) || in_atomic_space(h, p) ) return false;
+    return h->nursery_start == NULL ||
+           (uint8_t *)p < h->nursery_start || (uint8_t *)p >= h->nursery_start + h->nursery_size;
+}
+
+static inline large_object *large_of(heap_object *p) {
+    return (large_object *)p - 1;
+}
+
+/* gc_mark_object() for p outside the heap */
+static void mark_large_object(gc_heap *h, heap_object *p) {
+    if ( !is_large(h, p) || large_of(p)->marked ) return;
+    large_of(p)->marked = true;
+    h->num_live_objects++;
+    if ( !mark_stack_push(h, p) ) h->gray.overflowed = true;
+}
+
+/* Unmap unmarked large objects, unmark the rest and set the budget for
+ * the next gc() from what survived.
+ */
+static void sweep_large_objects(gc_heap *h) {
+    large_object **prev = &h->large_objects;
+    size_t live = 0;
+    while ( *prev != NULL ) {
+        large_object *l = *prev;
+        if ( l->marked ) {
+            l->marked = false;
+            live += l->mapped;
+            prev = &l->next;
         }
         else {
-            charbuf_add_str(&state, "  ");
-            char *s = ptr_to_str(p);
-            s[strlen(s)-1] = '\0'; // strip \n
-            charbuf_add_str(&state, s);
-            free(s);
-            {
-                // print ptr fields
-                if ( p->metaclass->num_fields>0 ) {
-                    charbuf_add_str(&state, "->[");
-                    int i;
-                    for (i = 0; i < p->metaclass->num_fields; i++) {
-                        int offset_of_ptr_field = p->metaclass->field_offsets[i];
-                        uint8_t *ptr_to_ptr_field = ((uint8_t *) p) + offset_of_ptr_field;
-                        heap_object **obj_ptr_to_ptr_field = (heap_object **) ptr_to_ptr_field;
-                        heap_object *target_obj = *obj_ptr_to_ptr_field;
-                        if ( i>0 ) charbuf_add(&state, ',');
-                        if ( target_obj!=NULL ) {
-                            sprintf(buf, "%ld", gc_rel_addr((heap_object *) target_obj));
-                            charbuf_add_str(&state, buf);
-                        }
-                        else {
-                            charbuf_add_str(&state, "NULL");
-                        }
-                    }
-                    charbuf_add_str(&state, "]");
-                }
-                charbuf_add(&state, '\n');
-            }
+            *prev = l->next;
+            munmap(l, l->mapped);
         }
     }
-    char *s = charbuf_to_str(state);
-    charbuf_free(state);
-    unmark_objects();
-    return s;
+    h->large_bytes = live;
+    h->large_budget = live * 100 / h->live_ratio;
+    if ( h->large_budget < (size_t)h->heap_size ) h->large_budget = (size_t)h->heap_size;
+    if ( h->large_budget < MIN_LARGE_BUDGET ) h->large_budget = MIN_LARGE_BUDGET;
+}
+
+/* Apply slot_fn to the pointer fields of every nth large object starting
+ * with the idth, so n workers can split them.
+ */
+static void scan_large_objects(gc_heap *h, int id, int n, void (*slot_fn)(gc_heap *h, heap_object **)) {
+    large_object *l;
+    int i = 0;
+    for (l = h->large_objects; l != NULL; l = l->next, i++) {
+        if ( i % n != id ) continue;
+        heap_object *p = (heap_object *)(l + 1);
+        type_descriptor *t = obj_desc(p);
+        SCAN_PTR_SLOTS(h, p, t, slot_fn);
+    }
 }
 
+static void free_large_objects(gc_heap *h) {
+    while ( h->large_objects != NULL ) {
+        large_object *l = h->large_objects;
+        h->large_objects = l->next;
+        munmap(l, l->mapped);
+    }
+    h->large_bytes = 0;
+}
 
+/* A zeroed cell of at least size bytes in the atomic space, or NULL if
+ * that's too big for a cell or there's no room even after a gc().
+ */
+static void *alloc_atomic(gc_heap *h, size_t size) {
+    int c;
+    for (c = 0; c < NUM_ATOMIC_CLASSES && atomic_cell_sizes[c] < size; c++) { }
+    if ( c == NUM_ATOMIC_CLASSES ) return NULL;
+    unsigned seen = __atomic_load_n(&h->num_collections, __ATOMIC_ACQUIRE);
+    pthread_mutex_lock(&h->atomic_lock);
+    if ( h->atomic_start == NULL ) reserve_atomic_space(h);
+    uint8_t *p = atomic_cell(h, c);
+    pthread_mutex_unlock(&h->atomic_lock);
+    if ( p == NULL ) {
+        stop_the_world(h);
+        if ( __atomic_load_n(&h->num_collections, __ATOMIC_ACQUIRE) == seen ) gc_collect(h);
+        resume_the_world(h);
+        pthread_mutex_lock(&h->atomic_lock);
+        p = atomic_cell(h, c);
+        pthread_mutex_unlock(&h->atomic_lock);
+    }
+    if ( p != NULL ) {
+        memset(p, 0, size);
+        if ( h->pub.marking ) set_atomic_marked(h, (heap_object *)p); // allocated black
+    }
+    return p;
+}
 
+/* Reserve as much address space as the heap's for atomic blocks; atomic_lock held */
+static void reserve_atomic_space(gc_heap *h) {
+    size_t n = h->max_heap_size > MIN_ATOMIC_RESERVE ? h->max_heap_size : MIN_ATOMIC_RESERVE;
+    h->num_atomic_blocks = (n + ATOMIC_BLOCK_SIZE - 1) / ATOMIC_BLOCK_SIZE;
+    h->atomic_start = mmap(NULL, h->num_atomic_blocks * ATOMIC_BLOCK_SIZE, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    h->atomic_blocks = calloc(h->num_atomic_blocks, sizeof(atomic_block));
+    if ( h->atomic_start == MAP_FAILED || h->atomic_blocks == NULL ) {
+        fprintf(stderr, "gc: can't reserve %zu bytes of address space for atomic objects\n", n);
+        exit(EXIT_FAILURE);
+    }
+    h->atomic_budget = (size_t)h->heap_size / ATOMIC_BLOCK_SIZE;
+    if ( h->atomic_budget < MIN_ATOMIC_BUDGET ) h->atomic_budget = MIN_ATOMIC_BUDGET;
+}
 
-/* Walk all roots and traverse object graph. Mark all p->mark=true for
-   reachable p.  Fill live_objects[], leaving num_live_objects set at number of live.
+/* Claim a free cell of class c, starting a new block of that class if
+ * the budget allows, or return NULL; atomic_lock held.
  */
-static void gc_mark_live() {
-    num_live_objects = 0;
-    for (int i = 0; i < num_roots; i++) {
-        if (DEBUG) printf("root[%d]=%p\n", i, _roots[i]);
-        heap_object *p = *_roots[i];
-        if (p != NULL) {
-            if (DEBUG) printf("root=%s@%p\n", p->metaclass->name, p);
-            if ( gc_in_heap(p) ) {
-                gc_mark_object(p);
-            }
+static uint8_t *atomic_cell(gc_heap *h, int c) {
+    size_t b;
+    for (b = h->atomic_cursor[c]; b < h->num_atomic_blocks; b++) {
+        atomic_block *k = &h->atomic_blocks[b];
+        if ( k->cell_size == 0 ) {
+            if ( h->atomic_blocks_used >= h->atomic_budget ) continue;
+            __atomic_store_n(&k->cell_size, atomic_cell_sizes[c], __ATOMIC_RELEASE); // a concurrent marker may be looking
+            k->num_cells = ATOMIC_BLOCK_SIZE / k->cell_size;
+            h->atomic_blocks_used++;
+        }
+        if ( k->cell_size != atomic_cell_sizes[c] ) continue;
+        int w;
+        for (w = 0; w * BITS_PER_BITMAP_WORD < (int)k->num_cells; w++) {
+            bitmap_word free_cells = ~k->alloc[w];
+            if ( free_cells == 0 ) continue;
+            size_t cell = (size_t)w * BITS_PER_BITMAP_WORD + lowest_set_bit(free_cells);
+            if ( cell >= k->num_cells ) break;
+            k->alloc[w] |= (bitmap_word)1 << (cell % BITS_PER_BITMAP_WORD);
+            h->atomic_cursor[c] = b;
+            return h->atomic_start + b * ATOMIC_BLOCK_SIZE + cell * k->cell_size;
         }
     }
+    h->atomic_cursor[c] = b;
+    return NULL;
 }
 
-/* recursively walk object graph starting from p. */
-static void gc_mark_object(heap_object *p) {
-    if (!p->marked) {
-        int i;
-        if (DEBUG) printf("mark %s@%p\n", p->metaclass->name, p);
-        p->marked = 1;
-        live_objects[num_live_objects++] = p; // track live
-        // check for tracked heap ptrs in this object
-        for (i = 0; i < p->metaclass->num_fields; i++) {
-            int offset_of_ptr_field = p->metaclass->field_offsets[i];
-            uint8_t *ptr_to_ptr_field = ((uint8_t *) p) + offset_of_ptr_field;
-            heap_object **ptr_to_obj_ptr_field = (heap_object **) ptr_to_ptr_field;
-            heap_object *target_obj = *ptr_to_obj_ptr_field;
-            if (target_obj != NULL) {
-                gc_mark_object(target_obj);
-            }
+static inline bool in_atomic_space(gc_heap *h, heap_object *p) {
+    return (size_t)((uint8_t *)p - h->atomic_start) < h->num_atomic_blocks * ATOMIC_BLOCK_SIZE;
+}
+
+/* Set p's bit in its block's mark bitmap and return whether it was already set */
+static bool set_atomic_marked(gc_heap *h, heap_object *p) {
+    size_t off = (size_t)((uint8_t *)p - h->atomic_start);
+    atomic_block *k = &h->atomic_blocks[off / ATOMIC_BLOCK_SIZE];
+    size_t cell = off % ATOMIC_BLOCK_SIZE / __atomic_load_n(&k->cell_size, __ATOMIC_ACQUIRE);
+    bitmap_word bit = (bitmap_word)1 << (cell % BITS_PER_BITMAP_WORD);
+    bitmap_word *w = &k->mark[cell / BITS_PER_BITMAP_WORD];
+    if ( (__atomic_load_n(w, __ATOMIC_RELAXED) & bit) != 0 ) return true;
+    return (__atomic_fetch_or(w, bit, __ATOMIC_RELAXED) & bit) != 0;
+}
+
+/* What's marked is what's allocated; free blocks with nothing marked */
+static void sweep_atomic_space(gc_heap *h) {
+    if ( h->atomic_start == NULL ) return;
+    size_t b;
+    for (b = 0; b < h->num_atomic_blocks; b++) {
+        atomic_block *k = &h->atomic_blocks[b];
+        if ( k->cell_size == 0 ) continue;
+        bitmap_word any = 0;
+        int w;
+        for (w = 0; w < ATOMIC_BITMAP_WORDS; w++) {
+            k->alloc[w] = k->mark[w];
+            k->mark[w] = 0;
+            any |= k->alloc[w];
+        }
+        if ( any == 0 ) {
+            k->cell_size = 0;
+            h->atomic_blocks_used--;
+            madvise(h->atomic_start + b * ATOMIC_BLOCK_SIZE, ATOMIC_BLOCK_SIZE, MADV_DONTNEED);
         }
     }
+    memset(h->atomic_cursor, 0, sizeof(h->atomic_cursor));
+    h->atomic_budget = h->atomic_blocks_used * 100 / h->live_ratio;
+    if ( h->atomic_budget < (size_t)h->heap_size / ATOMIC_BLOCK_SIZE ) h->atomic_budget = (size_t)h->heap_size / ATOMIC_BLOCK_SIZE;
+    if ( h->atomic_budget < MIN_ATOMIC_BUDGET ) h->atomic_budget = MIN_ATOMIC_BUDGET;
+}
+
+static void unmark_atomic_space(gc_heap *h) {
+    size_t b;
+    for (b = 0; b < h->num_atomic_blocks; b++) {
+        memset(h->atomic_blocks[b].mark, 0, sizeof(h->atomic_blocks[b].mark));
+    }
+}
+
+static void start_nursery(gc_heap *h) {
+    h->nursery_start = malloc(h->nursery_size);
+    h->nursery_next = h->nursery_start;
+    h->num_cards = cards_for((size_t)h->heap_size);
+    h->pub.cards = calloc(cards_for(h->max_heap_size), 1);
+    h->card_object = calloc(cards_for(h->max_heap_size), sizeof(uint32_t));
+    if ( h->nursery_start == NULL || h->pub.cards == NULL || h->card_object == NULL ) {
+        fprintf(stderr, "gc: out of memory allocating %zu byte nursery\n", h->nursery_size);
+        exit(EXIT_FAILURE);
+    }
+    h->pub.card_heap_start = (uintptr_t)h->start_of_heap;
+    h->pub.card_heap_size = (size_t)h->heap_size;
+}
+
+static void stop_nursery(gc_heap *h) {
+    free(h->nursery_start);
+    h->nursery_start = h->nursery_next = NULL;
+    h->nursery_size = 0;
+    free(h->pub.cards);
+    h->pub.cards = NULL;
+    free(h->card_object);
+    h->card_object = NULL;
+    h->num_cards = 0;
+    h->pub.card_heap_start = 0;
+    h->pub.card_heap_size = 0;
+}
+
+/* Room in the nursery, and room in the heap to promote all of it? */
+static bool nursery_fits(gc_heap *h, size_t size) {
+    size_t used = (size_t)(h->nursery_next - h->nursery_start);
+    return used + size <= h->nursery_size && used + size <= old_room(h);
+}
+
+static bool in_nursery(gc_heap *h, heap_object *p) {
+    return (uint8_t *)p >= h->nursery_start && (uint8_t *)p < h->nursery_next;
+}
+
+static size_t old_room(gc_heap *h) {
+    return (size_t)(h->end_of_heap - h->next_free);
+}
+
+/* Object p of size bytes now lives in the heap; record it for the cards
+ * whose first byte it covers.
+ */
+static void note_old_object(gc_heap *h, uint8_t *p, size_t size) {
+    size_t off = (size_t)(p - h->start_of_heap);
+    size_t c;
+    for (c = (off + CARD_SIZE - 1) >> GC_CARD_SHIFT; (c << GC_CARD_SHIFT) < off + size; c++) {
+        h->card_object[c] = (uint32_t)off;
+    }
+}
+
+static void dirty_cards(gc_heap *h, uint8_t *p, size_t size) {
+    size_t off = (size_t)(p - h->start_of_heap);
+    memset(h->pub.cards + (off >> GC_CARD_SHIFT), 1, ((off + size - 1) >> GC_CARD_SHIFT) - (off >> GC_CARD_SHIFT) + 1);
+}
+
+/* Compaction moved everything; recompute card_object */
+static void rebuild_card_objects(gc_heap *h) {
+    uint8_t *q = h->start_of_heap;
+    while ( q < h->next_free ) {
+        uint32_t size = obj_size((heap_object *)q);
+        note_old_object(h, q, size);
+        q += size;
+    }
+}
+
+static bool gc_in_heap(gc_heap *h, heap_object *p) {
+    return p >= (heap_object *) h->start_of_heap && p <= (heap_object *) h->end_of_heap;
+}
+
+static inline size_t granule_of(gc_heap *h, uint8_t *p) {
+    return (size_t)(p - h->start_of_heap) / WORD_SIZE_IN_BYTES;
+}
+
+static bool is_marked(gc_heap *h, heap_object *p) {
+    size_t g = granule_of(h, (uint8_t *)p);
+    return (h->mark_bits[g / BITS_PER_BITMAP_WORD] >> (g % BITS_PER_BITMAP_WORD)) & 1;
+}
+
+static void set_marked(gc_heap *h, heap_object *p) {
+    size_t g = granule_of(h, (uint8_t *)p);
+    h->mark_bits[g / BITS_PER_BITMAP_WORD] |= (bitmap_word)1 << (g % BITS_PER_BITMAP_WORD);
+}
+
+static void clear_marks(gc_heap *h) {
+    memset(h->mark_bits, 0, h->num_mark_words * sizeof(bitmap_word));
+    h->num_live_objects = 0;
+}
+
+static inline int popcount(bitmap_word w) {
+#if defined(__GNUC__)
+    return __builtin_popcountll(w);
+#else
+    int n = 0;
+    for (; w != 0; w &= w - 1) n++;
+    return n;
+#endif
+}
+
+static inline int lowest_set_bit(bitmap_word w) {
+#if defined(__GNUC__)
+    return __builtin_ctzll(w);
+#else
+    int i = 0;
+    while ( (w & 1) == 0 ) { w >>= 1; i++; }
+    return i;
+#endif
+}
+
+/* Set n bits of bits starting at bit g */
+static void set_bit_range(bitmap_word *bits, size_t g, size_t n) {
+    while ( n > 0 ) {
+        size_t off = g % BITS_PER_BITMAP_WORD;
+        size_t k = BITS_PER_BITMAP_WORD - off;
+        if ( k > n ) k = n;
+        bitmap_word mask = k == BITS_PER_BITMAP_WORD ? ~(bitmap_word)0 : (((bitmap_word)1 << k) - 1) << off;
+        bits[g / BITS_PER_BITMAP_WORD] |= mask;
+        g += k;
+        n -= k;
+    }
+}
+
+/* set_bit_range() for when other threads may set bits in the same words */
+static void set_bit_range_shared(bitmap_word *bits, size_t g, size_t n) {
+    while ( n > 0 ) {
+        size_t off = g % BITS_PER_BITMAP_WORD;
+        size_t k = BITS_PER_BITMAP_WORD - off;
+        if ( k > n ) k = n;
+        bitmap_word mask = k == BITS_PER_BITMAP_WORD ? ~(bitmap_word)0 : (((bitmap_word)1 << k) - 1) << off;
+        __atomic_fetch_or(&bits[g / BITS_PER_BITMAP_WORD], mask, __ATOMIC_RELAXED);
+        g += k;
+        n -= k;
+    }
+}
+
+/* Where LISP2 compaction will move live object p */
+static heap_object *forwarding_addr(gc_heap *h, heap_object *p) {
+    size_t g = granule_of(h, (uint8_t *)p);
+    size_t b = g / BITS_PER_BITMAP_WORD;
+    bitmap_word below = h->live_bits[b] & (((bitmap_word)1 << (g % BITS_PER_BITMAP_WORD)) - 1);
+    return (heap_object *)(h->start_of_heap + (h->block_offset[b] + popcount(below)) * WORD_SIZE_IN_BYTES);
+}
+
+/* Return first marked object at or after from, or NULL if none. Skips
+ * unmarked stretches of the heap 64 granules at a time.
+ */
+static heap_object *next_marked(gc_heap *h, uint8_t *from) {
+    if ( from >= h->next_free ) return NULL;
+    size_t g = granule_of(h, from);
+    size_t w = g / BITS_PER_BITMAP_WORD;
+    bitmap_word bits = h->mark_bits[w] & (~(bitmap_word)0 << (g % BITS_PER_BITMAP_WORD));
+    while ( bits == 0 ) {
+        if ( ++w >= h->num_mark_words ) return NULL;
+        bits = h->mark_bits[w];
+    }
+    g = w * BITS_PER_BITMAP_WORD + lowest_set_bit(bits);
+    uint8_t *p = h->start_of_heap + g * WORD_SIZE_IN_BYTES;
+    return p < h->next_free ? (heap_object *)p : NULL;
+}
+
+/* Double the capacity of array (initial_size if empty), updating *size.
+ * Running out of memory for collector bookkeeping is fatal.
+ */
+static void *grow_array(void *array, int *size, int initial_size, size_t elem_size) {
+    int n = *size == 0 ? initial_size : *size * 2;
+    void *bigger = realloc(array, n * elem_size);
+    if ( bigger == NULL ) {
+        fprintf(stderr, "gc: out of memory growing internal array to %d elements\n", n);
+        exit(EXIT_FAILURE);
+    }
+    *size = n;
+    return bigger;
 }
 
-static bool gc_in_heap(heap_object *p) {
-    return p >= (heap_object *) start_of_heap && p <= (heap_object *) end_of_heap;
+/** Allocate size bytes in the nursery, heap or large object space; if full, gc_minor() or gc() */
+static void *gc_alloc_space(gc_heap *h, size_t size) {
+    if ( h->incremental_budget > 0 || h->concurrent ) mark_incrementally(h);
+    if ( h->large_object_size > 0 && size >= h->large_object_size ) return alloc_large(h, size);
+    bool young = h->nursery_start != NULL && size <= h->nursery_size / MAX_NURSERY_OBJECT_FRACTION;
+    for (;;) {
+        unsigned seen = __atomic_load_n(&h->num_collections, __ATOMIC_ACQUIRE);
+        void *p;
+        if ( h->nursery_start != NULL && !young ) {
+            p = alloc_old(h, size);
+        }
+        else if ( size <= MAX_TLAB_OBJECT ) {
+            p = refill_tlab(h, size) ? gc_tlab_bump(h, size) : NULL;
+        }
+        else if ( young ) {
+            size_t n = size;
+            pthread_mutex_lock(&h->alloc_lock);
+            p = bump_nursery(h, size, &n);
+            pthread_mutex_unlock(&h->alloc_lock);
+        }
+        else {
+            size_t n = size;
+            p = bump_heap(h, size, &n);
+        }
+        if ( p != NULL ) return p;
+        if ( !collect_for_alloc(h, seen, young, size) ) {
+            if ( !young ) return NULL; // oh well, no room. puke
+            young = false; // gc_minor() couldn't make room; try the heap
+        }
+    }
 }
 
-/** Allocate size bytes in the heap; if full, gc() */
-static void *gc_alloc_space(size_t size) {
-	size = request2size(size);
-    if (next_free + size > end_of_heap) {
-        gc(); // try to collect        
-        if (next_free + size > end_of_heap) { // try again
-            return NULL;                      // oh well, no room. puke
+/* Collect because an allocation of size bytes failed, unless another thread
+ * collected since we looked (seen), and say whether it's worth retrying.
+ * Whether there's room is decided before the world restarts, as other
+ * threads may fill the space again before we retry. young failures need
+ * only a minor collection, plus a full one if the heap can't take the next
+ * nursery's worth of promotions.
+ */
+static bool collect_for_alloc(gc_heap *h, unsigned seen, bool young, size_t size) {
+    stop_the_world(h);
+    bool room = true;
+    if ( __atomic_load_n(&h->num_collections, __ATOMIC_ACQUIRE) == seen ) {
+        if ( young ) {
+            gc_collect_nursery(h);
+            if ( old_room(h) < h->nursery_size ) gc_collect(h); // make room to promote next time
+            room = nursery_fits(h, size);
+        }
+        else {
+            gc_collect(h); // empties the nursery too
+            if ( size > old_room(h) ) resize_heap(h, size);
+            room = size <= old_room(h);
         }
     }
+    resume_the_world(h);
+    return room;
+}
+
+/* Replace this thread's TLAB with a zeroed chunk of at least size bytes from
+ * the nursery, if there is one, or the heap. Retiring the old one first lets
+ * its unused tail rejoin the space if nothing was carved after it.
+ */
+static bool refill_tlab(gc_heap *h, size_t size) {
+    gc_tlab *t = &my_mutator(h)->tlab;
+    size_t n = TLAB_SIZE;
+    uint8_t *p;
+    if ( h->nursery_start != NULL ) {
+        pthread_mutex_lock(&h->alloc_lock);
+        retire_tlab(h, t);
+        p = bump_nursery(h, size, &n);
+        pthread_mutex_unlock(&h->alloc_lock);
+    }
+    else {
+        retire_tlab(h, t);
+        p = bump_heap(h, size, &n);
+    }
+    if ( p == NULL ) return false;
+    memset(p, 0, n);
+    t->next = p;
+    t->end = p + n;
+    return true;
+}
+
+/* Take min(*n, what's left) but at least size bytes from next_free, setting
+ * *n to what we got. Without a nursery threads race for next_free, so CAS.
+ */
+static uint8_t *bump_heap(gc_heap *h, size_t size, size_t *n) {
+    uint8_t *p = __atomic_load_n(&h->next_free, __ATOMIC_RELAXED);
+    size_t take;
+    do {
+        size_t avail = (size_t)(h->end_of_heap - p);
+        if ( size > avail ) return NULL;
+        take = *n < avail ? *n : avail;
+        if ( take < size ) take = size;
+    } while ( !__atomic_compare_exchange_n(&h->next_free, &p, p + take, true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED) );
+    *n = take;
+    return p;
+}
+
+/* Like bump_heap() but from the nursery, keeping nursery_fits(); alloc_lock held */
+static uint8_t *bump_nursery(gc_heap *h, size_t size, size_t *n) {
+    if ( !nursery_fits(h, size) ) return NULL;
+    size_t used = (size_t)(h->nursery_next - h->nursery_start);
+    size_t avail = h->nursery_size - used;
+    if ( old_room(h) - used < avail ) avail = old_room(h) - used;
+    size_t take = *n < avail ? *n : avail;
+    if ( take < size ) take = size;
+    uint8_t *p = h->nursery_next;
+    h->nursery_next += take;
+    *n = take;
+    return p;
+}
 
-    void *p = next_free;
-    next_free += size;
+/* Allocate in the heap behind a nursery, keeping room to promote it */
+static void *alloc_old(gc_heap *h, size_t size) {
+    void *p = NULL;
+    pthread_mutex_lock(&h->alloc_lock);
+    size_t reserve = (size_t)(h->nursery_next - h->nursery_start); // to promote the nursery
+    if ( h->next_free + size + reserve <= h->end_of_heap ) {
+        p = h->next_free;
+        h->next_free += size;
+        note_old_object(h, p, size);
+        dirty_cards(h, p, size); // so stores that initialize it needn't use the barrier
+    }
+    pthread_mutex_unlock(&h->alloc_lock);
     return p;
 }
 
-static void print_ptr(heap_object *p) {
-    if (p->metaclass == &String_metaclass) {
-        printf("%s[%d]@%ld\n", p->metaclass->name,
-                ((String *) p)->length, gc_rel_addr(p));
-    } else printf("%s@%ld\n", p->metaclass->name, gc_rel_addr(p));
+/* Hand back the unused tail of t if it's at the top of its space; else
+ * leave a type 0 filler object there so the heap stays walkable. Callers
+ * hold alloc_lock or have stopped the world if there is a nursery.
+ */
+static void retire_tlab(gc_heap *h, gc_tlab *t) {
+    if ( t->next == NULL ) return;
+    uint8_t *end = t->end;
+    bool returned;
+    if ( h->nursery_start != NULL ) {
+        returned = end == h->nursery_next;
+        if ( returned ) h->nursery_next = t->next;
+    }
+    else {
+        returned = __atomic_compare_exchange_n(&h->next_free, &end, t->next, false,
+                                               __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+    }
+    if ( !returned && t->end > t->next ) {
+        ((heap_object *)t->next)->header = gc_make_header((uint32_t)(t->end - t->next), 0);
+    }
+    t->next = t->end = NULL;
+}
+
+static void retire_my_tlab(gc_heap *h) {
+    gc_tlab *t = &my_mutator(h)->tlab;
+    if ( h->nursery_start != NULL ) pthread_mutex_lock(&h->alloc_lock);
+    retire_tlab(h, t);
+    if ( h->nursery_start != NULL ) pthread_mutex_unlock(&h->alloc_lock);
+}
+
+static void print_ptr(gc_heap *h, heap_object *p) {
+    if (obj_type(p) == &String_metaclass) {
+        printf("%s[%d]@%ld\n", obj_type(p)->name,
+                ((String *) p)->length, gc_rel_addr(h, p));
+    } else printf("%s@%ld\n", obj_type(p)->name, gc_rel_addr(h, p));
 }
 
-static char *ptr_to_str(heap_object *p) {
+static char *ptr_to_str(gc_heap *h, heap_object *p) {
     char *buf = malloc(200);
-    if (p->metaclass == &String_metaclass) {
+    if (obj_type(p) == &String_metaclass) {
         String *s = (String *) p;
         sprintf(buf, "%04ld:String[%ld+%d]=\"%s\"\n",
-                gc_rel_addr(p), sizeof (String), ((String *) p)->length + 1, s->str);
+                gc_rel_addr(h, p), sizeof (String), ((String *) p)->length + 1, s->str);
     }
     else {
-        sprintf(buf, "%04ld:%s[%d]\n", gc_rel_addr(p), p->metaclass->name, gc_object_size(p));
+        sprintf(buf, "%04ld:%s[%d]\n", gc_rel_addr(h, p), obj_type(p)->name, gc_object_size(p));
     }
     return buf;
 }
 
 static int gc_object_size(heap_object *p) {
-    if (p->metaclass == &String_metaclass) {
+    if (obj_type(p) == &String_metaclass) {
         int n = ((String *) p)->length;
-        return p->metaclass->size + n + 1;
+        return obj_type(p)->size + n + 1;
     }
-    return p->metaclass->size;
+    return obj_type(p)->size;
 }
 
-static void gc_dump() {
+static void gc_dump(gc_heap *h) {
     printf("--------------\n");
-    char *s = gc_get_state();
+    char *s = gc_heap_get_state(h);
     printf("%s", s);
     free(s);
 }
 
-static void print_addr_array(heap_object **array, int len) {
+static void print_addr_array(gc_heap *h, heap_object **array, int len) {
     int i;
 
-    for (i = 0; i < len; i++) printf("%ld ", gc_rel_addr(array[i]));
+    for (i = 0; i < len; i++) printf("%ld ", gc_rel_addr(h, array[i]));
     putchar('\n');
 }
 
@@ -326,26 +2688,25 @@ static char *long_array_to_str(unsigned long *array, int len) {
 /* Get a string with a char per uint8_t of heap. _=live, .=free.
    Chop down to avoid empty space after last live object.
  */
-static char *gc_viz_heap() {
-    gc_mark_live(); // fill live_objects[]
-    char *map = malloc(heap_size);
-    memset(map, '.', heap_size);
-    int i;
+static char *gc_viz_heap(gc_heap *h) {
+    stop_the_world(h);
+    mark_for_inspection(h);
+    char *map = malloc(h->heap_size);
+    memset(map, '.', h->heap_size);
+    heap_object *p;
     int last = 0;
-    for (i = 0; i < num_live_objects; i++) {
-        heap_object *p = live_objects[i];
-        if (p == NULL) continue;
-        int start = (int) gc_rel_addr(p);
+    for (p = next_marked(h, h->start_of_heap); p != NULL; p = next_marked(h, (uint8_t *)p + obj_size(p))) {
+        int start = (int) gc_rel_addr(h, p);
         int j;
         map[start] = '[';
         int n = gc_object_size(p);
-        if (start >= heap_size || start + n >= heap_size) {
+        if (start >= h->heap_size || start + n >= h->heap_size) {
             printf("object straddles end of heap; start=%d, size=%d, heap_size=%d\n",
-                    start, n, heap_size);
+                    start, n, h->heap_size);
             continue;
         }
-        char *name = p->metaclass->name;
-        int nlen = (int) strlen(p->metaclass->name);
+        const char *name = obj_type(p)->name;
+        int nlen = (int) strlen(obj_type(p)->name);
         int min = nlen < n ? nlen : n;
         strncpy(&map[start + 1], name, min);
         for (j = start + 1 + nlen; j < start + n - 1; j++) {
@@ -355,28 +2716,20 @@ static char *gc_viz_heap() {
         last = start + n;
     }
     map[last] = '\0';
-    unmark_objects();
+    unmark_objects(h);
+    resume_the_world(h);
     return map;
 }
 
 /** Convert pointers in heap to 0..heapsize-1 */
-static unsigned long gc_rel_addr(heap_object *p) {
+static unsigned long gc_rel_addr(gc_heap *h, heap_object *p) {
     if ( p==NULL ) return 0;
-    return ((uint8_t *) p)-start_of_heap;
+    return ((uint8_t *) p)-h->start_of_heap;
 }
 
-/* qsort address comparison function */
-static int addrcmp(const void *a, const void *b) {
-    void **p = (void **) a;
-    void **q = (void **) b;
-    return *p - *q;
-}
-
-static void unmark_objects() {
-    // done with live_objects, wack it
-    int i;
-    for (i = 0; i < num_live_objects; i++) {
-        live_objects[i]->marked = 0; // turn off bits set during bogus gc_mark
-    }
-    num_live_objects = 0;
+static void unmark_objects(gc_heap *h) {
+    clear_marks(h); // turn off bits set during bogus gc_mark
+    large_object *l;
+    for (l = h->large_objects; l != NULL; l = l->next) l->marked = false;
+    unmark_atomic_space(h);
 }
\ No newline at end of file
@@ -1,21 +1,55 @@
 #ifndef GC_H_
 #define GC_H_
 
+#include <stddef.h>
+#include <stdint.h>
 #include <stdbool.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-/* stuff that every instance in the heap must have at the beginning */
+/* Describes the layout of one type of heap object; one instance per type */
+typedef struct {
+	const char *name;		// "Employee"
+	int size;				// size in bytes of an instance, including heap_object header
+	int num_fields;			// how many managed pointer fields in an instance
+	uint32_t type_id;		// index into the collector's type table; 0 until registered
+	int field_offsets[];	// byte offset of each managed pointer field from start of object
+} object_metadata;
+
+/* One word at the start of every instance in the heap:
+ *
+ *   63           32 31          8 7     1  0
+ *  +---------------+-------------+-------+---+
+ *  | size in bytes | type_id     | flags | 1 |
+ *  +---------------+-------------+-------+---+
+ *
+ * size includes the header and is word aligned. type_id indexes the type
+ * table of object_metadata. Bit 0 is always set so a header can never be
+ * mistaken for a (word aligned) pointer, which threaded compaction relies
+ * on. Flag bits are spare for pin/age bits. Mark bits live in a side bitmap
+ * and LISP2 forwarding addresses in a side table, so neither costs header space.
+ */
+#define GC_HEADER_TAG		((uint64_t)1)
+#define GC_TYPE_ID_SHIFT	8
+#define GC_SIZE_SHIFT		32
+
 typedef struct _heap_object {
-	uint32_t size;  // 31 bits for size and 1 bit for inuse/free; size includes header data
-	uint8_t marked;	// used during the mark phase of garbage collection
-	void (*chase_ptrs)(struct _heap_object *p); // how to chase pointer fields of this type of object
-	struct heap_object *forwarded; 				// where we've moved this object during collection
+	uint64_t header;
+#ifndef __cplusplus // C++ can't embed a struct ending in a flexible array
 	unsigned char mem[]; // nothing allocated; just a label to location of actual instance data
+#endif
 } heap_object;
 
+typedef struct {
+	heap_object header;
+	int length;				// number of chars, not counting the terminating '\0'
+	char str[];
+} String;
+
+extern object_metadata String_metaclass;
+
 // GC interface
 
 /* Initialize a heap with a certain size for use with the garbage collector */
@@ -28,19 +62,187 @@ extern void gc_done();
  * to the start of the heap.
  */
 extern void gc();
-extern heap_object *gc_alloc(size_t size, void (*chase_ptrs)(struct _heap_object *p));
+
+/* How gc() slides live objects down: LISP2 computes forwarding addresses
+ * from a side table of live bytes per heap block; threaded (Jonkers) instead
+ * links the slots that point at an object through its header word.
+ */
+typedef enum { GC_COMPACT_LISP2, GC_COMPACT_THREADED } gc_compaction;
+extern void gc_set_compaction(gc_compaction c);
+
+/* Collect with n threads (default 1). Marking splits the roots and
+ * balances the traversal by work stealing; LISP2 compaction works heap
+ * region by region. Takes effect at the next gc_init(), which starts the
+ * threads; gc_done() stops them. Each heap has its own threads.
+ */
+extern void gc_set_gc_threads(int n);
+
+/* Allocate small objects in a nursery of size bytes (default 0, none) in
+ * front of the compacting heap. When it fills, gc_minor() copies its
+ * survivors into the heap, finding old-to-young pointers through the card
+ * table that gc_store_ptr() maintains. Takes effect at the next gc_init().
+ * With a nursery, every pointer store into a heap object must go through
+ * gc_store_ptr().
+ */
+extern void gc_set_nursery_size(int size);
+
+/* Let heaps grow to size bytes (default 0: they stay the size given to
+ * gc_init()). A heap reserves that much address space up front but only
+ * commits what it uses. After each gc() it grows or shrinks, never below
+ * its gc_init() size, so live data fills about gc_set_live_ratio() percent
+ * of it (default 50), and it hands the free pages past the last live
+ * object back to the OS. A heap also grows when it can't otherwise fit an
+ * allocation. Takes effect at the next gc_init().
+ */
+extern void gc_set_max_heap_size(long size);
+extern void gc_set_live_ratio(int percent);
+
+/* Give objects of size bytes or more (default 64K; at least 32K+8; 0 for
+ * none) pages of their own outside the heap. gc() marks them like the
+ * rest but never copies them; it unmaps the dead ones. They don't count
+ * toward the heap size; allocating enough of them triggers a gc().
+ */
+extern void gc_set_large_object_size(int size);
+
+/* Mark incrementally (default 0: no), in slices of at most usec
+ * microseconds with the world stopped. Once half the heap's free space
+ * is gone, allocation starts a marking cycle and then does a slice of
+ * marking work, in proportion to what it allocated, each time a thread
+ * needs a new TLAB. gc() then only has to remark what the roots reach and
+ * compact. While marking, every pointer store into a heap object must go
+ * through gc_store_ptr(). Ignored with a nursery.
+ */
+extern void gc_set_incremental_budget(long usec);
+
+/* Mark on a background thread (default false). A heap starts one at
+ * gc_init(); once half its free space is gone, allocation stops the world
+ * just long enough to shade the roots and then the thread traces the heap
+ * while mutators run. gc() only has to take over whatever is left gray
+ * and compact. As with incremental marking, every pointer store into a
+ * heap object must go through gc_store_ptr(). Ignored with a nursery.
+ */
+extern void gc_set_concurrent_marking(bool on);
+
+/* Collect just the nursery, promoting everything live in it */
+extern void gc_minor();
+
+/* Add a type to the collector's type table, deriving its pointer bitmap from
+ * field_offsets, and return its type_id. Registering again is a no-op and
+ * gc_alloc() registers types it hasn't seen, so calling this is optional.
+ */
+extern uint32_t gc_register_type(object_metadata *metaclass);
 extern void gc_add_addr_of_root(heap_object **p);
 
+/* Allocate an object with no pointer fields, or a String, in the atomic
+ * space: blocks of same-sized cells that gc() marks by address without
+ * reading or scanning the objects, never moves, and sweeps a block at a
+ * time from its mark bitmap. Text and numeric buffers then cost tracing
+ * nothing. Objects bigger than 2K come from the heap as usual.
+ */
+extern heap_object *gc_alloc_atomic(object_metadata *metaclass);
+extern String *gc_alloc_string_atomic(int size);
+
+/* Threads other than the one that called gc_init() must register before
+ * touching the heap and unregister before exiting; each has its own roots.
+ * gc() stops every registered thread at a safepoint: allocation is one,
+ * and a thread that runs a long time without allocating should call
+ * gc_safepoint(). A thread about to block (join, I/O, lock) brackets that
+ * with gc_blocking_begin/end so collections needn't wait for it; it must
+ * not touch the heap in between.
+ */
+extern void gc_register_thread();
+extern void gc_unregister_thread();
+extern void gc_blocking_begin();
+extern void gc_blocking_end();
+
+/* An independent heap. The gc_xxx() calls above work on a default heap
+ * made by gc_init(); gc_heap_xxx(h, ...) do the same on heap h. Heaps
+ * share only registered types, so threads can each use and collect their
+ * own heap without synchronizing, and gc_heap_free() throws a whole heap
+ * away without looking at what's in it. Settings from gc_set_*() apply to
+ * heaps created afterwards.
+ */
+typedef struct gc_heap gc_heap;
+
+extern gc_heap *gc_heap_new(int size);
+extern void gc_heap_free(gc_heap *h);
+extern heap_object *gc_heap_alloc_atomic(gc_heap *h, object_metadata *metaclass);
+extern String *gc_heap_alloc_string_atomic(gc_heap *h, int size);
+extern void gc_heap_collect(gc_heap *h);
+extern void gc_heap_minor(gc_heap *h);
+extern void gc_heap_add_addr_of_root(gc_heap *h, heap_object **p);
+extern int gc_heap_num_roots(gc_heap *h);
+extern void gc_heap_set_num_roots(gc_heap *h, int roots);
+extern void gc_heap_register_thread(gc_heap *h);
+extern void gc_heap_unregister_thread(gc_heap *h);
+extern void gc_heap_blocking_begin(gc_heap *h);
+extern void gc_heap_blocking_end(gc_heap *h);
+extern void gc_heap_set_compaction(gc_heap *h, gc_compaction c);
+extern void gc_heap_set_mark_stack_limit(gc_heap *h, int n);
+extern void gc_heap_set_live_ratio(gc_heap *h, int percent);
+extern void gc_heap_set_large_object_size(gc_heap *h, int size);
+extern void gc_heap_set_incremental_budget(gc_heap *h, long usec);
+extern char *gc_heap_get_state(gc_heap *h);
+extern long gc_heap_highwater_of(gc_heap *h);
+extern long gc_heap_size_of(gc_heap *h);
+
+extern gc_heap *gc_default_heap;
+
 #define gc_begin_func()		int __save = gc_num_roots()
 #define gc_end_func()		gc_set_num_roots(__save)
 #define gc_add_root(p)		gc_add_addr_of_root((heap_object **)&(p));
 
+#define gc_heap_begin_func(h)	int __save = gc_heap_num_roots(h)
+#define gc_heap_end_func(h)		gc_heap_set_num_roots(h, __save)
+#define gc_heap_add_root(h, p)	gc_heap_add_addr_of_root(h, (heap_object **)&(p));
+
+/* The start of every gc_heap: what the inline allocator and write barrier
+ * read. The rest of the heap is private to gc.c.
+ */
+typedef struct {
+	int stop_requested;			// a thread is waiting to collect; see gc_heap_safepoint()
+	uint8_t *cards;				// card table for gc_heap_store_ptr()
+	uintptr_t card_heap_start;
+	size_t card_heap_size;		// 0 with no nursery
+	int marking;				// GC_MARKING_xxx if a mark is under way; see gc_heap_shade()
+} gc_heap_public;
+
+#define GC_MARKING_INCREMENTAL	1	// the barrier shades what's stored (Dijkstra)
+#define GC_MARKING_SATB			2	// the barrier shades what's overwritten (Yuasa)
+
+#define GC_HEAP_PUBLIC(h)	((gc_heap_public *)(h))
+
+extern void gc_heap_shade(gc_heap *h, heap_object *p);
+
+/* Write barrier: obj->field = value, dirtying the card holding the field
+ * if obj is in the compacting heap so gc_minor() finds old-to-young pointers.
+ * During incremental marking it shades value and during concurrent marking
+ * the pointer value replaces, so marking can't miss either. The store is
+ * atomic as a concurrent marker may be reading the field.
+ */
+#define gc_heap_store_ptr(h, obj, field, value) \
+	do { \
+		gc_heap_public *_gc_h = GC_HEAP_PUBLIC(h); \
+		__typeof__((obj)->field) _gc_v = (value); \
+		if ( _gc_h->marking == GC_MARKING_SATB ) gc_heap_shade((h), (heap_object *)(obj)->field); \
+		__atomic_store_n(&(obj)->field, _gc_v, __ATOMIC_RELAXED); \
+		uintptr_t _gc_off = (uintptr_t)&(obj)->field - _gc_h->card_heap_start; \
+		if ( _gc_off < _gc_h->card_heap_size ) _gc_h->cards[_gc_off >> GC_CARD_SHIFT] = 1; \
+		if ( _gc_h->marking == GC_MARKING_INCREMENTAL ) gc_heap_shade((h), (heap_object *)_gc_v); \
+	} while (0)
+
+#define gc_store_ptr(obj, field, value)	gc_heap_store_ptr(gc_default_heap, obj, field, value)
+
+#define GC_CARD_SHIFT		9 // 512 byte cards
+
 // peek into internals for testing and hidden use in macros
 
 extern char *gc_get_state();
 extern long gc_heap_highwater();
+extern long gc_heap_size();
 extern int gc_num_roots();
 extern void gc_set_num_roots(int roots);
+extern void gc_set_mark_stack_limit(int n);
 
 static const size_t WORD_SIZE_IN_BYTES = sizeof(void *);
 static const size_t ALIGN_MASK = WORD_SIZE_IN_BYTES - 1;
@@ -62,6 +264,73 @@ static inline size_t request2size(size_t n) {
 	return align_to_word_boundary(size_with_header(n));
 }
 
+static inline uint64_t gc_make_header(uint32_t size, uint32_t type_id) {
+	return ((uint64_t)size << GC_SIZE_SHIFT) | ((uint64_t)type_id << GC_TYPE_ID_SHIFT) | GC_HEADER_TAG;
+}
+
+#ifdef __cplusplus
+#define GC_THREAD_LOCAL thread_local
+#else
+#define GC_THREAD_LOCAL _Thread_local
+#endif
+
+/* Thread-local allocation buffer: a zeroed chunk of a heap (or its
+ * nursery) that only its thread bumps through, so allocation needs no
+ * atomics. gc_my_tlab is the calling thread's in the heap it last used.
+ */
+typedef struct {
+	uint8_t *next;
+	uint8_t *end;
+	gc_heap *heap;
+} gc_tlab;
+
+extern GC_THREAD_LOCAL gc_tlab *gc_my_tlab;
+extern heap_object *gc_heap_alloc_slow(gc_heap *h, object_metadata *metaclass);
+extern String *gc_heap_alloc_string_slow(gc_heap *h, int size);
+extern void gc_heap_safepoint_slow(gc_heap *h);
+
+/* Park here if another thread is waiting to collect h */
+static inline void gc_heap_safepoint(gc_heap *h) {
+	if ( __atomic_load_n(&GC_HEAP_PUBLIC(h)->stop_requested, __ATOMIC_ACQUIRE) ) gc_heap_safepoint_slow(h);
+}
+
+static inline uint8_t *gc_tlab_bump(gc_heap *h, size_t size) {
+	gc_tlab *t = gc_my_tlab;
+	if ( t == NULL || t->heap != h ) return NULL;
+	uint8_t *p = t->next;
+	if ( size > (size_t)(t->end - p) ) return NULL;
+	t->next = p + size;
+	return p;
+}
+
+static inline heap_object *gc_heap_alloc(gc_heap *h, object_metadata *metaclass) {
+	gc_heap_safepoint(h);
+	uint32_t type_id = __atomic_load_n(&metaclass->type_id, __ATOMIC_ACQUIRE);
+	size_t size = align_to_word_boundary((size_t)metaclass->size);
+	uint8_t *p = type_id != 0 ? gc_tlab_bump(h, size) : NULL;
+	if ( p == NULL ) return gc_heap_alloc_slow(h, metaclass);
+	heap_object *o = (heap_object *)p;
+	o->header = gc_make_header((uint32_t)size, type_id);
+	return o;
+}
+
+static inline String *gc_heap_alloc_string(gc_heap *h, int size) {
+	gc_heap_safepoint(h);
+	uint32_t type_id = __atomic_load_n(&String_metaclass.type_id, __ATOMIC_ACQUIRE);
+	/* size for struct String, the String itself, and null char */
+	size_t n = align_to_word_boundary(sizeof(String) + size + 1);
+	uint8_t *p = type_id != 0 ? gc_tlab_bump(h, n) : NULL;
+	if ( p == NULL ) return gc_heap_alloc_string_slow(h, size);
+	String *s = (String *)p;
+	s->header.header = gc_make_header((uint32_t)n, type_id);
+	s->length = size;
+	return s;
+}
+
+static inline void gc_safepoint() { gc_heap_safepoint(gc_default_heap); }
+static inline heap_object *gc_alloc(object_metadata *metaclass) { return gc_heap_alloc(gc_default_heap, metaclass); }
+static inline String *gc_alloc_string(int size) { return gc_heap_alloc_string(gc_default_heap, size); }
+
 #ifdef __cplusplus
 }
 #endif
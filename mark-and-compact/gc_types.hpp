@@ -0,0 +1,116 @@
+#ifndef GC_TYPES_HPP_
+#define GC_TYPES_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include "gc.h"
+
+/* Compile-time object_metadata for C++ structs. Instead of writing the
+ * offsets table by hand, declare which fields are managed pointers:
+ *
+ *   struct Employee {
+ *       heap_object header;
+ *       int ID;
+ *       String *name;
+ *       Employee *mgr;
+ *   };
+ *   GC_TYPE(Employee, name, mgr)
+ *   GC_LEAF_TYPE(Point)             // no managed pointers
+ *
+ *   Employee *e = gc_new<Employee>();
+ *
+ * The offsets come from offsetof() and are checked with static_assert, and
+ * the metadata is a constant-initialized static, so there is no startup
+ * work; the collector derives the type's pointer bitmap from it when the
+ * type is first registered or allocated. GC_TYPE takes up to 16 fields.
+ */
+
+/* Same layout as object_metadata but with a fixed-size field_offsets array,
+ * which C++ can initialize statically where it can't a flexible array member.
+ */
+template <int N>
+struct gc_metadata_layout {
+    const char *name;
+    int size;
+    int num_fields;
+    uint32_t type_id;
+    int field_offsets[N > 0 ? N : 1];
+};
+
+static_assert(offsetof(gc_metadata_layout<1>, field_offsets) == offsetof(object_metadata, field_offsets),
+              "gc_metadata_layout must match object_metadata");
+
+/* Specialized for each heap type by GC_TYPE/GC_LEAF_TYPE */
+template <typename T>
+struct gc_type;
+
+template <typename T>
+T *gc_new() {
+    return reinterpret_cast<T *>(gc_alloc(gc_type<T>::metadata()));
+}
+
+template <typename T>
+constexpr bool gc_is_heap_type() {
+    return std::is_standard_layout<T>::value &&
+           std::is_same<typename std::remove_cv<decltype(T::header)>::type, heap_object>::value &&
+           offsetof(T, header) == 0;
+}
+
+#define GC_FIELD_OFFSET(T, f) \
+    static_cast<int>(offsetof(T, f))
+#define GC_CHECK_FIELD(T, f) \
+    static_assert(std::is_pointer<decltype(T::f)>::value, #T "." #f " is not a pointer"); \
+    static_assert(offsetof(T, f) % sizeof(void *) == 0, #T "." #f " is not word aligned");
+
+#define GC_NARGS(...) GC_NARGS_(__VA_ARGS__, 16,15,14,13,12,11,10,9,8,7,6,5,4,3,2,1)
+#define GC_NARGS_(_1,_2,_3,_4,_5,_6,_7,_8,_9,_10,_11,_12,_13,_14,_15,_16,N,...) N
+#define GC_CAT(a, b) GC_CAT_(a, b)
+#define GC_CAT_(a, b) a##b
+
+/* Apply M(T, f) to each field f, separated by SEP */
+#define GC_MAP(M, SEP, T, ...) GC_CAT(GC_MAP_, GC_NARGS(__VA_ARGS__))(M, SEP, T, __VA_ARGS__)
+#define GC_MAP_1(M, SEP, T, a) M(T, a)
+#define GC_MAP_2(M, SEP, T, a, ...) M(T, a) SEP() GC_MAP_1(M, SEP, T, __VA_ARGS__)
+#define GC_MAP_3(M, SEP, T, a, ...) M(T, a) SEP() GC_MAP_2(M, SEP, T, __VA_ARGS__)
+#define GC_MAP_4(M, SEP, T, a, ...) M(T, a) SEP() GC_MAP_3(M, SEP, T, __VA_ARGS__)
+#define GC_MAP_5(M, SEP, T, a, ...) M(T, a) SEP() GC_MAP_4(M, SEP, T, __VA_ARGS__)
+#define GC_MAP_6(M, SEP, T, a, ...) M(T, a) SEP() GC_MAP_5(M, SEP, T, __VA_ARGS__)
+#define GC_MAP_7(M, SEP, T, a, ...) M(T, a) SEP() GC_MAP_6(M, SEP, T, __VA_ARGS__)
+#define GC_MAP_8(M, SEP, T, a, ...) M(T, a) SEP() GC_MAP_7(M, SEP, T, __VA_ARGS__)
+#define GC_MAP_9(M, SEP, T, a, ...) M(T, a) SEP() GC_MAP_8(M, SEP, T, __VA_ARGS__)
+#define GC_MAP_10(M, SEP, T, a, ...) M(T, a) SEP() GC_MAP_9(M, SEP, T, __VA_ARGS__)
+#define GC_MAP_11(M, SEP, T, a, ...) M(T, a) SEP() GC_MAP_10(M, SEP, T, __VA_ARGS__)
+#define GC_MAP_12(M, SEP, T, a, ...) M(T, a) SEP() GC_MAP_11(M, SEP, T, __VA_ARGS__)
+#define GC_MAP_13(M, SEP, T, a, ...) M(T, a) SEP() GC_MAP_12(M, SEP, T, __VA_ARGS__)
+#define GC_MAP_14(M, SEP, T, a, ...) M(T, a) SEP() GC_MAP_13(M, SEP, T, __VA_ARGS__)
+#define GC_MAP_15(M, SEP, T, a, ...) M(T, a) SEP() GC_MAP_14(M, SEP, T, __VA_ARGS__)
+#define GC_MAP_16(M, SEP, T, a, ...) M(T, a) SEP() GC_MAP_15(M, SEP, T, __VA_ARGS__)
+#define GC_COMMA() ,
+#define GC_NOTHING()
+
+#define GC_TYPE(T, ...) \
+    template <> \
+    struct gc_type<T> { \
+        static_assert(gc_is_heap_type<T>(), #T " must be standard layout and start with heap_object header"); \
+        GC_MAP(GC_CHECK_FIELD, GC_NOTHING, T, __VA_ARGS__) \
+        static object_metadata *metadata() { \
+            static gc_metadata_layout<GC_NARGS(__VA_ARGS__)> m = { \
+                #T, sizeof(T), GC_NARGS(__VA_ARGS__), 0, \
+                { GC_MAP(GC_FIELD_OFFSET, GC_COMMA, T, __VA_ARGS__) } \
+            }; \
+            return reinterpret_cast<object_metadata *>(&m); \
+        } \
+    };
+
+#define GC_LEAF_TYPE(T) \
+    template <> \
+    struct gc_type<T> { \
+        static_assert(gc_is_heap_type<T>(), #T " must be standard layout and start with heap_object header"); \
+        static object_metadata *metadata() { \
+            static gc_metadata_layout<0> m = { #T, sizeof(T), 0, 0, { 0 } }; \
+            return reinterpret_cast<object_metadata *>(&m); \
+        } \
+    };
+
+#endif
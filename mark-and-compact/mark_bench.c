@@ -0,0 +1,106 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <time.h>
+#include "gc.h"
+
+/* gc() pause versus number of gc threads. The heaps hold a complete binary
+ * tree, which is wide enough for every marker to find work; the same tree
+ * with a dead node allocated before each live one, so compaction has to
+ * slide everything; and a long list, which is a single chain and can't be
+ * marked in parallel. Speedup is limited by the cores available; run with nproc >= the
+ * largest thread count to see scaling.
+ */
+
+#define DEPTH		20
+#define CHAIN		200000
+#define REPS		5
+
+typedef struct Node {
+    heap_object header;
+    struct Node *left;
+    struct Node *right;
+    long value;
+} Node;
+
+object_metadata Node_class = {
+    .name = "Node", .size = sizeof(Node), .num_fields = 2,
+    .field_offsets = {offsetof(Node, left), offsetof(Node, right)}
+};
+
+static Node *tree(int depth) {
+    Node *n = (Node *)gc_alloc(&Node_class);
+    if ( depth > 0 ) {
+        n->left = tree(depth - 1);
+        n->right = tree(depth - 1);
+    }
+    return n;
+}
+
+static Node *sparse_tree(int depth) {
+    gc_alloc(&Node_class); // garbage
+    Node *n = (Node *)gc_alloc(&Node_class);
+    if ( depth > 0 ) {
+        n->left = sparse_tree(depth - 1);
+        n->right = sparse_tree(depth - 1);
+    }
+    return n;
+}
+
+static Node *chain(int len) {
+    Node *head = NULL;
+    int i;
+    for (i = 0; i < len; i++) {
+        Node *n = (Node *)gc_alloc(&Node_class);
+        n->left = head;
+        head = n;
+    }
+    return head;
+}
+
+static double now_ms() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000.0 + t.tv_nsec / 1000000.0;
+}
+
+/* Best gc() time in ms of REPS heaps built by build(); build() is rerun
+ * each time so there is garbage to compact away.
+ */
+static double pause_ms(int threads, Node *(*build)(int), int n, long nodes) {
+    gc_set_gc_threads(threads);
+    double best = 1e30;
+    int r;
+    for (r = 0; r < REPS; r++) {
+        gc_init((int)(nodes * sizeof(Node) + 1000));
+        Node *root = NULL;
+        gc_add_root(root);
+        root = build(n);
+        double t0 = now_ms();
+        gc();
+        double t = now_ms() - t0;
+        if ( t < best ) best = t;
+        gc_done();
+    }
+    return best;
+}
+
+int main() {
+    static const int threads[] = {1, 2, 4, 8};
+    long tree_nodes = (1L << (DEPTH + 1)) - 1;
+    printf("tree of %ld nodes, chain of %d nodes; best gc() of %d\n", tree_nodes, CHAIN, REPS);
+    printf("%8s %10s %8s %10s %8s %10s %8s\n", "threads",
+           "tree ms", "speedup", "sparse ms", "speedup", "chain ms", "speedup");
+    double tree1 = 0, sparse1 = 0, chain1 = 0;
+    int i;
+    for (i = 0; i < (int)(sizeof(threads) / sizeof(threads[0])); i++) {
+        double t = pause_ms(threads[i], tree, DEPTH, tree_nodes);
+        double s = pause_ms(threads[i], sparse_tree, DEPTH, 2 * tree_nodes);
+        double c = pause_ms(threads[i], chain, CHAIN, CHAIN);
+        if ( i == 0 ) { tree1 = t; sparse1 = s; chain1 = c; }
+        printf("%8d %10.2f %8.2f %10.2f %8.2f %10.2f %8.2f\n", threads[i],
+               t, tree1 / t, s, sparse1 / s, c, chain1 / c);
+    }
+    gc_set_gc_threads(1);
+    return 0;
+}
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <stddef.h>
 #include <string.h>
+#include <pthread.h>
 #include "gc.h"
 
 #define ASSERT(EXPECTED, RESULT)\
@@ -22,11 +23,6 @@
 
 typedef enum {String_t, User_t, Employee_t} TYPE;
 
-typedef struct {
-    heap_object header;
-
-} String;
-
 typedef struct {
     heap_object header;
 
@@ -44,6 +40,16 @@ typedef struct {
     struct Employee *mgr;
 } Employee;
 
+object_metadata User_class = {
+    .name = "User", .size = sizeof(User), .num_fields = 1,
+    .field_offsets = {offsetof(User, name)}
+};
+
+object_metadata Employee_class = {
+    .name = "Employee", .size = sizeof(Employee), .num_fields = 2,
+    .field_offsets = {offsetof(Employee, name), offsetof(Employee, mgr)}
+};
+
 
 void test_empty() {
     gc_init(1000);
@@ -68,15 +74,15 @@ void test_alloc_str_gc_compact_does_nothing() {
     a = gc_alloc_string(10);
     strcpy(a->str, "hi mom");
 
-    check("next_free=43\n"
+    check("next_free=32\n"
                 "objects:\n"
-                "  0000:String[32+11]=\"hi mom\"\n");
+                "  0000:String[16+11]=\"hi mom\"\n");
 
     gc();
 
-    check("next_free=43\n"
+    check("next_free=32\n"
                 "objects:\n"
-                "  0000:String[32+11]=\"hi mom\"\n");
+                "  0000:String[16+11]=\"hi mom\"\n");
 
     gc_done();
 }
@@ -90,9 +96,9 @@ void test_alloc_str_set_null_gc() {
     a = gc_alloc_string(10);
     strcpy(a->str, "hi mom");
 
-    check("next_free=43\n"
+    check("next_free=32\n"
         "objects:\n"
-        "  0000:String[32+11]=\"hi mom\"\n");
+        "  0000:String[16+11]=\"hi mom\"\n");
 
     a = NULL;
 
@@ -113,18 +119,18 @@ void test_alloc_2_str_overwrite_first_one_gc() {
     a = gc_alloc_string(10);
     strcpy(a->str, "hi mom");
 
-    check("next_free=43\n"
+    check("next_free=32\n"
                 "objects:\n"
-                "  0000:String[32+11]=\"hi mom\"\n");
+                "  0000:String[16+11]=\"hi mom\"\n");
 
     a = gc_alloc_string(10);
     strcpy(a->str,"hi dad");
 
     gc();
 
-    check("next_free=43\n"
+    check("next_free=32\n"
                 "objects:\n"
-                "  0000:String[32+11]=\"hi dad\"\n");
+                "  0000:String[16+11]=\"hi dad\"\n");
 
 
     gc_done();
@@ -141,10 +147,10 @@ void test_alloc_user() {
     u->name = gc_alloc_string(20);
     strcpy(u->name->str, "parrt");
 
-    check("next_free=101\n"
+    check("next_free=72\n"
                 "objects:\n"
-                "  0000:User[48]->[48]\n"
-                "  0048:String[32+21]=\"parrt\"\n");
+                "  0000:User[32]->[32]\n"
+                "  0032:String[16+21]=\"parrt\"\n");
 
     u = NULL; // should free user and string
 
@@ -167,18 +173,18 @@ void test_alloc_user_after_string() {
     gc_add_root(u);
     u->name = s;
 
-    check("next_free=101\n"
+    check("next_free=72\n"
                 "objects:\n"
-                "  0000:String[32+21]=\"parrt\"\n"
-                "  0053:User[48]->[0]\n");
+                "  0000:String[16+21]=\"parrt\"\n"
+                "  0040:User[32]->[0]\n");
 
     u = NULL; // should free user but NOT string
 
     gc();
 
-    check("next_free=53\n"
+    check("next_free=40\n"
                 "objects:\n"
-                "  0000:String[32+21]=\"parrt\"\n");
+                "  0000:String[16+21]=\"parrt\"\n");
 
     gc_done();
 }
@@ -200,12 +206,12 @@ void test_alloc_obj_with_two_ptr_fields() {
     
     gc();
 
-    check("next_free=175\n"
+    check("next_free=120\n"
             "objects:\n"
-            "  0000:Employee[48]->[48,NULL]\n"
-            "  0048:String[32+4]=\"Tom\"\n"
-            "  0084:Employee[48]->[132,0]\n"
-            "  0132:String[32+11]=\"Terence\"\n");
+            "  0000:Employee[32]->[32,NULL]\n"
+            "  0032:String[16+4]=\"Tom\"\n"
+            "  0056:Employee[32]->[88,0]\n"
+            "  0088:String[16+11]=\"Terence\"\n");
 
     gc_done();
 }
@@ -229,10 +235,10 @@ void test_alloc_obj_kill_mgr_ptr() {
     
     gc();
 
-    check("next_free=91\n"
+    check("next_free=64\n"
             "objects:\n"
-            "  0000:Employee[48]->[48,NULL]\n"
-            "  0048:String[32+11]=\"Terence\"\n");
+            "  0000:Employee[32]->[32,NULL]\n"
+            "  0032:String[16+11]=\"Terence\"\n");
 
     gc_done();
 }
@@ -257,12 +263,12 @@ void test_mgr_cycle() {
     
     gc();
 
-    check("next_free=175\n"
+    check("next_free=120\n"
         "objects:\n"
-        "  0000:Employee[48]->[48,84]\n"
-        "  0048:String[32+4]=\"Tom\"\n"
-        "  0084:Employee[48]->[132,0]\n"
-        "  0132:String[32+11]=\"Terence\"\n");
+        "  0000:Employee[32]->[32,56]\n"
+        "  0032:String[16+4]=\"Tom\"\n"
+        "  0056:Employee[32]->[88,0]\n"
+        "  0088:String[16+11]=\"Terence\"\n");
 
     gc_done();
 }
@@ -289,14 +295,161 @@ void test_mgr_cycle_kill_one_link() {
     
     gc();
 
-    check("next_free=91\n"
+    check("next_free=64\n"
             "objects:\n"
-            "  0000:Employee[48]->[48,NULL]\n"
-            "  0048:String[32+11]=\"Terence\"\n");
+            "  0000:Employee[32]->[32,NULL]\n"
+            "  0032:String[16+11]=\"Terence\"\n");
+
+    gc_done();
+}
 
+void test_incremental_mark_keeps_moved_object() {
+    gc_set_incremental_budget(1000000); // so slices are bounded by work alone
+    gc_init(1024*1024);
+    Employee *b;
+    Employee *n;
+    Employee *r;
+    gc_add_root(b);
+    gc_add_root(n);
+    gc_add_root(r);
+    b = (Employee *) gc_alloc(&Employee_class);
+    Employee *c = (Employee *) gc_alloc(&Employee_class); // reachable only from b
+    c->ID = 42;
+    gc_store_ptr(b, mgr, (struct Employee *)c);
+    c = NULL;
+    while ( !GC_HEAP_PUBLIC(gc_default_heap)->marking ) gc_alloc_string(100); // garbage
+    // roots are shaded, b is gray and c white; move c under a new, black object
+    r = (Employee *) b->mgr;
+    gc_store_ptr(b, mgr, NULL);
+    n = (Employee *) gc_alloc(&Employee_class);
+    gc_store_ptr(n, mgr, (struct Employee *)r);
+    r = NULL;
+
+    gc();
+    ASSERT(0, GC_HEAP_PUBLIC(gc_default_heap)->marking);
+    ASSERT(3 * (int)sizeof(Employee) + 120, (int)gc_heap_highwater()); // b, n, c and the string that started marking
+    ASSERT(42, ((Employee *)n->mgr)->ID);
+    gc(); // that string was allocated black, so it took this gc() to free it
+    ASSERT(3 * (int)sizeof(Employee), (int)gc_heap_highwater());
+    ASSERT(42, ((Employee *)n->mgr)->ID);
+    gc_done();
+    gc_set_incremental_budget(0);
+}
+
+void test_state_during_incremental_mark_keeps_moved_object() {
+    gc_set_incremental_budget(1000000);
+    gc_init(1024*1024);
+    Employee *b;
+    Employee *n;
+    Employee *r;
+    gc_add_root(b);
+    gc_add_root(n);
+    gc_add_root(r);
+    b = (Employee *) gc_alloc(&Employee_class);
+    Employee *c = (Employee *) gc_alloc(&Employee_class); // reachable only from b
+    c->ID = 42;
+    gc_store_ptr(b, mgr, (struct Employee *)c);
+    c = NULL;
+    while ( !GC_HEAP_PUBLIC(gc_default_heap)->marking ) gc_alloc_string(100); // garbage
+    // c is only marked because the barrier shaded it; n is black and won't be scanned
+    r = (Employee *) b->mgr;
+    gc_store_ptr(b, mgr, NULL);
+    n = (Employee *) gc_alloc(&Employee_class);
+    gc_store_ptr(n, mgr, (struct Employee *)r);
+    r = NULL;
+
+    char *state = gc_get_state(); // mustn't lose c's mark
+    free(state);
+    gc();
+    ASSERT(3 * (int)sizeof(Employee), (int)gc_heap_highwater()); // b, n and c
+    ASSERT(42, ((Employee *)n->mgr)->ID);
+    gc_done();
+    gc_set_incremental_budget(0);
+}
+
+/* Churn a list of 100 employees, one new node per iteration, through many marking cycles */
+static void check_list_survives_marking() {
+    gc_init(256*1024);
+    Employee *head;
+    Employee *e;
+    gc_add_root(head);
+    gc_add_root(e);
+    head = (Employee *) gc_alloc(&Employee_class);
+    int i;
+    for (i = 0; i < 100; i++) { // a list of 100 behind head
+        e = (Employee *) gc_alloc(&Employee_class);
+        e->ID = i;
+        gc_store_ptr(e, mgr, head->mgr);
+        gc_store_ptr(head, mgr, (struct Employee *)e);
+    }
+    for (i = 100; i < 200000; i++) { // replace one node with a new one each time
+        e = (Employee *) gc_alloc(&Employee_class);
+        e->ID = i;
+        String *s = gc_alloc_string(3);
+        strcpy(s->str, "Tom");
+        gc_store_ptr(e, name, s);
+        Employee *prev = head;
+        int k;
+        for (k = 0; k < i % 100; k++) prev = (Employee *) prev->mgr;
+        Employee *old = (Employee *) prev->mgr;
+        gc_store_ptr(e, mgr, old->mgr);
+        gc_store_ptr(prev, mgr, (struct Employee *)e);
+        gc_alloc_string(50); // garbage
+    }
+    int n = 0;
+    int bad = 0;
+    for (e = (Employee *) head->mgr; e != NULL; e = (Employee *) e->mgr) {
+        n++;
+        if ( e->ID < 199800 || strcmp(e->name->str, "Tom") != 0 ) bad++;
+    }
+    ASSERT(100, n);
+    ASSERT(0, bad);
     gc_done();
 }
 
+void test_incremental_marking_keeps_list_intact() {
+    gc_set_incremental_budget(50);
+    check_list_survives_marking();
+    gc_set_incremental_budget(0);
+}
+
+void test_concurrent_marking_keeps_list_intact() {
+    gc_set_concurrent_marking(true);
+    check_list_survives_marking();
+    gc_set_concurrent_marking(false);
+}
+
+void test_concurrent_mark_keeps_overwritten_object() {
+    gc_set_concurrent_marking(true);
+    gc_init(1024*1024);
+    Employee *b;
+    Employee *n;
+    Employee *r;
+    gc_add_root(b);
+    gc_add_root(n);
+    gc_add_root(r);
+    b = (Employee *) gc_alloc(&Employee_class);
+    Employee *c = (Employee *) gc_alloc(&Employee_class); // reachable only from b
+    c->ID = 42;
+    b->mgr = (struct Employee *)c;
+    c = NULL;
+    while ( GC_HEAP_PUBLIC(gc_default_heap)->marking != GC_MARKING_SATB ) gc_alloc_string(100); // garbage
+    // the marker may or may not have got to b; either way c was reachable when marking started
+    r = (Employee *) b->mgr;
+    gc_store_ptr(b, mgr, NULL);
+    n = (Employee *) gc_alloc(&Employee_class);
+    n->mgr = (struct Employee *)r; // no barrier needed on an object allocated during marking
+    r = NULL;
+
+    gc();
+    gc(); // the string that started marking was allocated black
+    ASSERT(0, GC_HEAP_PUBLIC(gc_default_heap)->marking);
+    ASSERT(3 * (int)sizeof(Employee), (int)gc_heap_highwater()); // b, n and c
+    ASSERT(42, ((Employee *)n->mgr)->ID);
+    gc_done();
+    gc_set_concurrent_marking(false);
+}
+
 void test_big_loop_doesnt_run_out_of_memory() {
     gc_init(1000);
 
@@ -332,24 +485,24 @@ void test_global() {
     gc_add_root(_e2);
     ASSERT(2, gc_num_roots());
 
-    check("next_free=96\n"
+    check("next_free=64\n"
           "objects:\n"
-          "  0000:Employee[48]->[NULL,NULL]\n"
-          "  0048:Employee[48]->[NULL,NULL]\n");
+          "  0000:Employee[32]->[NULL,NULL]\n"
+          "  0032:Employee[32]->[NULL,NULL]\n");
 
     gc();
 
-    check("next_free=96\n"
+    check("next_free=64\n"
               "objects:\n"
-              "  0000:Employee[48]->[NULL,NULL]\n"
-              "  0048:Employee[48]->[NULL,NULL]\n");
+              "  0000:Employee[32]->[NULL,NULL]\n"
+              "  0032:Employee[32]->[NULL,NULL]\n");
 
     _e1 = NULL;
     gc();
 
-    check("next_free=48\n"
+    check("next_free=32\n"
               "objects:\n"
-              "  0000:Employee[48]->[NULL,NULL]\n"); // gets moved
+              "  0000:Employee[32]->[NULL,NULL]\n"); // gets moved
 
     gc_done();
 }
@@ -361,9 +514,9 @@ static void f()
     gc_begin_func();
 
     // just 1 global
-    check("next_free=48\n"
+    check("next_free=32\n"
           "objects:\n"
-          "  0000:Employee[48]->[NULL,NULL]\n");
+          "  0000:Employee[32]->[NULL,NULL]\n");
 
     a = gc_alloc_string(10);
     strcpy(a->str, "parrt");
@@ -371,11 +524,11 @@ static void f()
     gc_add_root(a);
     gc_add_root(b);
 
-    check("next_free=139\n"
+    check("next_free=96\n"
           "objects:\n"
-          "  0000:Employee[48]->[NULL,NULL]\n"
-          "  0048:String[32+11]=\"parrt\"\n"
-          "  0091:Employee[48]->[NULL,NULL]\n");
+          "  0000:Employee[32]->[NULL,NULL]\n"
+          "  0032:String[16+11]=\"parrt\"\n"
+          "  0064:Employee[32]->[NULL,NULL]\n");
 
     gc_end_func(); // should deallocate a,b automagically
 }
@@ -392,14 +545,14 @@ void test_local_roots_in_called_func() {
 
     // all of the locals from f() should have gone away
 
-    check("next_free=139\n"  // we haven't called gc() yet
+    check("next_free=96\n"  // we haven't called gc() yet
               "objects:\n"
-              "  0000:Employee[48]->[NULL,NULL]\n");
+              "  0000:Employee[32]->[NULL,NULL]\n");
     gc();
 
-    check("next_free=48\n"
+    check("next_free=32\n"
               "objects:\n"
-              "  0000:Employee[48]->[NULL,NULL]\n");
+              "  0000:Employee[32]->[NULL,NULL]\n");
 
     _e1 = NULL;
     gc();
@@ -409,13 +562,577 @@ void test_local_roots_in_called_func() {
     gc_done();
 }
 
+void test_mark_stack_overflow_rescans_heap() {
+    gc_init(1000);
+    gc_set_mark_stack_limit(1); // force overflow on nearly every push
+
+    // boss->mgr chain where everybody also has a name
+    Employee *boss = NULL;
+    gc_add_root(boss);
+    int i;
+    for (i = 0; i < 4; i++) {
+        Employee *e = (Employee *) gc_alloc(&Employee_class);
+        e->mgr = (struct Employee *)boss;
+        e->name = gc_alloc_string(1);
+        strcpy(e->name->str, "x");
+        boss = e;
+    }
+    gc_alloc(&Employee_class); // garbage
+
+    gc();
+
+    check("next_free=224\n"
+          "objects:\n"
+          "  0000:Employee[32]->[32,NULL]\n"
+          "  0032:String[16+2]=\"x\"\n"
+          "  0056:Employee[32]->[88,0]\n"
+          "  0088:String[16+2]=\"x\"\n"
+          "  0112:Employee[32]->[144,56]\n"
+          "  0144:String[16+2]=\"x\"\n"
+          "  0168:Employee[32]->[200,112]\n"
+          "  0200:String[16+2]=\"x\"\n");
+
+    gc_set_mark_stack_limit(1024*1024);
+    gc_done();
+}
+
+void test_long_mgr_chain() {
+    int n = 300000; // deep enough to have blown the stack of a recursive marker
+    gc_init(n * (int)sizeof(Employee) + 1000);
+
+    Employee *boss = NULL;
+    gc_add_root(boss);
+    int i;
+    for (i = 0; i < n; i++) {
+        Employee *e = (Employee *) gc_alloc(&Employee_class);
+        e->mgr = (struct Employee *)boss;
+        boss = e;
+    }
+    gc();
+    ASSERT(n * (int)sizeof(Employee), (int)gc_heap_highwater());
+
+    // chop the chain in half
+    Employee *e = boss;
+    for (i = 0; i < n / 2 - 1; i++) e = (Employee *)e->mgr;
+    e->mgr = NULL;
+    gc();
+    ASSERT(n / 2 * (int)sizeof(Employee), (int)gc_heap_highwater());
+
+    gc_done();
+}
+
+void test_many_roots() {
+    gc_init(10000);
+    gc_begin_func();
+    String *strs[500];
+    int i;
+    for (i = 0; i < 500; i++) {
+        strs[i] = NULL;
+        gc_add_root(strs[i]);
+    }
+    ASSERT(500, gc_num_roots());
+    strs[499] = gc_alloc_string(3);
+    strcpy(strs[499]->str, "end");
+    gc();
+    check("next_free=24\n"
+          "objects:\n"
+          "  0000:String[16+4]=\"end\"\n");
+    gc_end_func();
+    gc_done();
+}
+
+void test_slide_overlapping_object() {
+    gc_init(1000);
+    String *garbage = gc_alloc_string(1);
+    String *s = gc_alloc_string(60); // 80 bytes; moves down only 24 so src and dst overlap
+    gc_add_root(s);
+    char expected[61];
+    int i;
+    for (i = 0; i < 60; i++) expected[i] = (char)('a' + i % 26);
+    expected[60] = '\0';
+    strcpy(s->str, expected);
+
+    gc();
+
+    ASSERT(0, (int)((uint8_t *)s - (uint8_t *)garbage)); // s now where garbage was
+    ASSERT(60, s->length);
+    STR_ASSERT(expected, s->str);
+    ASSERT(80, (int)gc_heap_highwater());
+
+    gc_done();
+}
+
+void test_self_reference() {
+    gc_init(1000);
+    gc_alloc_string(1); // garbage
+    Employee *e = (Employee *) gc_alloc(&Employee_class);
+    e->mgr = (struct Employee *)e; // own boss
+    gc_add_root(e);
+
+    gc();
+
+    check("next_free=32\n"
+          "objects:\n"
+          "  0000:Employee[32]->[NULL,0]\n");
+
+    gc_done();
+}
+
+/* Enough heap for many compaction regions, with garbage of varying size
+ * between live objects and one live string bigger than a region.
+ */
+void test_compact_across_regions() {
+    int n = 20000;
+    gc_set_large_object_size(0); // slide big too
+    gc_init(4 * 1024 * 1024);
+    Employee *boss = NULL;
+    String *big = NULL;
+    gc_add_root(boss);
+    gc_add_root(big);
+    long live = 0;
+    int i;
+    for (i = 0; i < n; i++) {
+        gc_alloc_string(i % 50);  // garbage
+        Employee *e = (Employee *) gc_alloc(&Employee_class);
+        e->ID = i;
+        e->mgr = (struct Employee *)boss;
+        boss = e;
+        e->name = gc_alloc_string(8);
+        sprintf(e->name->str, "%d", i);
+        live += sizeof(Employee) + align_to_word_boundary(sizeof(String) + 8 + 1);
+        if ( i == n / 2 ) {
+            big = gc_alloc_string(100000);
+            memset(big->str, 'x', 100000);
+            live += align_to_word_boundary(sizeof(String) + 100000 + 1);
+        }
+    }
+
+    gc();
+
+    ASSERT((int)live, (int)gc_heap_highwater());
+    Employee *e = boss;
+    char buf[20];
+    for (i = n - 1; i >= 0; i--) {
+        ASSERT(i, e->ID);
+        sprintf(buf, "%d", i);
+        STR_ASSERT(buf, e->name->str);
+        e = (Employee *)e->mgr;
+    }
+    ASSERT(100000, big->length);
+    ASSERT('x', big->str[0]);
+    ASSERT('x', big->str[99999]);
+
+    gc_done();
+    gc_set_large_object_size(64 * 1024);
+}
+
+typedef struct {
+    heap_object header;
+    Employee *emp;
+    char payload[100000];
+} Big;
+
+object_metadata Big_class = {
+    .name = "Big", .size = sizeof(Big), .num_fields = 1,
+    .field_offsets = {offsetof(Big, emp)}
+};
+
+void test_large_objects_stay_put() {
+    gc_init(1000);
+    Big *b;
+    String *s;
+    gc_add_root(b);
+    gc_add_root(s);
+    gc_alloc_string(10); // garbage, so the employee moves
+    b = (Big *) gc_alloc(&Big_class);
+    Big *b_addr = b;
+    b->emp = (Employee *) gc_alloc(&Employee_class);
+    b->emp->ID = 42;
+    s = gc_alloc_string(100000);
+    String *s_addr = s;
+    s->str[99999] = 'x';
+    gc_alloc_string(100000); // dead large object
+    ASSERT(32 + (int)sizeof(Employee), (int)gc_heap_highwater()); // large ones aren't in the heap
+
+    gc();
+    ASSERT(1, (b == b_addr));
+    ASSERT(1, (s == s_addr));
+    ASSERT('x', s->str[99999]);
+    ASSERT((int)sizeof(Employee), (int)gc_heap_highwater());
+    ASSERT(42, b->emp->ID); // the field followed the employee down
+
+    b = NULL;
+    s = NULL;
+    gc();
+    ASSERT(0, (int)gc_heap_highwater());
+    gc_done();
+}
+
+void test_atomic_strings_arent_in_heap() {
+    gc_init(10000);
+    String *s;
+    Employee *e;
+    gc_add_root(s);
+    gc_add_root(e);
+    gc_alloc_string_atomic(10); // garbage
+    s = gc_alloc_string_atomic(10);
+    String *s_addr = s;
+    strcpy(s->str, "atomic");
+    e = (Employee *) gc_alloc(&Employee_class);
+    ASSERT((int)sizeof(Employee), (int)gc_heap_highwater()); // the strings are elsewhere
+
+    gc();
+    ASSERT(1, (s == s_addr));
+    ASSERT(0, strcmp(s->str, "atomic"));
+
+    int i;
+    for (i = 0; i < 100000; i++) {
+        gc_alloc_string_atomic(i % 200); // reused or swept a block at a time
+    }
+    ASSERT(0, strcmp(s->str, "atomic"));
+    ASSERT((int)sizeof(Employee), (int)gc_heap_highwater());
+
+    s = gc_alloc_string_atomic(3000); // too big for a cell
+    ASSERT(1, (gc_heap_highwater() > (long)sizeof(Employee)));
+    gc_done();
+}
+
+void test_large_object_keeps_young_object_alive() {
+    gc_set_nursery_size(4096);
+    gc_init(10000);
+    Big *b;
+    gc_add_root(b);
+    b = (Big *) gc_alloc(&Big_class);
+    Employee *e = (Employee *) gc_alloc(&Employee_class); // young
+    e->ID = 7;
+    gc_store_ptr(b, emp, e);
+    e = NULL;
+    gc_minor();
+    ASSERT((int)sizeof(Employee), (int)gc_heap_highwater()); // promoted
+    ASSERT(7, b->emp->ID);
+    gc_done();
+    gc_set_nursery_size(0);
+}
+
+void test_minor_promotes_only_live() {
+    gc_set_nursery_size(1024);
+    gc_init(1000);
+    String *a;
+    gc_add_root(a);
+    gc_alloc_string(10); // garbage
+    a = gc_alloc_string(5);
+    strcpy(a->str, "hello");
+    gc_alloc_string(20); // garbage
+    ASSERT(0, (int)gc_heap_highwater()); // all in nursery
+
+    gc_minor();
+
+    check("next_free=24\n"
+          "objects:\n"
+          "  0000:String[16+6]=\"hello\"\n");
+    gc_done();
+    gc_set_nursery_size(0);
+}
+
+void test_card_keeps_young_object_alive() {
+    gc_set_nursery_size(1024);
+    gc_init(1000);
+    Employee *e;
+    gc_add_root(e);
+    e = (Employee *) gc_alloc(&Employee_class);
+    gc_minor(); // e is old now
+    String *s = gc_alloc_string(3); // young and reachable only from e
+    strcpy(s->str, "tom");
+    gc_store_ptr(e, name, s);
+
+    gc_minor();
+
+    check("next_free=56\n"
+          "objects:\n"
+          "  0000:Employee[32]->[32,NULL]\n"
+          "  0032:String[16+4]=\"tom\"\n");
+    gc_done();
+    gc_set_nursery_size(0);
+}
+
+/* Many nursery fills and some full collections in between */
+void test_nursery_overflows_into_heap() {
+    int n = 20000;
+    gc_set_nursery_size(4096);
+    gc_init(n * (int)(sizeof(Employee) + 32) + 10000);
+    Employee *boss = NULL;
+    gc_add_root(boss);
+    int i;
+    for (i = 0; i < n; i++) {
+        gc_alloc_string(30); // garbage
+        Employee *e = (Employee *) gc_alloc(&Employee_class);
+        e->ID = i;
+        gc_store_ptr(e, mgr, (struct Employee *)boss);
+        boss = e;
+        String *name = gc_alloc_string(8);
+        sprintf(name->str, "%d", i);
+        gc_store_ptr(boss, name, name);
+    }
+    gc();
+
+    ASSERT(n * (int)(sizeof(Employee) + 32), (int)gc_heap_highwater());
+    Employee *e = boss;
+    char buf[20];
+    for (i = n - 1; i >= 0; i--) {
+        ASSERT(i, e->ID);
+        sprintf(buf, "%d", i);
+        STR_ASSERT(buf, e->name->str);
+        e = (Employee *)e->mgr;
+    }
+    gc_done();
+    gc_set_nursery_size(0);
+}
+
+#define NUM_MUTATORS	4
+
+/* Each thread builds chains of employees, dropping each one for the next,
+ * with garbage in between, and checks its chain survives other threads'
+ * collections.
+ */
+static void *build_chains(void *arg) {
+    int id = (int)(intptr_t)arg;
+    gc_register_thread();
+    int errors = 0;
+    int round;
+    for (round = 0; round < 20; round++) {
+        Employee *boss = NULL;
+        gc_begin_func();
+        gc_add_root(boss);
+        int i;
+        for (i = 0; i < 500; i++) {
+            gc_alloc_string(40); // garbage
+            Employee *e = (Employee *) gc_alloc(&Employee_class);
+            e->ID = id * 1000 + i;
+            gc_store_ptr(e, mgr, (struct Employee *)boss);
+            boss = e;
+            String *name = gc_alloc_string(8);
+            sprintf(name->str, "%d", i);
+            gc_store_ptr(boss, name, name);
+        }
+        if ( round % 5 == 0 ) gc();
+        char buf[20];
+        Employee *e = boss;
+        for (i = 499; i >= 0; i--) {
+            sprintf(buf, "%d", i);
+            if ( e->ID != id * 1000 + i || strcmp(buf, e->name->str) != 0 ) errors++;
+            e = (Employee *)e->mgr;
+        }
+        gc_end_func();
+    }
+    gc_unregister_thread();
+    return (void *)(intptr_t)errors;
+}
+
+static void run_mutators() {
+    pthread_t threads[NUM_MUTATORS];
+    int t;
+    for (t = 0; t < NUM_MUTATORS; t++) {
+        pthread_create(&threads[t], NULL, build_chains, (void *)(intptr_t)t);
+    }
+    gc_blocking_begin(); // don't hold up their collections while we wait
+    int errors = 0;
+    for (t = 0; t < NUM_MUTATORS; t++) {
+        void *e;
+        pthread_join(threads[t], &e);
+        errors += (int)(intptr_t)e;
+    }
+    gc_blocking_end();
+    ASSERT(0, errors);
+    ASSERT(0, gc_num_roots());
+}
+
+void test_threads_allocate_while_others_collect() {
+    gc_init(300000);
+    run_mutators();
+    gc();
+    ASSERT(0, (int)gc_heap_highwater());
+    gc_done();
+
+    gc_set_nursery_size(32768);
+    gc_init(300000);
+    run_mutators();
+    gc();
+    ASSERT(0, (int)gc_heap_highwater());
+    gc_done();
+    gc_set_nursery_size(0);
+
+    gc_set_incremental_budget(100);
+    gc_init(300000);
+    run_mutators();
+    gc(); // finishes a mark that may have been under way, keeping what was allocated during it
+    gc();
+    ASSERT(0, (int)gc_heap_highwater());
+    gc_done();
+    gc_set_incremental_budget(0);
+
+    gc_set_concurrent_marking(true);
+    gc_init(300000);
+    run_mutators();
+    gc();
+    gc();
+    ASSERT(0, (int)gc_heap_highwater());
+    gc_done();
+    gc_set_concurrent_marking(false);
+}
+
+void test_heap_grows_and_shrinks() {
+    gc_set_max_heap_size(1024*1024);
+    gc_init(4096);
+    Employee *boss = NULL;
+    gc_add_root(boss);
+    int n = 2000; // far more than fits in 4096 bytes
+    int i;
+    for (i = 0; i < n; i++) {
+        Employee *e = (Employee *) gc_alloc(&Employee_class);
+        if ( e == NULL ) break;
+        e->mgr = (struct Employee *)boss;
+        boss = e;
+    }
+    ASSERT(n, i);
+    gc();
+    long live = n * (long)sizeof(Employee);
+    ASSERT((int)live, (int)gc_heap_highwater());
+    if ( gc_heap_size() < 2 * live ) { // live data fills at most half the heap
+        printf("\n%-30s failure on line %d; heap size %ld for %ld live bytes\n", __func__, __LINE__, gc_heap_size(), live);
+    }
+
+    boss = NULL;
+    gc();
+    ASSERT(4096, (int)gc_heap_size()); // back to the size we started with
+    ASSERT(0, (int)gc_heap_highwater());
+
+    Employee *e = (Employee *) gc_alloc(&Employee_class); // released pages work again
+    ASSERT(0, e->ID);
+    gc_done();
+    gc_set_max_heap_size(0);
+}
+
+void test_fixed_heap_runs_out() {
+    gc_init(1000);
+    Employee *boss = NULL;
+    gc_add_root(boss);
+    int i;
+    for (i = 0; i < 1000; i++) {
+        Employee *e = (Employee *) gc_alloc(&Employee_class);
+        if ( e == NULL ) break;
+        e->mgr = (struct Employee *)boss;
+        boss = e;
+    }
+    ASSERT(1000 / (int)sizeof(Employee), i);
+    ASSERT(1000, (int)gc_heap_size());
+    gc_done();
+}
+
+/* Each thread makes, fills and collects a heap of its own */
+static void *use_own_heap(void *arg) {
+    int id = (int)(intptr_t)arg;
+    gc_heap *h = gc_heap_new(20000);
+    Employee *boss = NULL;
+    gc_heap_add_root(h, boss);
+    int errors = 0;
+    int round;
+    for (round = 0; round < 50; round++) {
+        boss = NULL;
+        int i;
+        for (i = 0; i < 100; i++) {
+            gc_heap_alloc_string(h, 40); // garbage
+            Employee *e = (Employee *) gc_heap_alloc(h, &Employee_class);
+            e->ID = id * 1000 + i;
+            e->mgr = (struct Employee *)boss;
+            boss = e;
+        }
+        gc_heap_collect(h);
+        if ( gc_heap_highwater_of(h) != 100 * (long)sizeof(Employee) ) errors++;
+        Employee *e = boss;
+        for (i = 99; i >= 0; i--) {
+            if ( e->ID != id * 1000 + i ) errors++;
+            e = (Employee *)e->mgr;
+        }
+    }
+    gc_heap_free(h); // boss's chain goes with it
+    return (void *)(intptr_t)errors;
+}
+
+void test_independent_heaps() {
+    gc_init(1000);
+    String *s;
+    gc_add_root(s);
+    s = gc_alloc_string(3);
+    strcpy(s->str, "hi!");
+
+    pthread_t threads[NUM_MUTATORS];
+    int t;
+    for (t = 0; t < NUM_MUTATORS; t++) {
+        pthread_create(&threads[t], NULL, use_own_heap, (void *)(intptr_t)t);
+    }
+    int errors = 0;
+    for (t = 0; t < NUM_MUTATORS; t++) { // not registered with their heaps, so no need to block
+        void *e;
+        pthread_join(threads[t], &e);
+        errors += (int)(intptr_t)e;
+    }
+    ASSERT(0, errors);
+
+    gc();
+    check("next_free=24\n"
+          "objects:\n"
+          "  0000:String[16+4]=\"hi!\"\n");
+    gc_done();
+}
+
+/* Registering types grows the shared type table while the other threads
+ * are collecting their own heaps, which look up types in it without a lock.
+ */
+void test_register_types_while_others_collect() {
+    gc_init(1000);
+    pthread_t threads[NUM_MUTATORS];
+    int t;
+    for (t = 0; t < NUM_MUTATORS; t++) {
+        pthread_create(&threads[t], NULL, use_own_heap, (void *)(intptr_t)t);
+    }
+    object_metadata *m = NULL;
+    int i;
+    for (i = 0; i < 2000; i++) { // past the first chunk of the table
+        m = malloc(sizeof(object_metadata) + 2 * sizeof(int)); // types are never unregistered
+        m->name = "Employee";
+        m->size = sizeof(Employee);
+        m->num_fields = 2;
+        m->type_id = 0;
+        m->field_offsets[0] = offsetof(Employee, name);
+        m->field_offsets[1] = offsetof(Employee, mgr);
+        gc_register_type(m);
+    }
+    int errors = 0;
+    for (t = 0; t < NUM_MUTATORS; t++) {
+        void *e;
+        pthread_join(threads[t], &e);
+        errors += (int)(intptr_t)e;
+    }
+    ASSERT(0, errors);
+
+    Employee *e = (Employee *) gc_alloc(m);
+    gc_add_root(e);
+    e->name = gc_alloc_string(1);
+    strcpy(e->name->str, "x");
+    gc_alloc_string(10); // garbage
+    gc();
+    STR_ASSERT("x", e->name->str);
+    ASSERT((int)sizeof(Employee) + 24, (int)gc_heap_highwater());
+    gc_done();
+}
+
 void test_template() {
     gc_init(1000);
     // gc_add_root(s);
     gc_done();
 }
 
-int main(int argc, char *argv[]) {
+static void run_tests() {
     TEST(test_empty);
     TEST(test_alloc_str_gc_compact_does_nothing);
     TEST(test_alloc_str_set_null_gc);
@@ -429,8 +1146,43 @@ int main(int argc, char *argv[]) {
 
     TEST(test_global);
     TEST(test_local_roots_in_called_func);
-
+    TEST(test_mark_stack_overflow_rescans_heap);
+    TEST(test_long_mgr_chain);
+    TEST(test_many_roots);
+    TEST(test_slide_overlapping_object);
+    TEST(test_self_reference);
+    TEST(test_compact_across_regions);
+    TEST(test_large_objects_stay_put);
+    TEST(test_large_object_keeps_young_object_alive);
+    TEST(test_atomic_strings_arent_in_heap);
+    TEST(test_minor_promotes_only_live);
+    TEST(test_card_keeps_young_object_alive);
+    TEST(test_nursery_overflows_into_heap);
+
+    TEST(test_incremental_mark_keeps_moved_object);
+    TEST(test_state_during_incremental_mark_keeps_moved_object);
+    TEST(test_incremental_marking_keeps_list_intact);
+    TEST(test_concurrent_mark_keeps_overwritten_object);
+    TEST(test_concurrent_marking_keeps_list_intact);
     TEST(test_big_loop_doesnt_run_out_of_memory);
-    
+    TEST(test_heap_grows_and_shrinks);
+    TEST(test_fixed_heap_runs_out);
+    TEST(test_threads_allocate_while_others_collect);
+    TEST(test_independent_heaps);
+    TEST(test_register_types_while_others_collect);
+}
+
+int main() {
+    run_tests();
+
+    printf("\nRERUNNING WITH THREADED COMPACTION\n");
+    gc_set_compaction(GC_COMPACT_THREADED);
+    run_tests();
+
+    printf("\nRERUNNING WITH 4 GC THREADS\n");
+    gc_set_compaction(GC_COMPACT_LISP2);
+    gc_set_gc_threads(4);
+    run_tests();
+
     return 0;
 }
@@ -0,0 +1,95 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "gc_types.hpp"
+
+/* Checks that GC_TYPE generates the same metadata that test.c writes by
+ * hand and that the collector traces through it.
+ */
+
+#define ASSERT(EXPECTED, RESULT)\
+  if((EXPECTED) != (RESULT)) { printf("\n%-30s failure on line %d; expecting %d found %d\n", \
+        __func__, __LINE__, (int)(EXPECTED), (int)(RESULT)); }
+#define STR_ASSERT(EXPECTED, RESULT)\
+  if(strcmp(EXPECTED,RESULT)!=0) { printf("\n%-30s failure on line %d; expecting:\n%s\nfound:\n%s\n", \
+        __func__, __LINE__, EXPECTED, RESULT); }
+
+#define TEST(t) printf("TESTING %s\n", #t); t();
+
+struct Employee {
+    heap_object header;
+
+    int ID;
+    String *name;
+    Employee *mgr;
+};
+
+struct Point {
+    heap_object header;
+
+    long x, y;
+};
+
+GC_TYPE(Employee, name, mgr)
+GC_LEAF_TYPE(Point)
+
+void test_generated_metadata() {
+    object_metadata *m = gc_type<Employee>::metadata();
+    STR_ASSERT("Employee", m->name);
+    ASSERT(sizeof(Employee), m->size);
+    ASSERT(2, m->num_fields);
+    ASSERT(offsetof(Employee, name), m->field_offsets[0]);
+    ASSERT(offsetof(Employee, mgr), m->field_offsets[1]);
+
+    m = gc_type<Point>::metadata();
+    STR_ASSERT("Point", m->name);
+    ASSERT(sizeof(Point), m->size);
+    ASSERT(0, m->num_fields);
+}
+
+void test_gc_traces_generated_fields() {
+    gc_init(1000);
+    Employee *e;
+    Point *p;
+    gc_begin_func();
+    gc_add_root(e);
+    gc_add_root(p);
+
+    gc_new<Point>();                  // garbage
+    e = gc_new<Employee>();
+    e->name = gc_alloc_string(3);
+    strcpy(e->name->str, "tom");
+    e->mgr = gc_new<Employee>();
+    e->mgr->name = gc_alloc_string(3);
+    strcpy(e->mgr->name->str, "ann");
+    p = gc_new<Point>();
+    p->x = 1; p->y = 2;
+
+    gc();
+
+    const char *expected =
+        "next_free=136\n"
+        "objects:\n"
+        "  0000:Employee[32]->[32,56]\n"
+        "  0032:String[16+4]=\"tom\"\n"
+        "  0056:Employee[32]->[88,NULL]\n"
+        "  0088:String[16+4]=\"ann\"\n"
+        "  0112:Point[24]\n";
+    char *found = gc_get_state();
+    STR_ASSERT(expected, found);
+    free(found);
+    ASSERT(1, p->x);
+    ASSERT(2, p->y);
+    STR_ASSERT("ann", e->mgr->name->str);
+
+    gc_end_func();
+    gc_done();
+}
+
+int main() {
+    TEST(test_generated_metadata);
+    TEST(test_gc_traces_generated_fields);
+    gc_set_compaction(GC_COMPACT_THREADED);
+    TEST(test_gc_traces_generated_fields);
+    return 0;
+}
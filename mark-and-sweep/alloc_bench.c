@@ -0,0 +1,65 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "gc_ms.h"
+
+/* Allocation throughput of the segregated free lists versus the original
+ * first-fit list. A fixed set of rooted slots is overwritten at random with
+ * strings of random sizes, keeping the heap over half full, so even with
+ * coalescing each sweep leaves thousands of holes of mixed sizes between
+ * survivors and first fit has to walk past the small ones for every large
+ * request. Built with DEBUG off.
+ */
+
+#define ALLOCS		1000000
+#define KEEP		4096		// live strings at any time
+#define MAX_LEN		231			// Strings of 32..256 bytes
+#define HEAP_SIZE	(1024*1024)
+#define REPS		3
+
+static double fragmentation;	// at the end of the last run
+
+static double now_ms() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000.0 + t.tv_nsec / 1000000.0;
+}
+
+/* Best wall clock ms of REPS runs of ALLOCS allocations */
+static double run_ms(gc_allocator allocator) {
+	static String *live[KEEP];
+	double best = 1e30;
+	int r;
+	for (r = 0; r < REPS; r++) {
+		gc_heap *h = gc_heap_new(HEAP_SIZE);
+		gc_heap_set_allocator(h, allocator);
+		int i;
+		for (i = 0; i < KEEP; i++) {
+			live[i] = NULL;
+			gc_heap_add_root(h, live[i]);
+		}
+		srand(42);
+		double t0 = now_ms();
+		for (i = 0; i < ALLOCS; i++) {
+			live[rand() % KEEP] = gc_heap_alloc_string(h, 1 + rand() % MAX_LEN);
+		}
+		double ms = now_ms() - t0;
+		if (ms < best) best = ms;
+		fragmentation = gc_heap_fragmentation(h);
+		gc_heap_free(h);
+	}
+	return best;
+}
+
+int main() {
+	printf("%d allocations of 32..256 byte strings, %d live, in a %d KB heap; best of %d\n",
+	       ALLOCS, KEEP, HEAP_SIZE / 1024, REPS);
+	printf("%-12s %10s %12s %14s\n", "allocator", "ms", "Kallocs/s", "fragmentation");
+	double ff = run_ms(GC_FIRST_FIT);
+	double ff_frag = fragmentation;
+	double seg = run_ms(GC_SEGREGATED_FIT);
+	printf("%-12s %10.2f %12.2f %14.2f\n", "first fit", ff, ALLOCS / ff, ff_frag);
+	printf("%-12s %10.2f %12.2f %14.2f\n", "segregated", seg, ALLOCS / seg, fragmentation);
+	printf("speedup %.2f\n", ff / seg);
+	return 0;
+}
@@ -25,194 +25,872 @@ SOFTWARE.
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
 #include "gc_ms.h"
 
+#ifndef DEBUG
 #define DEBUG 1
-#define MAX_ROOTS       100
-#define MAX_OBJECTS     200
-
-static Object **_roots[MAX_ROOTS];
-static int num_roots;
-static int heap_size;
-static byte *start_of_heap;
-static byte *end_of_heap;
-Free_Header *freechunk;
-
-static Object *objects[MAX_OBJECTS];
-static int num_objects;
-static int num_live_objects;
-
-static void gc_mark();
-static void gc_mark_object(Object *p);
-static void gc_sweep();
-static bool gc_in_heap(Object *p);
-static void *gc_alloc(int size);
-static void *gc_alloc_space(int size);
-static bool already_free(Object *p);
-
-void gc_init(int size) {
-	heap_size = size;
-	start_of_heap = malloc(size);
-	end_of_heap = start_of_heap + heap_size -1;
-	num_live_objects = 0;
-	num_roots = 0;
-	num_objects =0;
-	freechunk = (Free_Header *)start_of_heap;
-	freechunk->size = size;
-	freechunk->next = NULL;
-}
-
-void gc_ms() {
+#endif
+#define ROOTS_INITIAL_SIZE      32
+#define MARK_STACK_INITIAL_SIZE 256
+#define SWEEP_PAGE              4096    // heap bytes a lazy sweep step covers
+
+/* Free chunks are kept on segregated lists so most allocations pop one
+ * without searching: an exact list per 8-byte size up to SMALL_MAX, then
+ * one list per power of two. Sizes are rounded up to ALIGN, so any chunk on
+ * a small list fits every request of that size, and any chunk on a list
+ * past a request's own fits it too; only a large request's own list needs
+ * a first-fit walk. Bit i of nonempty says free_lists[i] has chunks.
+ *
+ * GC_TLSF instead keeps Two-Level Segregated Fit lists: a first level per
+ * power of two and TLSF_SL lists splitting each one evenly, with a bitmap
+ * per level. A request is rounded up to the start of the next list, so the
+ * first chunk of any nonempty list from there on fits, and two bit scans
+ * find that list. Allocation is O(1) in the worst case, not just on average,
+ * at the price of passing over a chunk in the request's own list that
+ * might have fit. Sizes under TLSF_SMALL get exact lists.
+ *
+ * Free chunks also end with a footer holding their size, and the chunk after
+ * one has prev_free set, so freeing merges with both neighbours in O(1)
+ * and no two free chunks are ever adjacent. Lists are doubly linked so a
+ * neighbour can come off its list without a search.
+ */
+#define ALIGN                   8
+#define SMALL_MAX               256
+#define NUM_SMALL_LISTS         (SMALL_MAX / ALIGN + 1)
+#define NUM_FREE_LISTS          (NUM_SMALL_LISTS + 32 - 8)   // large lists from 2^8 up
+#define MIN_CHUNK               ((sizeof(Free_Header) + sizeof(int) + ALIGN - 1) & ~(ALIGN - 1))   // room for the footer
+#define TLSF_SL_LOG2            4
+#define TLSF_SL                 (1 << TLSF_SL_LOG2)
+#define TLSF_SMALL              (TLSF_SL * ALIGN)   // exact lists below this
+#define TLSF_FL_SHIFT           7                   // log2(TLSF_SMALL)
+#define TLSF_FL                 (31 - TLSF_FL_SHIFT + 2)
+#define FOOTER(q, size)         (*(int *) (((char *) (q)) + (size) - sizeof(int)))
+
+/* Atomic space. Strings and Vectors have no pointers in them, so those
+ * from gc_heap_alloc_string_atomic() and gc_heap_alloc_vector_atomic() live
+ * outside the heap in blocks of same-sized cells. Marking one
+ * sets its bit in the block's mark bitmap without touching the object, and
+ * sweeping a block is one assignment: its mark bitmap becomes its alloc
+ * bitmap. Anything too big for a cell goes in the heap as usual.
+ */
+#define ATOMIC_BLOCK_SIZE       1024
+static const int atomic_cell_sizes[] = {16, 32, 64, 128, 256, 512};
+#define NUM_ATOMIC_CLASSES      ((int)(sizeof(atomic_cell_sizes) / sizeof(atomic_cell_sizes[0])))
+#define MIN_ATOMIC_BLOCKS       (2 * NUM_ATOMIC_CLASSES) // room for every size even in a tiny heap
+
+typedef struct Atomic_Block {
+	int cell_size;              // 0 while the block is unused
+	uint64_t alloc;             // a bit per cell, 64 cells at most
+	uint64_t mark;
+} Atomic_Block;
+
+/* Everything one heap owns; gc_ms() and friends use default_heap */
+struct gc_heap {
+	Object ***roots;
+	int num_roots;
+	int roots_size;
+	int heap_size;
+	byte *start_of_heap;
+	byte *end_of_heap;
+	gc_allocator allocator;
+	Free_Header *freechunk;     // the single GC_FIRST_FIT list
+	Free_Header *free_lists[NUM_FREE_LISTS];
+	uint64_t nonempty;
+	Free_Header *tlsf_lists[TLSF_FL][TLSF_SL];
+	uint32_t tlsf_fl_bitmap;    // bit fl set if any tlsf_lists[fl][*] has chunks
+	uint32_t tlsf_sl_bitmap[TLSF_FL];
+	Free_Header *last_freed;    // most recent chunk put back on a list
+
+	int num_objects;            // allocated chunks in the heap
+	int num_live_objects;
+
+	byte *atomic_space;         // about heap_size bytes of blocks, made on first use
+	Atomic_Block *atomic_blocks;
+	int num_atomic_blocks;
+
+	bool fork_marking;          // gc_heap_collect() marks in a forked child
+	pid_t snapshot_pid;         // that child, 0 if no snapshot is pending
+	int snapshot_fd;            // read end of the pipe it sends the dead through
+
+	Object **mark_stack;        // marked objects whose fields gc_mark() has yet to follow
+	int mark_stack_top;
+	int mark_stack_size;
+
+	bool lazy_sweep;            // collections only mark; allocation sweeps
+	byte *sweep_next;           // chunk the lazy sweep resumes at, NULL if swept
+};
+
+static gc_heap *default_heap = NULL;
+
+object_metadata String_metaclass = { .name = "String", .size = sizeof(String), .num_fields = 0 };
+object_metadata Vector_metaclass = { .name = "Vector", .size = sizeof(Vector), .num_fields = 0 };
+
+static void gc_mark(gc_heap *h);
+static void gc_mark_object(gc_heap *h, Object *p);
+static void gc_sweep(gc_heap *h);
+static bool gc_in_heap(gc_heap *h, Object *p);
+static void *gc_alloc(gc_heap *h, int size);
+static void *gc_alloc_space(gc_heap *h, int size);
+static void *grow_array(void *array, int *size, int initial_size, size_t elem_size);
+static int free_list_index(int size);
+static Free_Header *free_object(gc_heap *h, Object *p);
+static Free_Header *free_chunk(gc_heap *h, Free_Header *q, int size);
+static void sweep_to(gc_heap *h, byte *limit);
+static void *gc_alloc_sweeping(gc_heap *h, int size);
+static Free_Header *find_chunk(gc_heap *h, int size);
+static Free_Header *find_first_fit(gc_heap *h, int size);
+static Free_Header *find_tlsf(gc_heap *h, int size);
+static void tlsf_mapping(int size, int *fl, int *sl);
+static void set_list_nonempty(gc_heap *h, int size, bool nonempty);
+static Free_Header **list_for(gc_heap *h, int size);
+static void push_chunk(gc_heap *h, Free_Header *q, int size);
+static void unlink_chunk(gc_heap *h, Free_Header *q);
+static void replace_chunk(gc_heap *h, Free_Header *old, Free_Header *q, int size);
+static void set_prev_free(gc_heap *h, byte *p, int prev_free);
+static byte *heap_end(gc_heap *h);
+static void reset_free_space(gc_heap *h);
+static void *gc_alloc_atomic(gc_heap *h, int size);
+static void *gc_alloc_atomic_space(gc_heap *h, int size);
+static void make_atomic_space(gc_heap *h);
+static bool gc_in_atomic_space(gc_heap *h, Object *p);
+static void gc_mark_atomic(gc_heap *h, Object *p);
+static void gc_sweep_atomic(gc_heap *h);
+static void gc_collect_now(gc_heap *h);
+static bool start_snapshot(gc_heap *h);
+static void finish_snapshot(gc_heap *h);
+static bool read_fully(int fd, void *buf, size_t n);
+static bool write_fully(int fd, const void *buf, size_t n);
+
+gc_heap *gc_heap_new(int size) {
+	gc_heap *h = calloc(1, sizeof(gc_heap));
+	if (h == NULL) {
+		fprintf(stderr, "gc: out of memory allocating a heap\n");
+		exit(EXIT_FAILURE);
+	}
+	h->heap_size = size & ~(ALIGN - 1);    // whole chunks, so footers stay aligned
+	h->start_of_heap = malloc(h->heap_size);
+	h->end_of_heap = h->start_of_heap + h->heap_size -1;
+	h->num_live_objects = 0;
+	h->num_roots = 0;
+	h->num_objects =0;
+	reset_free_space(h);
+	return h;
+}
+
+void gc_heap_free(gc_heap *h) {
+	if (h->snapshot_pid > 0) {
+		kill(h->snapshot_pid, SIGKILL);
+		close(h->snapshot_fd);
+		waitpid(h->snapshot_pid, NULL, 0);
+	}
+	free(h->start_of_heap);
+	free(h->roots);
+	free(h->mark_stack);
+	free(h->atomic_space);
+	free(h->atomic_blocks);
+	free(h);
+}
+
+void gc_heap_collect(gc_heap *h) {
 	if(DEBUG) printf("begin_mark_sweep\n");
-	gc_mark();
-	gc_sweep();
+	if (h->sweep_next != NULL) sweep_to(h, heap_end(h));  // marking needs every mark bit clear
+	if (h->fork_marking) {
+		if (h->snapshot_pid > 0) finish_snapshot(h);
+		if (start_snapshot(h)) return;
+	}
+	gc_collect_now(h);
 }
 
-static void gc_mark() {
-	int i;
-    num_live_objects = 0;
-	for (i = 0; i < num_roots; i++) {
-		if (DEBUG) printf("root[%d]=%p\n", i, _roots[i]);
-		Object *p = *_roots[i];
-		if (p != NULL) {
-			if (gc_in_heap(p)) {
-				gc_mark_object(p);
+static void gc_collect_now(gc_heap *h) {
+	if (h->sweep_next != NULL) sweep_to(h, heap_end(h));
+	gc_mark(h);
+	gc_sweep_atomic(h);
+	if (h->lazy_sweep) {
+		h->sweep_next = h->start_of_heap;   // gc_alloc_sweeping() takes it from here
+	}
+	else {
+		gc_sweep(h);
+	}
+}
+
+/* Fork-based snapshot marking. The child gets a copy-on-write snapshot of
+ * the heap and roots as of the fork, marks it, and writes back through a pipe
+ * what it found dead: the number live, the heap offsets of the dead and a
+ * mask of dead cells per atomic block. The parent carries on meanwhile and
+ * frees them at the next gc_heap_collect(), or sooner if an allocation
+ * doesn't fit. Nothing dead in the snapshot can come back to life, and until
+ * then no object or atomic cell is freed, so the offsets and masks are still
+ * right when applied. Objects allocated since the fork survive until the
+ * snapshot after.
+ */
+static bool start_snapshot(gc_heap *h) {
+	int fds[2];
+	if (pipe(fds) < 0) return false;
+	fflush(stdout);             // or the child flushes our buffered output too
+	pid_t pid = fork();
+	if (pid < 0) {
+		close(fds[0]);
+		close(fds[1]);
+		return false;
+	}
+	if (pid == 0) {
+		close(fds[0]);
+		gc_mark(h);
+		int fd = fds[1];
+		byte *end = h->start_of_heap + h->heap_size;
+		byte *q;
+		int num_dead = 0;
+		for (q = h->start_of_heap; q < end; q += ((Object *)q)->header.size) {
+			if (!((Object *)q)->header.free && !((Object *)q)->header.marked) num_dead++;
+		}
+		bool ok = write_fully(fd, &h->num_live_objects, sizeof(int)) &&
+		          write_fully(fd, &num_dead, sizeof(int));
+		for (q = h->start_of_heap; ok && q < end; q += ((Object *)q)->header.size) {
+			if (!((Object *)q)->header.free && !((Object *)q)->header.marked) {
+				int offset = q - h->start_of_heap;
+				ok = write_fully(fd, &offset, sizeof(int));
 			}
 		}
+		int i;
+		if (ok) ok = write_fully(fd, &h->num_atomic_blocks, sizeof(int));
+		for (i = 0; ok && i < h->num_atomic_blocks; i++) {
+			uint64_t dead = h->atomic_blocks[i].alloc & ~h->atomic_blocks[i].mark;
+			ok = write_fully(fd, &dead, sizeof(uint64_t));
+		}
+		fflush(stdout);
+		_exit(ok ? 0 : 1);
+	}
+	close(fds[1]);
+	h->snapshot_pid = pid;
+	h->snapshot_fd = fds[0];
+	return true;
+}
+
+/* Wait for the pending snapshot and free what it found dead; if the child
+ * failed, nothing is freed and the next collection will find it again.
+ */
+static void finish_snapshot(gc_heap *h) {
+	int fd = h->snapshot_fd;
+	int num_live = 0;
+	int num_dead = 0;
+	int *dead = NULL;
+	bool ok = read_fully(fd, &num_live, sizeof(int)) && read_fully(fd, &num_dead, sizeof(int));
+	if (ok && num_dead > 0) {
+		dead = malloc(num_dead * sizeof(int));
+		if (dead == NULL) {
+			fprintf(stderr, "gc: out of memory reading %d dead objects\n", num_dead);
+			exit(EXIT_FAILURE);
+		}
+		ok = read_fully(fd, dead, num_dead * sizeof(int));
 	}
+	int i;
+	if (ok) {
+		for (i = 0; i < num_dead; i++) free_object(h, (Object *)(h->start_of_heap + dead[i]));
+		h->num_live_objects = num_live;
+	}
+	int nb = 0;
+	if (ok) ok = read_fully(fd, &nb, sizeof(int));
+	for (i = 0; ok && i < nb; i++) {
+		uint64_t dead_cells;
+		ok = read_fully(fd, &dead_cells, sizeof(uint64_t));
+		if (ok) {
+			Atomic_Block *b = &h->atomic_blocks[i];
+			b->alloc &= ~dead_cells;
+			if (b->alloc == 0) b->cell_size = 0;
+		}
+	}
+	free(dead);
+	close(fd);
+	waitpid(h->snapshot_pid, NULL, 0);
+	h->snapshot_pid = 0;
 }
 
-static void gc_mark_object(Object *p) {
-	if (!p->header.marked) {
-		if (DEBUG) printf("mark %s@%p\n", p->name, p);
-		p->header.marked = 1;
-        num_live_objects++;
+static bool read_fully(int fd, void *buf, size_t n) {
+	while (n > 0) {
+		ssize_t got = read(fd, buf, n);
+		if (got <= 0) return false;
+		buf = (char *)buf + got;
+		n -= got;
 	}
+	return true;
 }
 
-static void gc_sweep() {
-	Object *p ;
+static bool write_fully(int fd, const void *buf, size_t n) {
+	while (n > 0) {
+		ssize_t put = write(fd, buf, n);
+		if (put <= 0) return false;
+		buf = (const char *)buf + put;
+		n -= put;
+	}
+	return true;
+}
+
+void gc_heap_set_fork_marking(gc_heap *h, bool on) { h->fork_marking = on; }
+
+/* Mark everything reachable from the roots. Marked objects with pointer
+ * fields go on mark_stack rather than being followed recursively, so a long
+ * list can't overflow the C stack.
+ */
+static void gc_mark(gc_heap *h) {
 	int i;
-	for (i = 0; i < num_objects; i++) {
-		p = objects[i];
-		if (p->header.marked) {
-			p->header.marked = 0;
+    h->num_live_objects = 0;
+	for (i = 0; i < h->num_roots; i++) {
+		if (DEBUG) printf("root[%d]=%p\n", i, h->roots[i]);
+		gc_mark_object(h, *h->roots[i]);
+	}
+	while (h->mark_stack_top > 0) {
+		Object *p = h->mark_stack[--h->mark_stack_top];
+		object_metadata *m = p->metadata;
+		for (i = 0; i < m->num_fields; i++) {
+			gc_mark_object(h, *(Object **)((byte *)p + m->field_offsets[i]));
+		}
+	}
+}
+
+static void gc_mark_object(gc_heap *h, Object *p) {
+	if (p == NULL) return;
+	if (gc_in_atomic_space(h, p)) {
+		gc_mark_atomic(h, p);
+		return;
+	}
+	if (!gc_in_heap(h, p) || p->header.marked) return;
+	if (DEBUG) printf("mark %s@%p\n", p->metadata->name, p);
+	p->header.marked = 1;
+	h->num_live_objects++;
+	if (p->metadata->num_fields > 0) {
+		if (h->mark_stack_top >= h->mark_stack_size) {
+			h->mark_stack = grow_array(h->mark_stack, &h->mark_stack_size, MARK_STACK_INITIAL_SIZE, sizeof(Object *));
+		}
+		h->mark_stack[h->mark_stack_top++] = p;
+	}
+}
+
+/* One pass over the heap from start_of_heap, chunk by chunk using the size
+ * in each header: free the allocated chunks that aren't marked and unmark
+ * the rest. Chunks already free stay on their lists.
+ */
+static void gc_sweep(gc_heap *h) {
+	h->sweep_next = h->start_of_heap;
+	sweep_to(h, heap_end(h));
+}
+
+/* Sweep from sweep_next until at or past limit. A freed chunk may merge
+ * with the free one after it, so carry on from the end of what it merged
+ * into; sweep_next then always sits on a real chunk even if allocation
+ * reuses the merged space before the sweep comes back. NULL once done.
+ */
+static void sweep_to(gc_heap *h, byte *limit) {
+	byte *p = h->sweep_next;
+	byte *end = heap_end(h);
+	while (p < end && p < limit) {
+		Object *o = (Object *)p;
+		if (o->header.free) {
+			p += o->header.size;
+		}
+		else if (o->header.marked) {
+			o->header.marked = 0;
+			p += o->header.size;
 		}
 		else {
-			if( p != NULL && !already_free(p)) {
-				Free_Header *q  = (Free_Header*)p;
-				q->size = p->size;
-				q->next = freechunk;
-				freechunk = q;
-				if (DEBUG) {
-					printf("sweep object@%p\n", q);
-				}
-			}
+			Free_Header *q = free_object(h, o);
+			p = (byte *)q + q->header.size;
 		}
 	}
+	h->sweep_next = p < end ? p : NULL;
 }
 
-Vector *gc_alloc_vector(int size) {
-	Vector *v = gc_alloc(sizeof(Vector) + size * sizeof(double)+1);
-	v->header.marked = 0;
+static Free_Header *free_object(gc_heap *h, Object *p) {
+	h->num_objects--;
+	if (DEBUG) {
+		printf("sweep object@%p\n", p);
+	}
+	return free_chunk(h, (Free_Header *)p, p->header.size);
+}
+
+Vector *gc_heap_alloc_vector(gc_heap *h, int size) {
+	Vector *v = gc_alloc(h, sizeof(Vector) + size * sizeof(double)+1);
+	if (v == NULL) return NULL;
 	v->length = size;
-	v->name = "Vector";
+	v->metadata = &Vector_metaclass;
 	memset(v->data, 0, size*sizeof(double));
-	gc_add_objects(v);
 	return v;
 }
 
-String *gc_alloc_string(int size) {
+String *gc_heap_alloc_string(gc_heap *h, int size) {
 	String *s;
-	s = (String *) gc_alloc(sizeof (String) + size + 1);
+	s = (String *) gc_alloc(h, sizeof (String) + size + 1);
+	if (s == NULL) return NULL;
+	memset(s->str, 0, size);
+	s->length = size;
+	s->metadata = &String_metaclass;
+	return s;
+}
+
+/* An instance of the type metadata describes, zeroed so its pointer fields
+ * start out NULL.
+ */
+Object *gc_heap_alloc_object(gc_heap *h, object_metadata *metadata) {
+	if (metadata->size < (int)sizeof(Object)) {
+		fprintf(stderr, "gc: %s is %d bytes, too small for an Object header\n", metadata->name, metadata->size);
+		exit(EXIT_FAILURE);
+	}
+	Object *o = gc_alloc(h, metadata->size);
+	if (o == NULL) return NULL;
+	memset((byte *)o + sizeof(Object), 0, metadata->size - sizeof(Object));
+	o->metadata = metadata;
+	return o;
+}
+
+/* Strings and Vectors that gc_mark() doesn't look inside, in the atomic
+ * space unless too big for a cell.
+ */
+String *gc_heap_alloc_string_atomic(gc_heap *h, int size) {
+	String *s = gc_alloc_atomic(h, sizeof (String) + size + 1);
+	if (s == NULL) return gc_heap_alloc_string(h, size);
 	s->header.marked = 0;
 	memset(s->str, 0, size);
 	s->length = size;
-	s->name = "String";
-	gc_add_objects(s);
+	s->metadata = &String_metaclass;
 	return s;
 }
 
-static void *gc_alloc(int size) {
-	Object *object = gc_alloc_space(size);
+Vector *gc_heap_alloc_vector_atomic(gc_heap *h, int size) {
+	Vector *v = gc_alloc_atomic(h, sizeof(Vector) + size * sizeof(double)+1);
+	if (v == NULL) return gc_heap_alloc_vector(h, size);
+	v->header.marked = 0;
+	v->length = size;
+	v->metadata = &Vector_metaclass;
+	memset(v->data, 0, size*sizeof(double));
+	return v;
+}
+
+static void *gc_alloc(gc_heap *h, int size) {
+	Object *object = gc_alloc_sweeping(h, size);
+	if (NULL == object && h->snapshot_pid > 0) {
+		finish_snapshot(h);     // free what the last snapshot found dead first
+		object = gc_alloc_space(h, size);
+	}
 	if(NULL == object) {
-		gc_ms();
-		object = gc_alloc_space(size);
+		gc_collect_now(h);
+		object = gc_alloc_sweeping(h, size);
 		if (object == NULL) {
 			if (DEBUG) printf("memory is full");
 			return NULL;
 		}
 	}
+	object->header.free = 0;
+	// marked if the lazy sweep has yet to reach it, so the sweep keeps it
+	object->header.marked = h->sweep_next != NULL && (byte *)object >= h->sweep_next;
+	h->num_objects++;
 	return object;
 }
-static void *gc_alloc_space(int size) {
 
-	Free_Header *p = freechunk;
-	Free_Header *prev = NULL;
-	while (p != NULL && size != p->size && p->size < size + sizeof(Free_Header)) {
-		prev = p;
-		p = p->next;
+/* Allocate, sweeping a page at a time while a lazy sweep is pending and
+ * nothing fits.
+ */
+static void *gc_alloc_sweeping(gc_heap *h, int size) {
+	void *p = gc_alloc_space(h, size);
+	while (p == NULL && h->sweep_next != NULL) {
+		sweep_to(h, h->sweep_next + SWEEP_PAGE);
+		p = gc_alloc_space(h, size);
+	}
+	return p;
+}
+static void *gc_alloc_space(gc_heap *h, int size) {
+	size = (size + ALIGN - 1) & ~(ALIGN - 1);
+	if (size < (int)MIN_CHUNK) size = MIN_CHUNK;
+	Free_Header *p;
+	switch (h->allocator) {
+	case GC_FIRST_FIT: p = find_first_fit(h, size); break;
+	case GC_TLSF: p = find_tlsf(h, size); break;
+	default: p = find_chunk(h, size); break;
 	}
 	if (p == NULL) return p;
-
-	Free_Header *nextchunk;
-	if (p->size == size) {
-		nextchunk = p->next;
+	int rest = p->header.size - size;
+	if (rest >= (int)MIN_CHUNK) {
+		// the rest stays free; its neighbours are allocated so there's nothing to merge
+		Free_Header *q = (Free_Header *) (((char *) p) + size);
+		q->header.prev_free = 0;
+		if (h->allocator == GC_FIRST_FIT) {
+			replace_chunk(h, p, q, rest);   // where p was, as first fit always did
+		}
+		else {
+			unlink_chunk(h, p);
+			push_chunk(h, q, rest);
+		}
 	}
 	else {
-		Free_Header *q = (Free_Header *) (((char *) p) + size);
-		q->size = p->size - size;
-		q->next = p->next;
-		nextchunk = q;
+		unlink_chunk(h, p);
+		size = p->header.size;  // too little left to track; the object gets it all
+		set_prev_free(h, (byte *)p + size, 0);
+	}
+	p->header.size = size;
+	p->header.free = 0;
+	p->header.prev_free = 0;    // free chunks never sit next to each other
+	return p;
+}
+
+/* A chunk of at least size bytes still on its list, NULL if none */
+static Free_Header *find_chunk(gc_heap *h, int size) {
+	int i = free_list_index(size);
+	Free_Header *p = h->free_lists[i];
+	if (i >= NUM_SMALL_LISTS) {
+		while (p != NULL && p->header.size < size) p = p->next;
+	}
+	if (p != NULL) return p;
+	uint64_t bigger = i + 1 < 64 ? h->nonempty & (~0ULL << (i + 1)) : 0;
+	if (bigger == 0) return NULL;
+	return h->free_lists[__builtin_ctzll(bigger)];
+}
+
+/* The original allocator: first fit on one list, splitting in place; kept
+ * to compare against.
+ */
+static Free_Header *find_first_fit(gc_heap *h, int size) {
+	Free_Header *p = h->freechunk;
+	while (p != NULL && size != p->header.size && p->header.size < size + (int)MIN_CHUNK) {
+		p = p->next;
 	}
-	p->size = size;
-	if (p == freechunk) {
-		freechunk = nextchunk;
+	return p;
+}
+
+/* The head of a nonempty TLSF list whose every chunk has size bytes or more */
+static Free_Header *find_tlsf(gc_heap *h, int size) {
+	if (size >= TLSF_SMALL) {
+		size += (1 << (31 - __builtin_clz(size) - TLSF_SL_LOG2)) - 1;   // up to the next list
+	}
+	int fl, sl;
+	tlsf_mapping(size, &fl, &sl);
+	uint32_t sl_map = h->tlsf_sl_bitmap[fl] & (~0U << sl);
+	if (sl_map == 0) {
+		uint32_t fl_map = fl + 1 < 32 ? h->tlsf_fl_bitmap & (~0U << (fl + 1)) : 0;
+		if (fl_map == 0) return NULL;
+		fl = __builtin_ctz(fl_map);
+		sl_map = h->tlsf_sl_bitmap[fl];
+	}
+	return h->tlsf_lists[fl][__builtin_ctz(sl_map)];
+}
+
+/* The TLSF list for a chunk of size bytes: fl from its top bit, sl from the
+ * TLSF_SL_LOG2 bits after that.
+ */
+static void tlsf_mapping(int size, int *fl, int *sl) {
+	if (size < TLSF_SMALL) {
+		*fl = 0;
+		*sl = size / ALIGN;
 	}
 	else {
-		prev->next = nextchunk;
+		int top = 31 - __builtin_clz(size);
+		*fl = top - TLSF_FL_SHIFT + 1;
+		*sl = (size >> (top - TLSF_SL_LOG2)) ^ TLSF_SL;
 	}
+}
 
-	return p;
+static int free_list_index(int size) {
+	if (size <= SMALL_MAX) return size / ALIGN;
+	return NUM_SMALL_LISTS + (31 - __builtin_clz(size)) - 8;
+}
+
+static Free_Header **list_for(gc_heap *h, int size) {
+	int fl, sl;
+	switch (h->allocator) {
+	case GC_FIRST_FIT:
+		return &h->freechunk;
+	case GC_TLSF:
+		tlsf_mapping(size, &fl, &sl);
+		return &h->tlsf_lists[fl][sl];
+	default:
+		return &h->free_lists[free_list_index(size)];
+	}
+}
+
+/* Keep the bitmaps over the lists in step as the list for size fills or empties */
+static void set_list_nonempty(gc_heap *h, int size, bool nonempty) {
+	int fl, sl;
+	switch (h->allocator) {
+	case GC_FIRST_FIT:
+		break;
+	case GC_TLSF:
+		tlsf_mapping(size, &fl, &sl);
+		if (nonempty) {
+			h->tlsf_sl_bitmap[fl] |= 1U << sl;
+			h->tlsf_fl_bitmap |= 1U << fl;
+		}
+		else {
+			h->tlsf_sl_bitmap[fl] &= ~(1U << sl);
+			if (h->tlsf_sl_bitmap[fl] == 0) h->tlsf_fl_bitmap &= ~(1U << fl);
+		}
+		break;
+	default:
+		if (nonempty) h->nonempty |= 1ULL << free_list_index(size);
+		else h->nonempty &= ~(1ULL << free_list_index(size));
+		break;
+	}
+}
+
+/* Free size bytes at q, merging with the chunks either side if they're
+ * free: the one after by its header, the one before by the footer it ends
+ * with, which q's prev_free bit says is there. Returns the merged chunk.
+ */
+static Free_Header *free_chunk(gc_heap *h, Free_Header *q, int size) {
+	Free_Header *next = (Free_Header *) (((char *) q) + size);
+	if ((byte *)next < heap_end(h) && next->header.free) {
+		unlink_chunk(h, next);
+		size += next->header.size;
+	}
+	if (q->header.prev_free) {
+		int prev_size = *(int *) (((char *) q) - sizeof(int));
+		q = (Free_Header *) (((char *) q) - prev_size);
+		unlink_chunk(h, q);
+		size += prev_size;
+	}
+	push_chunk(h, q, size);
+	return q;
+}
+
+/* Put q on its list as a free chunk of size bytes, as is */
+static void push_chunk(gc_heap *h, Free_Header *q, int size) {
+	q->header.size = size;
+	q->header.free = 1;
+	q->header.marked = 0;
+	FOOTER(q, size) = size;
+	Free_Header **list = list_for(h, size);
+	q->prev = NULL;
+	q->next = *list;
+	if (*list != NULL) (*list)->prev = q;
+	*list = q;
+	if (q->next == NULL) set_list_nonempty(h, size, true);
+	set_prev_free(h, (byte *)q + size, 1);
+	h->last_freed = q;
+}
+
+static void unlink_chunk(gc_heap *h, Free_Header *q) {
+	Free_Header **list = list_for(h, q->header.size);
+	if (q->prev != NULL) q->prev->next = q->next;
+	else *list = q->next;
+	if (q->next != NULL) q->next->prev = q->prev;
+	if (*list == NULL) set_list_nonempty(h, q->header.size, false);
+}
+
+/* Free chunk q of size bytes takes old's place on the single first-fit list */
+static void replace_chunk(gc_heap *h, Free_Header *old, Free_Header *q, int size) {
+	q->header.size = size;
+	q->header.free = 1;
+	q->header.marked = 0;
+	FOOTER(q, size) = size;
+	q->prev = old->prev;
+	q->next = old->next;
+	if (q->prev != NULL) q->prev->next = q;
+	else h->freechunk = q;
+	if (q->next != NULL) q->next->prev = q;
 }
 
-static bool gc_in_heap(Object *p) {
-	return p >= (Object *) start_of_heap && p <= (Object *) end_of_heap;
+static void set_prev_free(gc_heap *h, byte *p, int prev_free) {
+	if (p < heap_end(h)) ((Object *)p)->header.prev_free = prev_free;
 }
 
-void *get_next_free_addr() {
-	return freechunk;
+static byte *heap_end(gc_heap *h) {
+	return h->start_of_heap + h->heap_size;
 }
 
-static bool already_free(Object *p) {
-	Free_Header *q = freechunk;
-	while (q != NULL) {
-		if (q == (Free_Header *)p) {
-			return true;
-		}else {
-			q = q->next;
+/* The whole heap as one free chunk */
+static void reset_free_space(gc_heap *h) {
+	h->freechunk = NULL;
+	memset(h->free_lists, 0, sizeof(h->free_lists));
+	h->nonempty = 0;
+	memset(h->tlsf_lists, 0, sizeof(h->tlsf_lists));
+	h->tlsf_fl_bitmap = 0;
+	memset(h->tlsf_sl_bitmap, 0, sizeof(h->tlsf_sl_bitmap));
+	((Object *)h->start_of_heap)->header.prev_free = 0;
+	push_chunk(h, (Free_Header *)h->start_of_heap, h->heap_size);
+}
+
+/* 1 - largest free chunk / free bytes: 0 when the free space is all in one
+ * chunk, near 1 when it's in crumbs no bigger request could use.
+ */
+double gc_heap_fragmentation(gc_heap *h) {
+	int free_bytes = 0;
+	int largest = 0;
+	byte *p;
+	for (p = h->start_of_heap; p < heap_end(h); p += ((Object *)p)->header.size) {
+		Object *o = (Object *)p;
+		if (o->header.free) {
+			free_bytes += o->header.size;
+			if (o->header.size > largest) largest = o->header.size;
 		}
 	}
-	return false;
+	return free_bytes == 0 ? 0.0 : 1.0 - (double)largest / free_bytes;
 }
 
-void gc_done() {
-	free(start_of_heap);
+void gc_heap_set_lazy_sweep(gc_heap *h, bool on) {
+	if (!on && h->sweep_next != NULL) sweep_to(h, heap_end(h));
+	h->lazy_sweep = on;
 }
 
-void gc_add_addr_of_root(Object **p)
+void gc_heap_set_allocator(gc_heap *h, gc_allocator allocator) {
+	h->allocator = allocator;
+	reset_free_space(h);
+}
+
+/* A cell for size bytes, collecting if the atomic space is full; NULL if
+ * it's too big for a cell or there's still no room.
+ */
+static void *gc_alloc_atomic(gc_heap *h, int size) {
+	void *p = gc_alloc_atomic_space(h, size);
+	bool fits = size <= atomic_cell_sizes[NUM_ATOMIC_CLASSES-1];
+	if (p == NULL && fits && h->snapshot_pid > 0) {
+		finish_snapshot(h);
+		p = gc_alloc_atomic_space(h, size);
+	}
+	if (p == NULL && fits) {
+		gc_collect_now(h);
+		p = gc_alloc_atomic_space(h, size);
+	}
+	return p;
+}
+
+static void *gc_alloc_atomic_space(gc_heap *h, int size) {
+	int c = 0;
+	while (c < NUM_ATOMIC_CLASSES && atomic_cell_sizes[c] < size) c++;
+	if (c == NUM_ATOMIC_CLASSES) return NULL;
+	if (h->atomic_space == NULL) make_atomic_space(h);
+	int i;
+	int unused = -1;
+	for (i = 0; i < h->num_atomic_blocks; i++) {
+		Atomic_Block *b = &h->atomic_blocks[i];
+		if (b->cell_size == 0 && unused < 0) unused = i;
+		if (b->cell_size != atomic_cell_sizes[c]) continue;
+		int num_cells = ATOMIC_BLOCK_SIZE / b->cell_size;
+		uint64_t free_cells = ~b->alloc & (num_cells == 64 ? ~0ULL : (1ULL << num_cells) - 1);
+		if (free_cells != 0) {
+			int cell = __builtin_ctzll(free_cells);
+			b->alloc |= 1ULL << cell;
+			return h->atomic_space + i * ATOMIC_BLOCK_SIZE + cell * b->cell_size;
+		}
+	}
+	if (unused < 0) return NULL;
+	Atomic_Block *b = &h->atomic_blocks[unused];
+	b->cell_size = atomic_cell_sizes[c];
+	b->alloc = 1;
+	return h->atomic_space + unused * ATOMIC_BLOCK_SIZE;
+}
+
+static void make_atomic_space(gc_heap *h) {
+	h->num_atomic_blocks = (h->heap_size + ATOMIC_BLOCK_SIZE - 1) / ATOMIC_BLOCK_SIZE;
+	if (h->num_atomic_blocks < MIN_ATOMIC_BLOCKS) h->num_atomic_blocks = MIN_ATOMIC_BLOCKS;
+	h->atomic_space = malloc(h->num_atomic_blocks * ATOMIC_BLOCK_SIZE);
+	h->atomic_blocks = calloc(h->num_atomic_blocks, sizeof(Atomic_Block));
+	if (h->atomic_space == NULL || h->atomic_blocks == NULL) {
+		fprintf(stderr, "gc: out of memory allocating %d atomic blocks\n", h->num_atomic_blocks);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static bool gc_in_atomic_space(gc_heap *h, Object *p) {
+	return h->atomic_space != NULL && (byte *)p >= h->atomic_space &&
+	       (byte *)p < h->atomic_space + h->num_atomic_blocks * ATOMIC_BLOCK_SIZE;
+}
+
+static void gc_mark_atomic(gc_heap *h, Object *p) {
+	int i = ((byte *)p - h->atomic_space) / ATOMIC_BLOCK_SIZE;
+	Atomic_Block *b = &h->atomic_blocks[i];
+	uint64_t bit = 1ULL << (((byte *)p - h->atomic_space) % ATOMIC_BLOCK_SIZE / b->cell_size);
+	if (!(b->mark & bit)) {
+		if (DEBUG) printf("mark atomic@%p\n", p);
+		b->mark |= bit;
+		h->num_live_objects++;
+	}
+}
+
+/* Whatever was marked stays allocated; a block with nothing marked is free for any size */
+static void gc_sweep_atomic(gc_heap *h) {
+	int i;
+	for (i = 0; i < h->num_atomic_blocks; i++) {
+		Atomic_Block *b = &h->atomic_blocks[i];
+		b->alloc = b->mark;
+		b->mark = 0;
+		if (b->alloc == 0) b->cell_size = 0;
+	}
+}
+
+static bool gc_in_heap(gc_heap *h, Object *p) {
+	return p >= (Object *) h->start_of_heap && p <= (Object *) h->end_of_heap;
+}
+
+void *gc_heap_next_free_addr(gc_heap *h) {
+	return h->last_freed;
+}
+
+void gc_heap_add_addr_of_root(gc_heap *h, Object **p)
 {
-	_roots[num_roots++] = p;
+	if (h->num_roots >= h->roots_size) {
+		h->roots = grow_array(h->roots, &h->roots_size, ROOTS_INITIAL_SIZE, sizeof(Object **));
+	}
+	h->roots[h->num_roots++] = p;
 }
 
-void gc_add_objects(Object *p) {
-	objects[num_objects++] = p;
+/* Double the capacity of array (initial_size if empty), updating *size */
+static void *grow_array(void *array, int *size, int initial_size, size_t elem_size) {
+	int n = *size == 0 ? initial_size : *size * 2;
+	void *bigger = realloc(array, n * elem_size);
+	if (bigger == NULL) {
+		fprintf(stderr, "gc: out of memory growing internal array to %d elements\n", n);
+		exit(EXIT_FAILURE);
+	}
+	*size = n;
+	return bigger;
 }
 
-int gc_num_roots() { return num_roots; }
+int gc_heap_num_roots(gc_heap *h) { return h->num_roots; }
+
+int gc_heap_num_live_object(gc_heap *h) { return h->num_live_objects; }
+
+int gc_heap_num_object(gc_heap *h) { return h->num_objects; }
+
+void gc_heap_set_num_roots(gc_heap *h, int roots) { h->num_roots = roots; }
+
+// the original single heap API, on default_heap
+
+void gc_init(int size) { default_heap = gc_heap_new(size); }
+
+void gc_done() {
+	gc_heap_free(default_heap);
+	default_heap = NULL;
+}
+
+void gc_ms() { gc_heap_collect(default_heap); }
+
+double gc_fragmentation() { return gc_heap_fragmentation(default_heap); }
+
+void gc_set_lazy_sweep(bool on) { gc_heap_set_lazy_sweep(default_heap, on); }
+
+void gc_set_allocator(gc_allocator allocator) { gc_heap_set_allocator(default_heap, allocator); }
+
+void gc_set_fork_marking(bool on) { gc_heap_set_fork_marking(default_heap, on); }
+
+Vector *gc_alloc_vector(int size) { return gc_heap_alloc_vector(default_heap, size); }
+
+String *gc_alloc_string(int size) { return gc_heap_alloc_string(default_heap, size); }
+
+Object *gc_alloc_object(object_metadata *metadata) { return gc_heap_alloc_object(default_heap, metadata); }
+
+Vector *gc_alloc_vector_atomic(int size) { return gc_heap_alloc_vector_atomic(default_heap, size); }
+
+String *gc_alloc_string_atomic(int size) { return gc_heap_alloc_string_atomic(default_heap, size); }
+
+void gc_add_addr_of_root(Object **p) { gc_heap_add_addr_of_root(default_heap, p); }
+
+int gc_num_roots() { return gc_heap_num_roots(default_heap); }
+
+int gc_num_live_object() { return gc_heap_num_live_object(default_heap); }
 
-int gc_num_live_object() { return num_live_objects; }
+int gc_num_object() { return gc_heap_num_object(default_heap); }
 
-int gc_num_object() { return num_objects; }
+void gc_set_num_roots(int roots) { gc_heap_set_num_roots(default_heap, roots); }
 
-void gc_set_num_roots(int roots) { num_roots = roots; }
\ No newline at end of file
+void *get_next_free_addr() { return gc_heap_next_free_addr(default_heap); }
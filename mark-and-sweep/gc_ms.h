@@ -29,51 +29,142 @@ SOFTWARE.
 
 typedef unsigned char byte;
 
+/* Every chunk of the heap, allocated or free, starts with one of these so
+ * gc_ms() can sweep by walking the heap from chunk to chunk.
+ */
 typedef struct GC_Fields {
 	byte marked;
+	byte free;          // on a free list
+	byte prev_free;     // the chunk just before this one is free
+	int size;           // bytes in the chunk, this header included
 } GC_Fields;
 
+/* Describes the layout of one type of heap object; one instance per type.
+ * gc_ms() follows the pointer fields it lists, so objects from
+ * gc_alloc_object() can point at each other and at Strings and Vectors.
+ */
+typedef struct {
+	const char *name;		// "Node"
+	int size;				// size in bytes of an instance, including the Object header
+	int num_fields;			// how many pointer fields in an instance
+	int field_offsets[];	// byte offset of each pointer field from start of object
+} object_metadata;
+
+/* Every object starts like this; a type of your own adds its fields after */
 typedef struct Object {
     GC_Fields header;
-    int size;
-    char *name;
+    object_metadata *metadata;
 } Object;
 
 typedef struct Vector {
     GC_Fields header;
-    char *name;
+    object_metadata *metadata;
     int length;
     double data[];
 }Vector;
 
 typedef struct String {
 	GC_Fields header;
-    char *name;
+    object_metadata *metadata;
 	int length;
 	char str[];
 }String;
 
+/* A free chunk; its last int repeats size so the chunk after can find it */
 typedef struct _Free_Header {
-	int size;
+	GC_Fields header;
 	struct _Free_Header *next;
+	struct _Free_Header *prev;
 }Free_Header;
 
 
+extern object_metadata String_metaclass;
+extern object_metadata Vector_metaclass;
+
 extern void gc_init(int size);
 extern void gc_done();
 
 extern void gc_ms();
 extern Vector *gc_alloc_vector(int size);
 extern String *gc_alloc_string(int size);
+extern Object *gc_alloc_object(object_metadata *metadata);
 extern void gc_add_addr_of_root(Object **p);
-extern void gc_add_objects(Object *p);
 extern int gc_num_roots();
 extern int gc_num_live_object();
 extern int gc_num_object();
 extern void gc_set_num_roots(int roots);
 extern void *get_next_free_addr();
 
+/* How broken up the free space is: 0 if it's one chunk, approaching 1 as the
+ * largest chunk becomes a vanishing share of all free bytes.
+ */
+extern double gc_fragmentation();
+
+/* Have gc_ms() only mark, leaving the sweep to allocation: when nothing fits,
+ * the allocator sweeps the next few KB of the heap and tries again. The pause
+ * is then marking alone, and the sweep is spread over the allocations that
+ * need the space. The next gc_ms() finishes any sweep left over first.
+ */
+extern void gc_set_lazy_sweep(bool on);
+
+/* How the heap finds free space. GC_SEGREGATED_FIT, the default, pops most
+ * sizes off an exact list but may search among big chunks. GC_TLSF (Two-
+ * Level Segregated Fit) finds space for any size in a bounded number of
+ * steps, for code that can't afford the occasional slow allocation, and may
+ * use a bigger chunk than needed. GC_FIRST_FIT is the original single list,
+ * kept to compare against. Setting it empties the heap, so do it before
+ * allocating anything.
+ */
+typedef enum { GC_SEGREGATED_FIT, GC_TLSF, GC_FIRST_FIT } gc_allocator;
+
+extern void gc_set_allocator(gc_allocator allocator);
+
+/* Like gc_alloc_string() and gc_alloc_vector(), but for ones the program
+ * will never store pointers in. They go in a separate space that marking
+ * doesn't look inside and that's swept a block of bitmaps at a time.
+ */
+extern Vector *gc_alloc_vector_atomic(int size);
+extern String *gc_alloc_string_atomic(int size);
+
+/* Have gc_ms() fork and mark a copy-on-write snapshot of the heap in the
+ * child while the program keeps running. What the snapshot found dead is
+ * freed at the next gc_ms(), or earlier if an allocation doesn't fit, so
+ * gc_num_object() drops one collection later than usual. Falls back to
+ * collecting in place if fork() fails. Not for programs with other threads.
+ */
+extern void gc_set_fork_marking(bool on);
+
 #define gc_begin_func()		int __save = gc_num_roots()
 #define gc_end_func()		gc_set_num_roots(__save)
 #define gc_add_root(p)		gc_add_addr_of_root((Object **)&(p));
+
+/* An independent heap. The calls above work on a default heap made by
+ * gc_init(); gc_heap_xxx(h, ...) do the same on heap h, so a program can
+ * keep several heaps, e.g. one per thread, without sharing any state.
+ */
+typedef struct gc_heap gc_heap;
+
+extern gc_heap *gc_heap_new(int size);
+extern void gc_heap_free(gc_heap *h);
+
+extern void gc_heap_collect(gc_heap *h);
+extern Vector *gc_heap_alloc_vector(gc_heap *h, int size);
+extern String *gc_heap_alloc_string(gc_heap *h, int size);
+extern Object *gc_heap_alloc_object(gc_heap *h, object_metadata *metadata);
+extern Vector *gc_heap_alloc_vector_atomic(gc_heap *h, int size);
+extern String *gc_heap_alloc_string_atomic(gc_heap *h, int size);
+extern void gc_heap_add_addr_of_root(gc_heap *h, Object **p);
+extern int gc_heap_num_roots(gc_heap *h);
+extern int gc_heap_num_live_object(gc_heap *h);
+extern int gc_heap_num_object(gc_heap *h);
+extern void gc_heap_set_num_roots(gc_heap *h, int roots);
+extern void *gc_heap_next_free_addr(gc_heap *h);
+extern double gc_heap_fragmentation(gc_heap *h);
+extern void gc_heap_set_lazy_sweep(gc_heap *h, bool on);
+extern void gc_heap_set_fork_marking(gc_heap *h, bool on);
+extern void gc_heap_set_allocator(gc_heap *h, gc_allocator allocator);
+
+#define gc_heap_begin_func(h)	int __save = gc_heap_num_roots(h)
+#define gc_heap_end_func(h)		gc_heap_set_num_roots(h, __save)
+#define gc_heap_add_root(h, p)	gc_heap_add_addr_of_root(h, (Object **)&(p));
 #endif //GC_GC_MS_H
@@ -0,0 +1,187 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include "gc_ms.h"
+
+/* Latency of single allocations under each allocator, and of the sweep
+ * per chunk it frees. A fixed set of rooted slots holds strings of random
+ * sizes up to a couple of KB, so requests hit the big lists where
+ * segregated fit may search and first fit always walks. Each round
+ * collects, leaving a hole for every string dropped in the round before,
+ * then times each of its allocations on its own. Rounds of more
+ * allocations leave more holes, so the worst case of an allocator that
+ * searches grows with them while a bounded one stays put, and the sweep
+ * frees more chunks into longer lists, which costs no more per chunk if
+ * freeing and coalescing are O(1). The collection only marks, with lazy
+ * sweep on; turning lazy sweep off then sweeps the heap, timed on its own.
+ *
+ * The same seed gives the same heap and the same requests in every run,
+ * so each allocation is timed REPS times and keeps its fastest. A slow
+ * path in the allocator is slow every time; an interrupt or preemption
+ * almost never hits the same allocation twice, and every page of the
+ * heap is touched before timing starts, so page faults don't either.
+ * Pass -realtime to also pin to one CPU at SCHED_FIFO priority with
+ * memory locked; that keeps other processes off the CPU, so don't use it
+ * on a machine with only one. Built with DEBUG off.
+ */
+
+#define SLOTS		4096		// live strings at any time
+#define MAX_LEN		2000		// Strings of 32..2032 bytes
+#define HEAP_SIZE	(32*1024*1024)
+#define WARMUP		3			// untimed rounds to reach a steady heap
+#define ROUNDS		4			// timed rounds
+#define REPS		5
+#define BUCKETS		12			// bucket b holds latencies under 2^(b+5) ns, the last all the rest
+
+static const int round_sizes[] = {1024, 4096, 16384};
+#define NUM_LEVELS	((int)(sizeof(round_sizes) / sizeof(round_sizes[0])))
+
+static const char *names[] = {"first fit", "segregated", "TLSF"};
+static const gc_allocator allocators[] = {GC_FIRST_FIT, GC_SEGREGATED_FIT, GC_TLSF};
+#define NUM_ALLOCATORS	((int)(sizeof(allocators) / sizeof(allocators[0])))
+
+static long now_ns() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000L + t.tv_nsec;
+}
+
+/* Touch every page of h's heap so no timing includes a first touch: fill
+ * it with big garbage strings and collect them back into one chunk.
+ */
+static void prefault(gc_heap *h) {
+	int i;
+	for (i = 0; i < HEAP_SIZE / 65536 - 1; i++) {
+		String *s = gc_heap_alloc_string(h, 65000);
+		memset(s->str, 1, 65000);
+	}
+	gc_heap_collect(h);
+}
+
+/* One run: ROUNDS timed rounds of round allocations. Lowers best[i] to this
+ * run's time for allocation i; returns sweep ns per chunk freed.
+ */
+static double run(gc_allocator allocator, int round, long *best) {
+	static String *live[SLOTS];
+	gc_heap *h = gc_heap_new(HEAP_SIZE);
+	gc_heap_set_allocator(h, allocator);
+	prefault(h);
+	int i;
+	srand(42);
+	for (i = 0; i < SLOTS; i++) {
+		gc_heap_add_root(h, live[i]);
+		live[i] = gc_heap_alloc_string(h, rand() % MAX_LEN);
+	}
+	long sweep_ns = 0;
+	long freed = 0;
+	int r;
+	int n = 0;
+	for (r = 0; r < WARMUP + ROUNDS; r++) {
+		int objects = gc_heap_num_object(h);
+		gc_heap_set_lazy_sweep(h, true);
+		gc_heap_collect(h);                 // only marks
+		long t0 = now_ns();
+		gc_heap_set_lazy_sweep(h, false);   // sweeps the whole heap
+		if (r >= WARMUP) {
+			sweep_ns += now_ns() - t0;
+			freed += objects - gc_heap_num_object(h);
+		}
+		for (i = 0; i < round; i++) {
+			int slot = rand() % SLOTS;
+			int len = rand() % MAX_LEN;
+			t0 = now_ns();
+			live[slot] = gc_heap_alloc_string(h, len);
+			long ns = now_ns() - t0;
+			if (r >= WARMUP) {
+				if (ns < best[n]) best[n] = ns;
+				n++;
+			}
+		}
+	}
+	gc_heap_free(h);
+	return (double)sweep_ns / freed;
+}
+
+static int compare_longs(const void *a, const void *b) {
+	long x = *(const long *)a, y = *(const long *)b;
+	return x < y ? -1 : x > y;
+}
+
+/* Stay on the CPU we started on, ahead of ordinary processes, and keep
+ * every page we touch resident.
+ */
+static void realtime() {
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	CPU_SET(sched_getcpu(), &cpus);
+	if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0) printf("can't pin to one CPU\n");
+	struct sched_param param = { .sched_priority = 1 };
+	if (sched_setscheduler(0, SCHED_FIFO, &param) != 0) printf("can't run SCHED_FIFO\n");
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) printf("can't lock memory\n");
+}
+
+static void print_histogram(long *samples[], int n) {
+	int a, b, i;
+	printf("%12s", "ns");
+	for (a = 0; a < NUM_ALLOCATORS; a++) printf(" %12s", names[a]);
+	printf("\n");
+	for (b = 0; b < BUCKETS; b++) {
+		long limit = 1L << (b + 5);
+		if (b < BUCKETS - 1) printf("   < %7ld", limit);
+		else printf("  >= %7ld", limit >> 1);
+		for (a = 0; a < NUM_ALLOCATORS; a++) {
+			int count = 0;
+			for (i = 0; i < n; i++) {
+				long ns = samples[a][i];
+				if ((b == 0 || ns >= limit >> 1) && (b == BUCKETS - 1 || ns < limit)) count++;
+			}
+			printf(" %12d", count);
+		}
+		printf("\n");
+	}
+}
+
+int main(int argc, char *argv[]) {
+	if (argc > 1 && strcmp(argv[1], "-realtime") == 0) realtime();
+	printf("strings of 32..%d bytes, %d live, in a %d MB heap; per allocation, fastest of %d runs\n",
+	       MAX_LEN + 32, SLOTS, HEAP_SIZE / (1024 * 1024), REPS);
+	long *samples[NUM_ALLOCATORS];
+	int level, a, i, rep;
+	for (level = 0; level < NUM_LEVELS; level++) {
+		int n = ROUNDS * round_sizes[level];
+		double sweep[NUM_ALLOCATORS];
+		for (a = 0; a < NUM_ALLOCATORS; a++) {
+			samples[a] = malloc(n * sizeof(long));
+			for (i = 0; i < n; i++) samples[a][i] = 1L << 62;
+			sweep[a] = 1e30;
+			for (rep = 0; rep < REPS; rep++) {
+				double ns = run(allocators[a], round_sizes[level], samples[a]);
+				if (ns < sweep[a]) sweep[a] = ns;
+			}
+			qsort(samples[a], n, sizeof(long), compare_longs);
+		}
+		printf("\n%d allocations between collections, %d timed\n%12s", round_sizes[level], n, "ns");
+		for (a = 0; a < NUM_ALLOCATORS; a++) printf(" %12s", names[a]);
+		printf("\n%12s", "p50");
+		for (a = 0; a < NUM_ALLOCATORS; a++) printf(" %12ld", samples[a][n / 2]);
+		printf("\n%12s", "p99");
+		for (a = 0; a < NUM_ALLOCATORS; a++) printf(" %12ld", samples[a][n * 99 / 100]);
+		printf("\n%12s", "p99.9");
+		for (a = 0; a < NUM_ALLOCATORS; a++) printf(" %12ld", samples[a][n * 999 / 1000]);
+		printf("\n%12s", "max");
+		for (a = 0; a < NUM_ALLOCATORS; a++) printf(" %12ld", samples[a][n - 1]);
+		printf("\n%12s", "sweep/free");
+		for (a = 0; a < NUM_ALLOCATORS; a++) printf(" %12.1f", sweep[a]);
+		printf("\n");
+		if (level == NUM_LEVELS - 1) {
+			printf("\nhistogram for %d allocations between collections\n", round_sizes[level]);
+			print_histogram(samples, n);
+		}
+		for (a = 0; a < NUM_ALLOCATORS; a++) free(samples[a]);
+	}
+	return 0;
+}
@@ -23,6 +23,7 @@ SOFTWARE.
 */
 
 #include <stdio.h>
+#include <stddef.h>
 #include <string.h>
 #include "gc_ms.h"
 
@@ -66,7 +67,7 @@ void test_alloc_strs_set_null_gc() {
 	strcpy(b->str, "mom");
 	gc_add_root(a);
 
-	void * last_sweep_addr = b;
+	void * last_sweep_addr = a; // b and the rest of the heap merge into a's chunk
 	ASSERT(1, gc_num_roots());
 	ASSERT(2, gc_num_object());
 
@@ -74,6 +75,7 @@ void test_alloc_strs_set_null_gc() {
 	gc_ms();
 	ASSERT(0, gc_num_live_object());
 	ASSERT(last_sweep_addr,get_next_free_addr());
+	ASSERT(1, (gc_fragmentation() == 0.0));
 	gc_done();
 }
 
@@ -150,6 +152,256 @@ void test_local_roots_in_called_func() {
 	gc_done();
 }
 
+void test_more_objects_than_old_registry_limit() {
+	gc_init(20000);
+	String *a;
+	gc_add_root(a);
+	int i;
+	for (i = 0; i < 300; i++) {
+		a = gc_alloc_string(10);
+	}
+	ASSERT(300, gc_num_object());
+	gc_ms();
+	ASSERT(1, gc_num_live_object());
+	ASSERT(1, gc_num_object());
+	gc_done();
+}
+
+void test_independent_heaps() {
+	gc_heap *h1 = gc_heap_new(1000);
+	gc_heap *h2 = gc_heap_new(1000);
+	String *a;
+	String *b;
+	gc_heap_add_root(h1, a);
+	gc_heap_add_root(h2, b);
+	a = gc_heap_alloc_string(h1, 10);
+	b = gc_heap_alloc_string(h2, 10);
+	gc_heap_alloc_string(h2, 10);
+	ASSERT(1, gc_heap_num_object(h1));
+	ASSERT(2, gc_heap_num_object(h2));
+
+	b = NULL;
+	gc_heap_collect(h2);
+	ASSERT(0, gc_heap_num_live_object(h2));
+	ASSERT(1, gc_heap_num_object(h1)); // collecting h2 leaves h1 alone
+	gc_heap_collect(h1);
+	ASSERT(1, gc_heap_num_live_object(h1));
+	gc_heap_free(h1);
+	gc_heap_free(h2);
+}
+
+void test_atomic_strings_skip_registry() {
+	gc_init(1000);
+	String *s;
+	Vector *v;
+	gc_add_root(s);
+	gc_add_root(v);
+	s = gc_alloc_string_atomic(10);
+	strcpy(s->str, "atomic");
+	String *s_addr = s;
+	v = gc_alloc_vector_atomic(3);
+	v->data[2] = 3.0;
+	ASSERT(0, gc_num_object()); // neither is in the heap
+	int i;
+	for (i = 0; i < 1000; i++) {
+		gc_alloc_string_atomic(10); // swept a block at a time as the space fills
+	}
+	ASSERT(1, (s == s_addr));
+	ASSERT(0, strcmp(s->str, "atomic"));
+	ASSERT(3, (int)v->data[2]);
+	ASSERT(0, gc_num_object());
+	gc_ms();
+	ASSERT(2, gc_num_live_object());
+	gc_done();
+}
+
+void test_fork_marking_frees_dead_objects_lazily() {
+	gc_init(1000);
+	gc_set_fork_marking(true);
+	gc_begin_func();
+	String *a = gc_alloc_string(10);
+	gc_add_root(a);
+	strcpy(a->str, "live");
+	gc_alloc_string(10);
+	gc_ms();                    // marking in the child, nothing freed yet
+	ASSERT(2, gc_num_object());
+	String *b = gc_alloc_string(10);
+	ASSERT(3, gc_num_object());
+	gc_ms();                    // frees the garbage, b waits for the next snapshot
+	ASSERT(2, gc_num_object());
+	ASSERT(1, gc_num_live_object());
+	ASSERT(0, strcmp(a->str, "live"));
+	int i;
+	for (i = 0; i < 100; i++) {
+		b = gc_alloc_string(10); // full heaps take the pending result, then collect in place
+	}
+	ASSERT(1, (b != NULL));
+	ASSERT(0, strcmp(a->str, "live"));
+	gc_end_func();
+	gc_done();
+}
+
+void test_freed_chunk_reused_for_same_size() {
+	gc_init(1000);
+	String *a = gc_alloc_string(10);
+	String *b = gc_alloc_string(10);
+	String *c = gc_alloc_string(10);
+	gc_add_root(a);
+	gc_add_root(c);
+	void *b_addr = b;
+	b = NULL;
+	gc_ms();
+	ASSERT(2, gc_num_live_object());
+	ASSERT(b_addr, get_next_free_addr());
+	String *big = gc_alloc_string(100);
+	ASSERT(1, ((void *)big != b_addr)); // too small for it
+	String *d = gc_alloc_string(12);    // same size once rounded up
+	ASSERT(b_addr, (void *)d);
+	gc_done();
+}
+
+void test_sweep_walks_heap_in_address_order() {
+	gc_init(1000);
+	String *a = gc_alloc_string(10);
+	String *b = gc_alloc_string(100);
+	String *c = gc_alloc_string(10);
+	gc_add_root(b);
+	void *a_addr = a;
+	void *c_addr = c;
+	a = c = NULL;
+	gc_ms();
+	ASSERT(1, gc_num_object());
+	ASSERT(c_addr, get_next_free_addr()); // freed last, being highest
+	String *d = gc_alloc_string(10);
+	ASSERT(a_addr, (void *)d);          // an exact fit, where c merged with the free space after it
+	ASSERT(2, gc_num_object());
+	gc_done();
+}
+
+void test_coalesced_space_fits_big_vector() {
+	gc_init(1000);
+	String *s[10];
+	int i;
+	for (i = 0; i < 10; i++) {
+		s[i] = gc_alloc_string(60);
+		gc_add_root(s[i]);
+	}
+	for (i = 0; i < 10; i += 2) s[i] = NULL;
+	gc_ms();
+	ASSERT(1, (gc_fragmentation() > 0.5)); // holes between the survivors
+	for (i = 1; i < 10; i += 2) s[i] = NULL;
+	gc_ms();
+	ASSERT(0, gc_num_object());
+	ASSERT(1, (gc_fragmentation() == 0.0)); // all one chunk again
+	Vector *v = gc_alloc_vector(100);      // more than any hole held
+	ASSERT(1, (v != NULL));
+	ASSERT(1, gc_num_object());
+	gc_done();
+}
+
+void test_lazy_sweep_frees_on_allocation() {
+	gc_init(1000);
+	gc_set_lazy_sweep(true);
+	gc_begin_func();
+	String *a = gc_alloc_string(10);
+	gc_add_root(a);
+	strcpy(a->str, "live");
+	int i;
+	for (i = 0; i < 5; i++) gc_alloc_string(10);
+	gc_ms();                    // marks only
+	ASSERT(1, gc_num_live_object());
+	ASSERT(6, gc_num_object());
+	String *b = gc_alloc_string(10); // ahead of the sweep, so allocated marked
+	gc_add_root(b);
+	strcpy(b->str, "new");
+	ASSERT(7, gc_num_object());
+	for (i = 0; i < 100; i++) gc_alloc_string(10); // the sweep runs as the heap fills
+	ASSERT(1, (gc_num_object() < 100));
+	ASSERT(0, strcmp(a->str, "live"));
+	ASSERT(0, strcmp(b->str, "new"));
+	gc_ms();
+	ASSERT(2, gc_num_live_object());
+	gc_end_func();
+	gc_done();
+}
+
+typedef struct Node {
+	GC_Fields header;
+	object_metadata *metadata;
+	struct Node *next;
+	String *label;
+} Node;
+
+object_metadata Node_metaclass = {
+	.name = "Node", .size = sizeof(Node), .num_fields = 2,
+	.field_offsets = {offsetof(Node, next), offsetof(Node, label)}
+};
+
+void test_marking_follows_pointer_fields() {
+	gc_init(2000);
+	Node *head = NULL;
+	gc_add_root(head);
+	int i;
+	for (i = 0; i < 5; i++) {
+		Node *n = (Node *)gc_alloc_object(&Node_metaclass);
+		ASSERT(1, (n->next == NULL && n->label == NULL));
+		n->next = head;
+		head = n;
+		n->label = i % 2 == 0 ? gc_alloc_string(3) : gc_alloc_string_atomic(3);
+		n->label->str[0] = 'a' + i;
+	}
+	gc_alloc_string(10);        // unreachable
+	ASSERT(11, gc_num_object() + 2); // 3 labels in the heap, 2 atomic
+	gc_ms();
+	ASSERT(10, gc_num_live_object()); // only head is a root
+	ASSERT(8, gc_num_object());
+	Node *n = head;
+	for (i = 4; i >= 0; i--, n = n->next) {
+		ASSERT('a' + i, n->label->str[0]);
+	}
+	head->next->next = NULL;    // drop the last three and their labels
+	gc_ms();
+	ASSERT(4, gc_num_live_object());
+	ASSERT(3, gc_num_object());
+	gc_done();
+}
+
+void test_tlsf_allocator_reuses_and_merges() {
+	gc_init(8000);
+	gc_set_allocator(GC_TLSF);
+	String *s[12];
+	int i;
+	for (i = 0; i < 12; i++) {
+		s[i] = gc_alloc_string(20 + 40 * i); // small and large lists both
+		gc_add_root(s[i]);
+	}
+	void *hole = s[9];          // a 408 byte chunk on the 400..415 list
+	s[9] = NULL;
+	gc_ms();
+	ASSERT(11, gc_num_object());
+	String *t = gc_alloc_string(380 + 3);       // 408 bytes too, but rounded up to the next list
+	ASSERT(1, ((void *)t != hole));
+	t = gc_alloc_string(20);                    // no small chunks free, so the hole splits
+	ASSERT(hole, (void *)t);
+	for (i = 0; i < 12; i++) s[i] = NULL;
+	gc_ms();
+	ASSERT(0, gc_num_object());
+	ASSERT(1, (gc_fragmentation() == 0.0));
+	Vector *v = gc_alloc_vector(950);           // nearly the whole heap
+	ASSERT(1, (v != NULL));
+	gc_done();
+}
+
+void test_alloc_too_big_returns_null() {
+	gc_init(1000);
+	ASSERT(1, (gc_alloc_string(5000) == NULL));
+	ASSERT(1, (gc_alloc_vector(1000) == NULL));
+	ASSERT(1, (gc_alloc_string_atomic(5000) == NULL));  // too big for a cell, so it tries the heap
+	ASSERT(1, (gc_alloc_vector_atomic(1000) == NULL));
+	ASSERT(1, (gc_alloc_string(3) != NULL));
+	gc_done();
+}
+
 int main(int argc, char *argv[]) {
 	TEST(test_empty);
 	TEST(test_alloc_str_still_alive_after_sweep);
@@ -157,6 +409,17 @@ int main(int argc, char *argv[]) {
 	TEST(test_alloc_vector_sweep_nothing);
 	TEST(test_alloc_vector_gc_twice);
 	TEST(test_local_roots_in_called_func);
+	TEST(test_more_objects_than_old_registry_limit);
+	TEST(test_independent_heaps);
+	TEST(test_atomic_strings_skip_registry);
+	TEST(test_fork_marking_frees_dead_objects_lazily);
+	TEST(test_freed_chunk_reused_for_same_size);
+	TEST(test_sweep_walks_heap_in_address_order);
+	TEST(test_coalesced_space_fits_big_vector);
+	TEST(test_lazy_sweep_frees_on_allocation);
+	TEST(test_marking_follows_pointer_fields);
+	TEST(test_tlsf_allocator_reuses_and_merges);
+	TEST(test_alloc_too_big_returns_null);
 	return 0;
 }
 
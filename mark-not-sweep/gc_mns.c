@@ -25,29 +25,74 @@ SOFTWARE.
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include "gc_mns.h"
 
 #define DEBUG 1
-#define MAX_ROOTS       100
-#define MAX_OBJECTS     200
-
-static Object **_roots[MAX_ROOTS];
-static int num_roots;
-static int heap_size;
-static byte *start_of_heap;
-static byte *end_of_heap;
-void *freechunk;
-
-static Object *objects[MAX_OBJECTS];
-static int num_objects;
-static int num_live_objects;
-
-static void gc_mark();
-static void gc_mark_object(Object *p);
-static void gc_clear_mark();
-static bool gc_in_heap(Object *p);
-static void *gc_alloc(int size);
-static void *gc_alloc_space(int size);
+#define ROOTS_INITIAL_SIZE      32
+#define MARK_STACK_INITIAL_SIZE 256
+#define OBJECTS_INITIAL_SIZE    256
+
+/* Atomic space. Strings and Vectors have no pointers in them, so those
+ * from gc_heap_alloc_string_atomic() and gc_heap_alloc_vector_atomic() live
+ * outside the heap and objects[] in blocks of same-sized cells. Marking one
+ * sets its bit in the block's mark bitmap without touching the object, and
+ * sweeping a block is one assignment: its mark bitmap becomes its alloc
+ * bitmap. Anything too big for a cell goes in the heap as usual.
+ */
+#define ATOMIC_BLOCK_SIZE       1024
+static const int atomic_cell_sizes[] = {16, 32, 64, 128, 256, 512};
+#define NUM_ATOMIC_CLASSES      ((int)(sizeof(atomic_cell_sizes) / sizeof(atomic_cell_sizes[0])))
+#define MIN_ATOMIC_BLOCKS       (2 * NUM_ATOMIC_CLASSES) // room for every size even in a tiny heap
+
+typedef struct Atomic_Block {
+    int cell_size;              // 0 while the block is unused
+    uint64_t alloc;             // a bit per cell, 64 cells at most
+    uint64_t mark;
+} Atomic_Block;
+
+/* Everything one heap owns; gc_alloc_vector() and friends use default_heap */
+struct gc_heap {
+    Object ***roots;
+    int num_roots;
+    int roots_size;
+    int heap_size;
+    byte *start_of_heap;
+    byte *end_of_heap;
+    byte *freechunk;
+
+    Object **objects;
+    int num_objects;
+    int objects_size;
+    int num_live_objects;
+
+    Object **mark_stack;        // marked objects whose fields gc_mark() has yet to follow
+    int mark_stack_top;
+    int mark_stack_size;
+
+    byte *atomic_space;         // about heap_size bytes of blocks, made on first use
+    Atomic_Block *atomic_blocks;
+    int num_atomic_blocks;
+};
+
+static gc_heap *default_heap = NULL;
+
+object_metadata String_metaclass = { .name = "String", .size = sizeof(String), .num_fields = 0 };
+object_metadata Vector_metaclass = { .name = "Vector", .size = sizeof(Vector), .num_fields = 0 };
+
+static void gc_mark(gc_heap *h);
+static void gc_mark_object(gc_heap *h, Object *p);
+static void gc_clear_mark(gc_heap *h);
+static bool gc_in_heap(gc_heap *h, Object *p);
+static void *gc_alloc(gc_heap *h, int size);
+static void *gc_alloc_space(gc_heap *h, int size);
+static void *grow_array(void *array, int *size, int initial_size, size_t elem_size);
+static void *gc_alloc_atomic(gc_heap *h, int size);
+static void *gc_alloc_atomic_space(gc_heap *h, int size);
+static void make_atomic_space(gc_heap *h);
+static bool gc_in_atomic_space(gc_heap *h, Object *p);
+static void gc_mark_atomic(gc_heap *h, Object *p);
+static void gc_sweep_atomic(gc_heap *h);
 
 /*
  * Implementation:
@@ -61,45 +106,106 @@ static void *gc_alloc_space(int size);
  * 5.walk all objects again, find the fitted object and return
  * 6.If still cannot allocate, return error "memory is full"
  */
-void gc_init(int size) {
-    heap_size = size;
-    start_of_heap = malloc(size);
-    end_of_heap = start_of_heap + heap_size -1;
-    num_live_objects = 0;
-    num_roots = 0;
-    num_objects =0;
-    freechunk = start_of_heap;
+gc_heap *gc_heap_new(int size) {
+    gc_heap *h = calloc(1, sizeof(gc_heap));
+    if (h == NULL) {
+        fprintf(stderr, "gc: out of memory allocating a heap\n");
+        exit(EXIT_FAILURE);
+    }
+    h->heap_size = size;
+    h->start_of_heap = malloc(size);
+    h->end_of_heap = h->start_of_heap + h->heap_size -1;
+    h->num_live_objects = 0;
+    h->num_roots = 0;
+    h->num_objects =0;
+    h->freechunk = h->start_of_heap;
+    return h;
+}
+
+void gc_heap_free(gc_heap *h) {
+    free(h->start_of_heap);
+    free(h->roots);
+    free(h->objects);
+    free(h->mark_stack);
+    free(h->atomic_space);
+    free(h->atomic_blocks);
+    free(h);
 }
 
-Vector *gc_alloc_vector(int size) {
-    Vector *v = gc_alloc(sizeof(Vector) + size * sizeof(double)+1);
+Vector *gc_heap_alloc_vector(gc_heap *h, int size) {
+    Vector *v = gc_alloc(h, sizeof(Vector) + size * sizeof(double)+1);
+    if (v == NULL) return NULL;
     if(DEBUG)  printf("gc allocate vector @%p\n",v);
     v->header.marked = 1;
     v->header.size = size;
-    v->name = "Vector";
+    v->metadata = &Vector_metaclass;
     memset(v->data, 0, size*sizeof(double));
-    gc_add_objects(v);
+    gc_heap_add_objects(h, (Object *)v);
     return v;
 }
 
-String *gc_alloc_string(int size) {
+String *gc_heap_alloc_string(gc_heap *h, int size) {
     String *s;
-    s = (String *) gc_alloc(sizeof (String) + size + 1);
+    s = (String *) gc_alloc(h, sizeof (String) + size + 1);
+    if (s == NULL) return NULL;
     if(DEBUG)  printf("gc allocate string @%p\n",s);
     s->header.marked = 1;
     memset(s->str, 0, size);
     s->header.size = size;
-    s->name = "String";
-    gc_add_objects(s);
+    s->metadata = &String_metaclass;
+    gc_heap_add_objects(h, (Object *)s);
     return s;
 }
 
-static void *gc_alloc(int size) {
-    void *o = gc_alloc_space(size);
+/* An instance of the type metadata describes, zeroed so its pointer fields
+ * start out NULL. Its header.size is its size in bytes.
+ */
+Object *gc_heap_alloc_object(gc_heap *h, object_metadata *metadata) {
+    if (metadata->size < (int)sizeof(Object)) {
+        fprintf(stderr, "gc: %s is %d bytes, too small for an Object header\n", metadata->name, metadata->size);
+        exit(EXIT_FAILURE);
+    }
+    Object *o = gc_alloc(h, metadata->size);
+    if (o == NULL) return NULL;
+    if(DEBUG)  printf("gc allocate %s @%p\n", metadata->name, o);
+    memset(o, 0, metadata->size);
+    o->header.marked = 1;
+    o->header.size = metadata->size;
+    o->metadata = metadata;
+    gc_heap_add_objects(h, o);
+    return o;
+}
+
+/* Strings and Vectors that gc_mark() doesn't look inside, in the atomic
+ * space unless too big for a cell.
+ */
+String *gc_heap_alloc_string_atomic(gc_heap *h, int size) {
+    String *s = gc_alloc_atomic(h, sizeof (String) + size + 1);
+    if (s == NULL) return gc_heap_alloc_string(h, size);
+    s->header.marked = 1;
+    memset(s->str, 0, size);
+    s->header.size = size;
+    s->metadata = &String_metaclass;
+    return s;
+}
+
+Vector *gc_heap_alloc_vector_atomic(gc_heap *h, int size) {
+    Vector *v = gc_alloc_atomic(h, sizeof(Vector) + size * sizeof(double)+1);
+    if (v == NULL) return gc_heap_alloc_vector(h, size);
+    v->header.marked = 1;
+    v->header.size = size;
+    v->metadata = &Vector_metaclass;
+    memset(v->data, 0, size*sizeof(double));
+    return v;
+}
+
+static void *gc_alloc(gc_heap *h, int size) {
+    void *o = gc_alloc_space(h, size);
     if(NULL == o) {
-        gc_clear_mark();
-        gc_mark();
-        o = gc_alloc_space(size);
+        gc_clear_mark(h);
+        gc_mark(h);
+        gc_sweep_atomic(h);
+        o = gc_alloc_space(h, size);
         if (o == NULL) {
             if (DEBUG) printf("memory is full");
             return NULL;
@@ -108,88 +214,232 @@ static void *gc_alloc(int size) {
     return o;
 }
 
-static void *gc_alloc_space(int size) {
-    if (freechunk + size < end_of_heap) {
-        void *p = freechunk;
-        freechunk += size;
+static void *gc_alloc_space(gc_heap *h, int size) {
+    if (h->freechunk + size < h->end_of_heap) {
+        void *p = h->freechunk;
+        h->freechunk += size;
         return p;
     }
     int i;
-    for (i = 0; i < num_objects; i++) {
-        Object * o = objects[i];
+    for (i = 0; i < h->num_objects; i++) {
+        Object * o = h->objects[i];
         if (!o->header.marked && o->header.size >= size) {
             if(DEBUG) printf("release object@%p\n",o);
+            h->objects[i] = h->objects[--h->num_objects]; // caller registers it again
             return o;
         }
     }
     return NULL;
 }
 
-static void gc_mark() {
+/* Mark everything reachable from the roots. Marked objects with pointer
+ * fields go on mark_stack rather than being followed recursively, so a long
+ * list can't overflow the C stack.
+ */
+static void gc_mark(gc_heap *h) {
     int i;
-    num_live_objects = 0;
-    for (i = 0; i < num_roots; i++) {
-        if (DEBUG) printf("root[%d]=%p\n", i, _roots[i]);
-        Object *p = *_roots[i];
-        if (p != NULL) {
-            if (gc_in_heap(p)) {
-                gc_mark_object(p);
-            }
+    h->num_live_objects = 0;
+    for (i = 0; i < h->num_roots; i++) {
+        if (DEBUG) printf("root[%d]=%p\n", i, h->roots[i]);
+        gc_mark_object(h, *h->roots[i]);
+    }
+    while (h->mark_stack_top > 0) {
+        Object *p = h->mark_stack[--h->mark_stack_top];
+        object_metadata *m = p->metadata;
+        for (i = 0; i < m->num_fields; i++) {
+            gc_mark_object(h, *(Object **)((byte *)p + m->field_offsets[i]));
         }
     }
 }
 
-static void gc_mark_object(Object *p) {
-    if (!p->header.marked) {
-        if (DEBUG) printf("mark %s@%p\n", p->name, p);
-        p->header.marked = 1;
-        num_live_objects++;
+static void gc_mark_object(gc_heap *h, Object *p) {
+    if (p == NULL) return;
+    if (gc_in_atomic_space(h, p)) {
+        gc_mark_atomic(h, p);
+        return;
+    }
+    if (!gc_in_heap(h, p) || p->header.marked) return;
+    if (DEBUG) printf("mark %s@%p\n", p->metadata->name, p);
+    p->header.marked = 1;
+    h->num_live_objects++;
+    if (p->metadata->num_fields > 0) {
+        if (h->mark_stack_top >= h->mark_stack_size) {
+            h->mark_stack = grow_array(h->mark_stack, &h->mark_stack_size, MARK_STACK_INITIAL_SIZE, sizeof(Object *));
+        }
+        h->mark_stack[h->mark_stack_top++] = p;
     }
 }
 
-static void gc_clear_mark() {
+static void gc_clear_mark(gc_heap *h) {
     Object *p = NULL;
     int i;
-    for (i =0; i< num_objects; i++) {
-        p = objects[i];
+    for (i =0; i< h->num_objects; i++) {
+        p = h->objects[i];
         p->header.marked = 0;
     }
 }
 
-int gc_num_roots() {
-    return num_roots;
+int gc_heap_num_roots(gc_heap *h) {
+    return h->num_roots;
 }
 
-int gc_num_live_object() {
-    return num_live_objects;
+int gc_heap_num_live_object(gc_heap *h) {
+    return h->num_live_objects;
 }
 
-int gc_num_object() {
-    return num_objects;
+int gc_heap_num_object(gc_heap *h) {
+    return h->num_objects;
 }
 
-void gc_set_num_roots(int roots)
+void gc_heap_set_num_roots(gc_heap *h, int roots)
 {
-    num_roots = roots;
+    h->num_roots = roots;
 }
 
-static bool gc_in_heap(Object *p) {
-    return p >= (Object *) start_of_heap && p <= (Object *) end_of_heap;
+/* A cell for size bytes, collecting if the atomic space is full; NULL if
+ * it's too big for a cell or there's still no room.
+ */
+static void *gc_alloc_atomic(gc_heap *h, int size) {
+    void *p = gc_alloc_atomic_space(h, size);
+    if (p == NULL && size <= atomic_cell_sizes[NUM_ATOMIC_CLASSES-1]) {
+        gc_clear_mark(h);
+        gc_mark(h);
+        gc_sweep_atomic(h);
+        p = gc_alloc_atomic_space(h, size);
+    }
+    return p;
 }
 
-void gc_done() {
-    free(start_of_heap);
+static void *gc_alloc_atomic_space(gc_heap *h, int size) {
+    int c = 0;
+    while (c < NUM_ATOMIC_CLASSES && atomic_cell_sizes[c] < size) c++;
+    if (c == NUM_ATOMIC_CLASSES) return NULL;
+    if (h->atomic_space == NULL) make_atomic_space(h);
+    int i;
+    int unused = -1;
+    for (i = 0; i < h->num_atomic_blocks; i++) {
+        Atomic_Block *b = &h->atomic_blocks[i];
+        if (b->cell_size == 0 && unused < 0) unused = i;
+        if (b->cell_size != atomic_cell_sizes[c]) continue;
+        int num_cells = ATOMIC_BLOCK_SIZE / b->cell_size;
+        uint64_t free_cells = ~b->alloc & (num_cells == 64 ? ~0ULL : (1ULL << num_cells) - 1);
+        if (free_cells != 0) {
+            int cell = __builtin_ctzll(free_cells);
+            b->alloc |= 1ULL << cell;
+            return h->atomic_space + i * ATOMIC_BLOCK_SIZE + cell * b->cell_size;
+        }
+    }
+    if (unused < 0) return NULL;
+    Atomic_Block *b = &h->atomic_blocks[unused];
+    b->cell_size = atomic_cell_sizes[c];
+    b->alloc = 1;
+    return h->atomic_space + unused * ATOMIC_BLOCK_SIZE;
+}
+
+static void make_atomic_space(gc_heap *h) {
+    h->num_atomic_blocks = (h->heap_size + ATOMIC_BLOCK_SIZE - 1) / ATOMIC_BLOCK_SIZE;
+    if (h->num_atomic_blocks < MIN_ATOMIC_BLOCKS) h->num_atomic_blocks = MIN_ATOMIC_BLOCKS;
+    h->atomic_space = malloc(h->num_atomic_blocks * ATOMIC_BLOCK_SIZE);
+    h->atomic_blocks = calloc(h->num_atomic_blocks, sizeof(Atomic_Block));
+    if (h->atomic_space == NULL || h->atomic_blocks == NULL) {
+        fprintf(stderr, "gc: out of memory allocating %d atomic blocks\n", h->num_atomic_blocks);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static bool gc_in_atomic_space(gc_heap *h, Object *p) {
+    return h->atomic_space != NULL && (byte *)p >= h->atomic_space &&
+           (byte *)p < h->atomic_space + h->num_atomic_blocks * ATOMIC_BLOCK_SIZE;
+}
+
+static void gc_mark_atomic(gc_heap *h, Object *p) {
+    int i = ((byte *)p - h->atomic_space) / ATOMIC_BLOCK_SIZE;
+    Atomic_Block *b = &h->atomic_blocks[i];
+    uint64_t bit = 1ULL << (((byte *)p - h->atomic_space) % ATOMIC_BLOCK_SIZE / b->cell_size);
+    if (!(b->mark & bit)) {
+        if (DEBUG) printf("mark atomic@%p\n", p);
+        b->mark |= bit;
+        h->num_live_objects++;
+    }
+}
+
+/* Whatever was marked stays allocated; a block with nothing marked is free for any size */
+static void gc_sweep_atomic(gc_heap *h) {
+    int i;
+    for (i = 0; i < h->num_atomic_blocks; i++) {
+        Atomic_Block *b = &h->atomic_blocks[i];
+        b->alloc = b->mark;
+        b->mark = 0;
+        if (b->alloc == 0) b->cell_size = 0;
+    }
+}
+
+static bool gc_in_heap(gc_heap *h, Object *p) {
+    return p >= (Object *) h->start_of_heap && p <= (Object *) h->end_of_heap;
 }
 
-void gc_add_addr_of_root(Object **p)
+void gc_heap_add_addr_of_root(gc_heap *h, Object **p)
 {
-    _roots[num_roots++] = p;
+    if (h->num_roots >= h->roots_size) {
+        h->roots = grow_array(h->roots, &h->roots_size, ROOTS_INITIAL_SIZE, sizeof(Object **));
+    }
+    h->roots[h->num_roots++] = p;
+}
+
+void gc_heap_add_objects(gc_heap *h, Object *p) {
+    if (h->num_objects >= h->objects_size) {
+        h->objects = grow_array(h->objects, &h->objects_size, OBJECTS_INITIAL_SIZE, sizeof(Object *));
+    }
+    h->objects[h->num_objects++] = p;
+}
+
+/* Double the capacity of array (initial_size if empty), updating *size */
+static void *grow_array(void *array, int *size, int initial_size, size_t elem_size) {
+    int n = *size == 0 ? initial_size : *size * 2;
+    void *bigger = realloc(array, n * elem_size);
+    if (bigger == NULL) {
+        fprintf(stderr, "gc: out of memory growing internal array to %d elements\n", n);
+        exit(EXIT_FAILURE);
+    }
+    *size = n;
+    return bigger;
+}
+
+void *gc_heap_freechunk_addr(gc_heap *h) {
+    return h->freechunk;
+}
+
+// the original single heap API, on default_heap
+
+void gc_init(int size) {
+    default_heap = gc_heap_new(size);
 }
 
-void gc_add_objects(Object *p) {
-    objects[num_objects++] = p;
+void gc_done() {
+    gc_heap_free(default_heap);
+    default_heap = NULL;
 }
 
-void *get_freechunk_addr(){
-    return freechunk;
-}
\ No newline at end of file
+Vector *gc_alloc_vector(int size) { return gc_heap_alloc_vector(default_heap, size); }
+
+String *gc_alloc_string(int size) { return gc_heap_alloc_string(default_heap, size); }
+
+Object *gc_alloc_object(object_metadata *metadata) { return gc_heap_alloc_object(default_heap, metadata); }
+
+Vector *gc_alloc_vector_atomic(int size) { return gc_heap_alloc_vector_atomic(default_heap, size); }
+
+String *gc_alloc_string_atomic(int size) { return gc_heap_alloc_string_atomic(default_heap, size); }
+
+void gc_add_addr_of_root(Object **p) { gc_heap_add_addr_of_root(default_heap, p); }
+
+void gc_add_objects(Object *p) { gc_heap_add_objects(default_heap, p); }
+
+int gc_num_roots() { return gc_heap_num_roots(default_heap); }
+
+int gc_num_live_object() { return gc_heap_num_live_object(default_heap); }
+
+int gc_num_object() { return gc_heap_num_object(default_heap); }
+
+void gc_set_num_roots(int roots) { gc_heap_set_num_roots(default_heap, roots); }
+
+void *get_freechunk_addr() { return gc_heap_freechunk_addr(default_heap); }
@@ -35,28 +35,44 @@ typedef struct GC_Fields {
     int size;
 } GC_Fields;
 
+/* Describes the layout of one type of heap object; one instance per type.
+ * Marking follows the pointer fields it lists, so objects from
+ * gc_alloc_object() can point at each other and at Strings and Vectors.
+ */
+typedef struct {
+    const char *name;       // "Node"
+    int size;               // size in bytes of an instance, including the Object header
+    int num_fields;         // how many pointer fields in an instance
+    int field_offsets[];    // byte offset of each pointer field from start of object
+} object_metadata;
+
+/* Every object starts like this; a type of your own adds its fields after */
 typedef struct Object {
     GC_Fields header;
-    char *name;
+    object_metadata *metadata;
 } Object;
 
 typedef struct Vector {
     GC_Fields header;
-    char *name;
+    object_metadata *metadata;
     double data[];
 }Vector;
 
 typedef struct String {
     GC_Fields header;
-    char *name;
+    object_metadata *metadata;
     char str[];
 }String;
 
+extern object_metadata String_metaclass;
+extern object_metadata Vector_metaclass;
+
 extern void gc_init(int size);
 extern void gc_done();
 
 extern Vector *gc_alloc_vector(int size);
 extern String *gc_alloc_string(int size);
+extern Object *gc_alloc_object(object_metadata *metadata);
 extern void gc_add_addr_of_root(Object **p);
 extern void gc_add_objects(Object *p);
 extern int gc_num_roots();
@@ -65,6 +81,37 @@ extern int gc_num_object();
 extern void gc_set_num_roots(int roots);
 extern void *get_freechunk_addr();
 
+/* Like gc_alloc_string() and gc_alloc_vector(), but for ones the program
+ * will never store pointers in. They go in a separate space that marking
+ * doesn't look inside and that's swept a block of bitmaps at a time.
+ */
+extern Vector *gc_alloc_vector_atomic(int size);
+extern String *gc_alloc_string_atomic(int size);
+
 #define gc_add_root(p)		gc_add_addr_of_root((Object **)&(p));
 
+/* An independent heap. The calls above work on a default heap made by
+ * gc_init(); gc_heap_xxx(h, ...) do the same on heap h, so a program can
+ * keep several heaps, e.g. one per thread, without sharing any state.
+ */
+typedef struct gc_heap gc_heap;
+
+extern gc_heap *gc_heap_new(int size);
+extern void gc_heap_free(gc_heap *h);
+
+extern Vector *gc_heap_alloc_vector(gc_heap *h, int size);
+extern String *gc_heap_alloc_string(gc_heap *h, int size);
+extern Object *gc_heap_alloc_object(gc_heap *h, object_metadata *metadata);
+extern Vector *gc_heap_alloc_vector_atomic(gc_heap *h, int size);
+extern String *gc_heap_alloc_string_atomic(gc_heap *h, int size);
+extern void gc_heap_add_addr_of_root(gc_heap *h, Object **p);
+extern void gc_heap_add_objects(gc_heap *h, Object *p);
+extern int gc_heap_num_roots(gc_heap *h);
+extern int gc_heap_num_live_object(gc_heap *h);
+extern int gc_heap_num_object(gc_heap *h);
+extern void gc_heap_set_num_roots(gc_heap *h, int roots);
+extern void *gc_heap_freechunk_addr(gc_heap *h);
+
+#define gc_heap_add_root(h, p)	gc_heap_add_addr_of_root(h, (Object **)&(p));
+
 #endif //GC_GC_MNS_H
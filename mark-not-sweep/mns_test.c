@@ -23,6 +23,7 @@ SOFTWARE.
 */
 
 #include <stdio.h>
+#include <stddef.h>
 #include <string.h>
 #include "gc_mns.h"
 
@@ -48,7 +49,7 @@ void test_mark_then_allocate() {
 	ASSERT(1,gc_num_object());
 	String *b;
 	b = gc_alloc_string(52);
-	ASSERT(2,gc_num_object());
+	ASSERT(1,gc_num_object()); // b reuses a's dead chunk; still one object in heap
 }
 
 void test_allocate_from_free_chunk() {
@@ -70,10 +71,112 @@ void test_allocate_from_free_chunk() {
 	ASSERT(2,gc_num_roots());
 }
 
+void test_more_objects_than_old_registry_limit() {
+	gc_init(20000);
+	String *s;
+	gc_add_root(s);
+	int i;
+	for (i = 0; i < 300; i++) {
+		s = gc_alloc_string(10);
+	}
+	ASSERT(300, gc_num_object());
+	ASSERT(1, gc_num_roots());
+	gc_done();
+}
+
+void test_independent_heaps() {
+	gc_heap *h1 = gc_heap_new(120);
+	gc_heap *h2 = gc_heap_new(120);
+	String *a;
+	gc_heap_add_root(h1, a);
+	a = gc_heap_alloc_string(h1, 80);
+	gc_heap_alloc_string(h2, 80);
+	gc_heap_alloc_string(h2, 52); // reuses h2's dead string
+	ASSERT(1, gc_heap_num_object(h2));
+	ASSERT(1, gc_heap_num_object(h1));
+	gc_heap_free(h1);
+	gc_heap_free(h2);
+}
+
+void test_atomic_strings_skip_registry() {
+	gc_init(1000);
+	String *s;
+	Vector *v;
+	gc_add_root(s);
+	gc_add_root(v);
+	s = gc_alloc_string_atomic(10);
+	strcpy(s->str, "atomic");
+	String *s_addr = s;
+	v = gc_alloc_vector_atomic(3);
+	v->data[2] = 3.0;
+	ASSERT(0, gc_num_object()); // neither is in the heap
+	int i;
+	for (i = 0; i < 1000; i++) {
+		gc_alloc_string_atomic(10); // marks and sweeps a block at a time as the space fills
+	}
+	ASSERT(1, (s == s_addr));
+	ASSERT(0, strcmp(s->str, "atomic"));
+	ASSERT(3, (int)v->data[2]);
+	ASSERT(0, gc_num_object());
+	ASSERT(2, gc_num_live_object()); // as of the last mark
+	gc_done();
+}
+
+typedef struct Node {
+	GC_Fields header;
+	object_metadata *metadata;
+	struct Node *next;
+	String *label;
+} Node;
+
+object_metadata Node_metaclass = {
+	.name = "Node", .size = sizeof(Node), .num_fields = 2,
+	.field_offsets = {offsetof(Node, next), offsetof(Node, label)}
+};
+
+void test_marking_follows_pointer_fields() {
+	gc_init(400);
+	Node *head = NULL;
+	gc_add_root(head);
+	int i;
+	for (i = 0; i < 4; i++) {
+		Node *n = (Node *)gc_alloc_object(&Node_metaclass);
+		n->next = head;
+		head = n;
+		n->label = gc_alloc_string(3);
+		n->label->str[0] = 'a' + i;
+	}
+	for (i = 0; i < 30; i++) {
+		gc_alloc_object(&Node_metaclass); // garbage, reusing only other garbage once the heap fills
+	}
+	ASSERT(8, gc_num_live_object()); // only head is a root
+	Node *n = head;
+	for (i = 3; i >= 0; i--, n = n->next) {
+		ASSERT('a' + i, n->label->str[0]);
+	}
+	ASSERT(1, (n == NULL));
+	gc_done();
+}
+
+void test_alloc_too_big_returns_null() {
+	gc_init(1000);
+	ASSERT(1, (gc_alloc_string(5000) == NULL));
+	ASSERT(1, (gc_alloc_vector(1000) == NULL));
+	ASSERT(1, (gc_alloc_string_atomic(5000) == NULL));  // too big for a cell, so it tries the heap
+	ASSERT(1, (gc_alloc_vector_atomic(1000) == NULL));
+	ASSERT(1, (gc_alloc_string(3) != NULL));
+	gc_done();
+}
+
 int main(int argc, char *argv[]) {
 	TEST(test_empty);
 	TEST(test_mark_then_allocate);
 	TEST(test_allocate_from_free_chunk);
+	TEST(test_more_objects_than_old_registry_limit);
+	TEST(test_independent_heaps);
+	TEST(test_atomic_strings_skip_registry);
+	TEST(test_marking_follows_pointer_fields);
+	TEST(test_alloc_too_big_returns_null);
 	return 0;
 }
 